@@ -0,0 +1,184 @@
+"""Benchmarks of the HyperLogLog Python API.
+
+Times add(), add_many(), merge(), cardinality(), serialization and the switch
+from sparse to dense representation across precisions, key sizes and key
+distributions. Results are written as a JSON array with one object per
+measurement, in the same format as bench/bench_core.
+
+Usage: python3 bench/bench.py [--quick] [--output FILE] [--compare FILE]
+"""
+import argparse
+import json
+import pickle
+import random
+import resource
+import sys
+import time
+
+from HLL import HyperLogLog
+
+
+def peak_rss():
+    return resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+
+
+def make_keys(n, size, distribution, rng):
+    """Makes n string keys of the given size drawn from a uniform or Zipf
+    distribution. Also returns the number of distinct keys."""
+    if distribution == 'uniform':
+        ids = range(n)
+    else:
+        universe = n
+        weights = [1.0 / (i + 1) for i in range(universe)]
+        ids = rng.choices(range(universe), weights=weights, k=n)
+
+    keys = [str(i).rjust(size, 'k') for i in ids]
+    return keys, len(set(ids))
+
+
+def measure(results, name, params, ops, func, distinct=None):
+    """Runs func once and records its time per operation, the change in the
+    number of allocated memory blocks and the relative error of the estimate
+    it returns when distinct is given."""
+    blocks = sys.getallocatedblocks()
+    start = time.perf_counter_ns()
+    value = func()
+    elapsed = time.perf_counter_ns() - start
+    error = None
+
+    if distinct:
+        error = abs(value.cardinality() - distinct) / distinct
+
+    results.append({
+        'suite': 'python',
+        'name': name,
+        'params': params,
+        'ns_per_op': elapsed / ops,
+        'ops': ops,
+        'allocations': sys.getallocatedblocks() - blocks,
+        'peak_rss_kb': peak_rss(),
+        'relative_error': error,
+    })
+
+    return value
+
+
+def bench_add(results, precisions, n, rng):
+    for size in (8, 36, 256):
+        for distribution in ('uniform', 'zipf'):
+            keys, distinct = make_keys(n, size, distribution, rng)
+
+            for p in precisions:
+                for sparse in (True, False):
+                    params = {'p': p, 'sparse': sparse, 'key_bytes': size, 'distribution': distribution}
+
+                    def add():
+                        hll = HyperLogLog(p, sparse=sparse)
+                        for key in keys:
+                            hll.add(key)
+                        return hll
+
+                    def add_many():
+                        hll = HyperLogLog(p, sparse=sparse)
+                        hll.add_many(keys)
+                        return hll
+
+                    measure(results, 'add', params, n, add, distinct)
+                    measure(results, 'add_many', params, n, add_many, distinct)
+
+
+def bench_transition(results, precisions):
+    for p in precisions:
+        hll = HyperLogLog(p)
+        n = 0
+        start = time.perf_counter_ns()
+
+        while hll._get_meta()['is_sparse']:
+            hll.add_many([str(n + i) for i in range(64)])
+            n += 64
+
+        results.append({
+            'suite': 'python',
+            'name': 'sparse_to_dense',
+            'params': {'p': p, 'elements': n},
+            'ns_per_op': (time.perf_counter_ns() - start) / n,
+            'ops': n,
+            'allocations': None,
+            'peak_rss_kb': peak_rss(),
+            'relative_error': abs(hll.cardinality() - n) / n,
+        })
+
+
+def bench_sketch(results, precisions, reps):
+    for p in precisions:
+        for sparse in (True, False):
+            a = HyperLogLog(p, sparse=sparse)
+            b = HyperLogLog(p, sparse=sparse)
+            a.add_many([str(i) for i in range(2 ** p // 8)])
+            b.add_many([str(-i) for i in range(2 ** p // 8)])
+            params = {'p': p, 'sparse': bool(a._get_meta()['is_sparse'])}
+
+            def merge():
+                for _ in range(reps):
+                    a.merge(b)
+
+            def cardinality():
+                for _ in range(reps):
+                    a.add('x')  # Invalidate the cached estimate
+                    a.cardinality()
+
+            def serialize():
+                for _ in range(reps):
+                    HyperLogLog.from_bytes(a.to_bytes())
+
+            def pickling():
+                for _ in range(reps):
+                    pickle.loads(pickle.dumps(a))
+
+            measure(results, 'merge', params, reps, merge)
+            measure(results, 'cardinality', params, reps, cardinality)
+            measure(results, 'serialize', params, reps, serialize)
+            measure(results, 'pickle', params, reps, pickling)
+
+
+def compare(results, path):
+    """Prints the ratio of each time to the time of the same measurement in a
+    previous run."""
+    with open(path) as f:
+        baseline = {(r['suite'], r['name'], json.dumps(r['params'], sort_keys=True)): r for r in json.load(f)}
+
+    for r in results:
+        old = baseline.get((r['suite'], r['name'], json.dumps(r['params'], sort_keys=True)))
+        if old and old['ns_per_op']:
+            print('%-16s %-90s %6.2fx' % (r['name'], json.dumps(r['params']), r['ns_per_op'] / old['ns_per_op']),
+                  file=sys.stderr)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('--quick', action='store_true', help='use fewer precisions and elements')
+    parser.add_argument('--output', help='write the results to a file instead of stdout')
+    parser.add_argument('--compare', help='print time ratios against the results in a previous output file')
+    args = parser.parse_args()
+
+    rng = random.Random(314)
+    precisions = [4, 10, 14] if args.quick else list(range(4, 21, 2))
+    results = []
+
+    bench_add(results, precisions, 20000 if args.quick else 200000, rng)
+    bench_transition(results, precisions)
+    bench_sketch(results, precisions, 20 if args.quick else 200)
+
+    output = json.dumps(results, indent=1)
+    if args.output:
+        with open(args.output, 'w') as f:
+            f.write(output + '\n')
+    else:
+        print(output)
+
+    if args.compare:
+        compare(results, args.compare)
+
+
+if __name__ == '__main__':
+    main()
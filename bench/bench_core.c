@@ -0,0 +1,446 @@
+/*
+ * Microbenchmarks of the C core
+ * -----------------------------
+ *
+ * Times the register, merge, estimation and serialization routines of
+ * src/hll.c without the overhead of calling them from Python. hll.c is
+ * included directly so its static functions can be called. The interpreter
+ * is initialized only so that HyperLogLog objects can be created with their
+ * usual constructor, the timed routines don't call into Python except for
+ * serialization.
+ *
+ * Allocations made by hll.c are counted by redirecting malloc(), calloc() and
+ * realloc(). Results are written to stdout as a JSON array with one object per
+ * measurement, in the same format as bench/bench.py.
+ *
+ * Usage: bench_core [--quick]
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "structmember.h"
+
+static uint64_t allocations = 0; /* Number of allocations made by hll.c */
+
+static void* countedMalloc(size_t n) { allocations++; return malloc(n); }
+static void* countedCalloc(size_t n, size_t size) { allocations++; return calloc(n, size); }
+static void* countedRealloc(void* p, size_t n) { allocations++; return realloc(p, n); }
+
+#define malloc(n) countedMalloc(n)
+#define calloc(n, size) countedCalloc(n, size)
+#define realloc(p, n) countedRealloc(p, n)
+#include "../src/hll.c"
+#undef malloc
+#undef calloc
+#undef realloc
+
+static bool quick = false;
+static bool first = true;
+
+
+/* Gets a monotonic time in nanoseconds. */
+static uint64_t now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+
+/* Generates well distributed 64 bit values. */
+static uint64_t splitmix64(uint64_t* state)
+{
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30))*0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27))*0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+
+/* Gets the peak resident set size of the process in KiB. */
+static long peakRss(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+
+/* Writes one measurement. params is a JSON object body such as "\"p\": 12". A
+ * negative error is written as null. */
+static void report(const char* name, const char* params, double nsPerOp, uint64_t ops, uint64_t allocs, double error)
+{
+    printf("%s\n  {\"suite\": \"core\", \"name\": \"%s\", \"params\": {%s}, \"ns_per_op\": %.3f, \"ops\": %llu, "
+           "\"allocations\": %llu, \"peak_rss_kb\": %ld, \"relative_error\": ",
+           first ? "[" : ",", name, params, nsPerOp, (unsigned long long)ops, (unsigned long long)allocs, peakRss());
+
+    if (error < 0) {
+        printf("null}");
+    } else {
+        printf("%.6f}", error);
+    }
+
+    first = false;
+    fflush(stdout);
+}
+
+
+/* Creates a HyperLogLog using the Python constructor. Sizes of 0 use the
+ * defaults. */
+static HyperLogLog* create(int p, bool sparse, const char* layout, uint64_t maxList, uint64_t maxBuffer)
+{
+    PyObject* args = Py_BuildValue("(iii)", p, 314, sparse);
+    PyObject* kwds = Py_BuildValue("{s:s,s:K,s:K}", "layout", layout,
+                                   "max_sparse_list_size", (unsigned long long)maxList,
+                                   "max_sparse_buffer_size", (unsigned long long)maxBuffer);
+    PyObject* hll = PyObject_Call((PyObject*)&HyperLogLogType, args, kwds);
+
+    Py_DECREF(args);
+    Py_DECREF(kwds);
+
+    if (hll == NULL) {
+        PyErr_Print();
+        exit(1);
+    }
+
+    return (HyperLogLog*)hll;
+}
+
+
+/* Gets the cardinality estimate of a HyperLogLog. */
+static uint64_t estimate(HyperLogLog* hll)
+{
+    PyObject* result;
+    uint64_t value;
+
+    hll->isCached = 0;
+    result = HyperLogLog_cardinality(hll);
+    value = PyLong_AsUnsignedLongLong(result);
+    Py_DECREF(result);
+
+    return value;
+}
+
+
+static void benchHash(void)
+{
+    static const size_t sizes[] = {8, 16, 36, 64, 256, 1024};
+    static const uint8_t kinds[] = {HASH_MURMUR64A, HASH_XXH3, HASH_WYHASH};
+    uint64_t n = quick ? 200000 : 2000000;
+    uint8_t* data = (uint8_t*)malloc(1024 + 4096);
+    uint64_t state = 1;
+    char params[128];
+
+    for (size_t i = 0; i < 1024 + 4096; i++) {
+        data[i] = (uint8_t)splitmix64(&state);
+    }
+
+    for (size_t k = 0; k < sizeof(kinds); k++) {
+        for (size_t s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++) {
+            uint64_t sink = 0;
+            uint64_t start = now();
+
+            for (uint64_t i = 0; i < n; i++) { /* Vary the offset so keys differ and are unaligned */
+                sink += hashElement(data + (i & 4095), sizes[s], 314, kinds[k]);
+            }
+
+            double ns = (double)(now() - start)/n;
+            snprintf(params, sizeof(params), "\"hash\": \"%s\", \"key_bytes\": %zu, \"sink\": %llu",
+                     hashName(kinds[k]), sizes[s], (unsigned long long)(sink & 1));
+            report("hash", params, ns, n, 0, -1);
+        }
+    }
+
+    free(data);
+}
+
+
+static void benchAdd(int minP, int maxP)
+{
+    static const char* layouts[] = {"u6", "u8", "u4"};
+    uint64_t n = quick ? 100000 : 1000000;
+    uint64_t* hashes = (uint64_t*)malloc(n*sizeof(uint64_t));
+    uint64_t state = 2;
+    char params[128];
+
+    for (uint64_t i = 0; i < n; i++) {
+        hashes[i] = splitmix64(&state);
+    }
+
+    for (int p = minP; p <= maxP; p++) {
+        for (int sparse = 1; sparse >= 0; sparse--) {
+            for (int l = 0; l < (sparse ? 1 : 3); l++) {
+                HyperLogLog* hll = create(p, sparse, layouts[l], 0, 0);
+                uint64_t allocs = allocations;
+                uint64_t start = now();
+
+                for (uint64_t i = 0; i < n; i++) {
+                    addHash(hll, hashes[i]);
+                }
+
+                double ns = (double)(now() - start)/n;
+                allocs = allocations - allocs;
+                double error = fabs((double)estimate(hll) - n)/n;
+
+                snprintf(params, sizeof(params), "\"p\": %d, \"sparse\": %s, \"layout\": \"%s\"",
+                         p, sparse ? "true" : "false", layouts[l]);
+                report("add", params, ns, n, allocs, error);
+                Py_DECREF(hll);
+            }
+        }
+    }
+
+    free(hashes);
+}
+
+
+/* Adds elements to sparse HyperLogLogs with different buffer and list sizes,
+ * without reaching dense representation. */
+static void benchSparse(void)
+{
+    static const uint64_t buffers[] = {16, 256, 4096, 65536};
+    static const uint64_t lists[] = {1 << 12, 1 << 16, 1 << 20};
+    int p = 18;
+    uint64_t state = 3;
+    char params[128];
+
+    for (size_t b = 0; b < sizeof(buffers)/sizeof(buffers[0]); b++) {
+        for (size_t l = 0; l < sizeof(lists)/sizeof(lists[0]); l++) {
+            HyperLogLog* hll = create(p, 1, "u6", lists[l], buffers[b]);
+            uint64_t allocs = allocations;
+            uint64_t n = 0;
+            uint64_t start = now();
+
+            while (hll->isSparse && n < (quick ? 20000 : 200000)) {
+                addHash(hll, splitmix64(&state));
+                n++;
+            }
+
+            double ns = (double)(now() - start)/n;
+            allocs = allocations - allocs;
+            double error = fabs((double)estimate(hll) - n)/n;
+
+            snprintf(params, sizeof(params), "\"p\": %d, \"max_sparse_buffer_size\": %llu, \"max_sparse_list_size\": %llu",
+                     p, (unsigned long long)buffers[b], (unsigned long long)lists[l]);
+            report("add_sparse", params, ns, n, allocs, error);
+            Py_DECREF(hll);
+        }
+    }
+}
+
+
+/* Times the adds that flush a full buffer into the sparse list and the add
+ * that switches to dense representation. */
+static void benchTransition(int minP, int maxP)
+{
+    uint64_t state = 4;
+    char params[128];
+
+    for (int p = minP; p <= maxP; p++) {
+        HyperLogLog* hll = create(p, 1, "u6", 0, 0);
+        uint64_t flushTime = 0;
+        uint64_t flushes = 0;
+        uint64_t denseTime = 0;
+        uint64_t denseAllocs = 0;
+        uint64_t n = 0;
+
+        while (hll->isSparse) {
+            uint64_t hash = splitmix64(&state);
+            bool willFlush = hll->bufferSize >= hll->maxBufferSize;
+            uint64_t allocs = allocations;
+            uint64_t start = now();
+
+            addHash(hll, hash);
+
+            uint64_t elapsed = now() - start;
+            n++;
+
+            if (!hll->isSparse) {
+                denseTime = elapsed;
+                denseAllocs = allocations - allocs;
+            } else if (willFlush) {
+                flushTime += elapsed;
+                flushes++;
+            }
+        }
+
+        snprintf(params, sizeof(params), "\"p\": %d, \"elements\": %llu", p, (unsigned long long)n);
+        report("flush", params, flushes ? (double)flushTime/flushes : 0, flushes, 0, -1);
+        report("to_dense", params, (double)denseTime, 1, denseAllocs, fabs((double)estimate(hll) - n)/n);
+        Py_DECREF(hll);
+    }
+}
+
+
+static void benchMerge(int minP, int maxP)
+{
+    uint64_t state = 5;
+    char params[128];
+
+    for (int p = minP; p <= maxP; p++) {
+        uint64_t size = 1ULL << p;
+        uint64_t reps = quick ? 20 : (1ULL << 24) >> p;
+
+        for (int unpacked = 0; unpacked < 2; unpacked++) {
+            uint64_t bytes = denseBytes(size, unpacked);
+            uint8_t* dst = (uint8_t*)calloc(bytes + 1, 1) + 1; /* Registers may read the byte before */
+            uint8_t* src = (uint8_t*)calloc(bytes + 1, 1) + 1;
+
+            for (uint64_t i = 0; i < size; i++) {
+                setRegisterIn(dst, unpacked, i, splitmix64(&state) % 20);
+                setRegisterIn(src, unpacked, i, splitmix64(&state) % 20);
+            }
+
+            if (reps == 0) reps = 1;
+
+            uint64_t start = now();
+
+            for (uint64_t r = 0; r < reps; r++) {
+                maxRegisters(dst, unpacked, src, unpacked, size);
+                src[r % bytes] ^= 1; /* Keep the compiler from hoisting the merge */
+            }
+
+            snprintf(params, sizeof(params), "\"p\": %d, \"layout\": \"%s\"", p, unpacked ? "u8" : "u6");
+            report("merge", params, (double)(now() - start)/reps, reps, 0, -1);
+
+            free(dst - 1);
+            free(src - 1);
+        }
+    }
+}
+
+
+static void benchCardinality(int minP, int maxP)
+{
+    uint64_t state = 6;
+    char params[128];
+
+    for (int p = minP; p <= maxP; p++) {
+        for (int sparse = 1; sparse >= 0; sparse--) {
+            HyperLogLog* hll = create(p, sparse, "u6", 0, 0);
+            uint64_t n = (1ULL << p)/(sparse ? 16 : 1) + 1; /* Sparse HyperLogLogs keep pending registers */
+            uint64_t reps = quick ? 20 : 2000;
+            uint64_t sink = 0;
+
+            for (uint64_t i = 0; i < n; i++) {
+                addHash(hll, splitmix64(&state));
+            }
+
+            uint64_t allocs = allocations;
+            uint64_t start = now();
+
+            for (uint64_t r = 0; r < reps; r++) {
+                sink += estimate(hll);
+            }
+
+            double ns = (double)(now() - start)/reps;
+            snprintf(params, sizeof(params), "\"p\": %d, \"sparse\": %s", p, hll->isSparse ? "true" : "false");
+            report("cardinality", params, ns, reps, allocations - allocs, fabs((double)sink/reps - n)/n);
+            Py_DECREF(hll);
+        }
+    }
+}
+
+
+static void benchSerialization(int minP, int maxP)
+{
+    uint64_t state = 7;
+    char params[128];
+
+    for (int p = minP; p <= maxP; p++) {
+        for (int sparse = 1; sparse >= 0; sparse--) {
+            HyperLogLog* hll = create(p, sparse, "u6", 0, 0);
+            uint64_t reps = quick ? 20 : 500;
+            uint64_t n = (1ULL << p)/4;
+
+            for (uint64_t i = 0; i < n; i++) {
+                addHash(hll, splitmix64(&state));
+            }
+
+            uint64_t allocs = allocations;
+            uint64_t start = now();
+            PyObject* bytes = NULL;
+
+            for (uint64_t r = 0; r < reps; r++) {
+                Py_XDECREF(bytes);
+                bytes = HyperLogLog_to_bytes(hll);
+            }
+
+            snprintf(params, sizeof(params), "\"p\": %d, \"sparse\": %s, \"bytes\": %zd",
+                     p, hll->isSparse ? "true" : "false", PyBytes_GET_SIZE(bytes));
+            report("to_bytes", params, (double)(now() - start)/reps, reps, (allocations - allocs)/reps, -1);
+
+            PyObject* args = PyTuple_Pack(1, bytes);
+            allocs = allocations;
+            start = now();
+
+            for (uint64_t r = 0; r < reps; r++) {
+                Py_DECREF(HyperLogLog_from_bytes(&HyperLogLogType, args, NULL));
+            }
+
+            report("from_bytes", params, (double)(now() - start)/reps, reps, (allocations - allocs)/reps, -1);
+
+            Py_DECREF(args);
+            Py_DECREF(bytes);
+            Py_DECREF(hll);
+        }
+    }
+}
+
+
+int main(int argc, char** argv)
+{
+    int minP = 4;
+    int maxP = 20;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--quick") == 0) {
+            quick = true;
+            maxP = 14;
+        } else {
+            fprintf(stderr, "usage: %s [--quick]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    Py_Initialize();
+
+    if (PyType_Ready(&HyperLogLogType) < 0) {
+        PyErr_Print();
+        return 1;
+    }
+
+    benchHash();
+    benchAdd(minP, maxP);
+    benchSparse();
+    benchTransition(minP, maxP);
+    benchMerge(minP, maxP);
+    benchCardinality(minP, maxP);
+    benchSerialization(minP, maxP);
+
+    printf("\n]\n");
+    Py_Finalize();
+
+    return 0;
+}
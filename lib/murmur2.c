@@ -2,32 +2,33 @@
 // MurmurHash2 was written by Austin Appleby, and is placed in the public
 // domain. The author hereby disclaims copyright to the MurmurHash2 source code.
 
-// Note - This code makes a few assumptions about how your machine behaves -
+// Note - Input is read using memcpy() so it does not need to be aligned.
 
-// 1. We can read a 4-byte value from any address without crashing
-// 2. sizeof(int) == 4
-
-// And it has a few limitations -
+// This code has a few limitations -
 
 // 1. It will not work incrementally.
 // 2. It will not produce the same results on little-endian and big-endian
 //    machines.
 
+#include <string.h>
+
 #include "murmur2.h"
 
-uint64_t MurmurHash64A ( const void * key, int len, uint64_t seed )
+uint64_t MurmurHash64A ( const void * key, size_t len, uint64_t seed )
 {
   const uint64_t m = 0xc6a4a7935bd1e995;
   const int r = 47;
 
   uint64_t h = seed ^ (len * m);
 
-  const uint64_t * data = (const uint64_t *)key;
-  const uint64_t * end = data + (len/8);
+  const unsigned char * data = (const unsigned char *)key;
+  const unsigned char * end = data + (len/8)*8;
 
   while(data != end)
   {
-    uint64_t k = *data++;
+    uint64_t k;
+    memcpy(&k, data, sizeof(k));
+    data += 8;
 
     k *= m;
     k ^= k >> r;
@@ -37,7 +38,7 @@ uint64_t MurmurHash64A ( const void * key, int len, uint64_t seed )
     h *= m;
   }
 
-  const unsigned char * data2 = (const unsigned char*)data;
+  const unsigned char * data2 = data;
 
   switch(len & 7)
   {
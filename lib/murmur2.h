@@ -24,9 +24,11 @@ typedef unsigned __int64 uint64_t;
 
 #endif // !defined(_MSC_VER)
 
+#include <stddef.h>
+
 //-----------------------------------------------------------------------------
 
-uint64_t MurmurHash64A      ( const void * key, int len, uint64_t seed );
+uint64_t MurmurHash64A      ( const void * key, size_t len, uint64_t seed );
 
 //-----------------------------------------------------------------------------
 
@@ -0,0 +1,18 @@
+//-----------------------------------------------------------------------------
+// wyhash was written by Wang Yi and is released into the public domain.
+// This is a portable implementation of the final version 4 of wyhash using
+// the default secret.
+
+#ifndef _WYHASH_H_
+#define _WYHASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+//-----------------------------------------------------------------------------
+
+uint64_t wyhash ( const void * key, size_t len, uint64_t seed );
+
+//-----------------------------------------------------------------------------
+
+#endif // _WYHASH_H_
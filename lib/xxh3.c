@@ -0,0 +1,321 @@
+//-----------------------------------------------------------------------------
+// XXH3 was written by Yann Collet and is released under the BSD 2-Clause
+// License:
+//
+// Copyright (C) 2019-2021 Yann Collet
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//    * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//    * Redistributions in binary form must reproduce the above
+//      copyright notice, this list of conditions and the following disclaimer
+//      in the documentation and/or other materials provided with the
+//      distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// This is a portable (scalar) implementation of XXH3_64bits_withSeed() which
+// produces the same hashes as the reference implementation on little-endian
+// machines. Unaligned input is read using memcpy().
+
+#include <string.h>
+
+#include "xxh3.h"
+
+#define PRIME32_1 0x9E3779B1U
+#define PRIME32_2 0x85EBCA77U
+#define PRIME32_3 0xC2B2AE3DU
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+#define SECRET_SIZE 192
+#define STRIPE_LEN 64
+#define SECRET_CONSUME_RATE 8
+#define ACC_NB 8
+#define MIDSIZE_MAX 240
+#define MIDSIZE_STARTOFFSET 3
+#define MIDSIZE_LASTOFFSET 17
+#define SECRET_SIZE_MIN 136
+#define SECRET_LASTACC_START 7
+#define SECRET_MERGEACCS_START 11
+
+static const uint8_t kSecret[SECRET_SIZE] = {
+  0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+  0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+  0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+  0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+  0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+  0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+  0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+  0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+  0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+  0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+  0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+  0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+//-----------------------------------------------------------------------------
+// Helpers
+
+static inline uint32_t readLE32 ( const uint8_t * p )
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint64_t readLE64 ( const uint8_t * p )
+{
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline void writeLE64 ( uint8_t * p, uint64_t v )
+{
+  memcpy(p, &v, sizeof(v));
+}
+
+static inline uint64_t rotl64 ( uint64_t x, int r )
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint32_t swap32 ( uint32_t x )
+{
+  return ((x << 24) & 0xff000000) | ((x << 8) & 0x00ff0000) |
+         ((x >> 8) & 0x0000ff00) | ((x >> 24) & 0x000000ff);
+}
+
+static inline uint64_t swap64 ( uint64_t x )
+{
+  return ((uint64_t)swap32((uint32_t)x) << 32) | swap32((uint32_t)(x >> 32));
+}
+
+static inline uint64_t mul128_fold64 ( uint64_t lhs, uint64_t rhs )
+{
+#if defined(__SIZEOF_INT128__)
+  __uint128_t product = (__uint128_t)lhs * rhs;
+  return (uint64_t)product ^ (uint64_t)(product >> 64);
+#else
+  uint64_t lo_lo = (lhs & 0xFFFFFFFF) * (rhs & 0xFFFFFFFF);
+  uint64_t hi_lo = (lhs >> 32) * (rhs & 0xFFFFFFFF);
+  uint64_t lo_hi = (lhs & 0xFFFFFFFF) * (rhs >> 32);
+  uint64_t hi_hi = (lhs >> 32) * (rhs >> 32);
+  uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xFFFFFFFF) + lo_hi;
+  uint64_t upper = (hi_lo >> 32) + (cross >> 32) + hi_hi;
+  uint64_t lower = (cross << 32) | (lo_lo & 0xFFFFFFFF);
+  return lower ^ upper;
+#endif
+}
+
+static inline uint64_t XXH64_avalanche ( uint64_t h )
+{
+  h ^= h >> 33;
+  h *= PRIME64_2;
+  h ^= h >> 29;
+  h *= PRIME64_3;
+  h ^= h >> 32;
+  return h;
+}
+
+static inline uint64_t XXH3_avalanche ( uint64_t h )
+{
+  h ^= h >> 37;
+  h *= 0x165667919E3779F9ULL;
+  h ^= h >> 32;
+  return h;
+}
+
+static inline uint64_t XXH3_rrmxmx ( uint64_t h, uint64_t len )
+{
+  h ^= rotl64(h, 49) ^ rotl64(h, 24);
+  h *= 0x9FB21C651E98DF25ULL;
+  h ^= (h >> 35) + len;
+  h *= 0x9FB21C651E98DF25ULL;
+  h ^= h >> 28;
+  return h;
+}
+
+static inline uint64_t mix16B ( const uint8_t * input, const uint8_t * secret, uint64_t seed )
+{
+  return mul128_fold64(readLE64(input) ^ (readLE64(secret) + seed),
+                       readLE64(input + 8) ^ (readLE64(secret + 8) - seed));
+}
+
+//-----------------------------------------------------------------------------
+// Short inputs
+
+static uint64_t len_0to16 ( const uint8_t * input, size_t len, const uint8_t * secret, uint64_t seed )
+{
+  if (len > 8) {
+    uint64_t bitflip1 = (readLE64(secret + 24) ^ readLE64(secret + 32)) + seed;
+    uint64_t bitflip2 = (readLE64(secret + 40) ^ readLE64(secret + 48)) - seed;
+    uint64_t input_lo = readLE64(input) ^ bitflip1;
+    uint64_t input_hi = readLE64(input + len - 8) ^ bitflip2;
+    uint64_t acc = len + swap64(input_lo) + input_hi + mul128_fold64(input_lo, input_hi);
+    return XXH3_avalanche(acc);
+  }
+
+  if (len >= 4) {
+    uint64_t s = seed ^ ((uint64_t)swap32((uint32_t)seed) << 32);
+    uint32_t input1 = readLE32(input);
+    uint32_t input2 = readLE32(input + len - 4);
+    uint64_t bitflip = (readLE64(secret + 8) ^ readLE64(secret + 16)) - s;
+    uint64_t input64 = input2 + ((uint64_t)input1 << 32);
+    return XXH3_rrmxmx(input64 ^ bitflip, len);
+  }
+
+  if (len > 0) {
+    uint8_t c1 = input[0];
+    uint8_t c2 = input[len >> 1];
+    uint8_t c3 = input[len - 1];
+    uint32_t combined = ((uint32_t)c1 << 16) | ((uint32_t)c2 << 24) | ((uint32_t)c3 << 0) | ((uint32_t)len << 8);
+    uint64_t bitflip = (readLE32(secret) ^ readLE32(secret + 4)) + seed;
+    return XXH64_avalanche((uint64_t)combined ^ bitflip);
+  }
+
+  return XXH64_avalanche(seed ^ (readLE64(secret + 56) ^ readLE64(secret + 64)));
+}
+
+static uint64_t len_17to128 ( const uint8_t * input, size_t len, const uint8_t * secret, uint64_t seed )
+{
+  uint64_t acc = len * PRIME64_1;
+
+  if (len > 32) {
+    if (len > 64) {
+      if (len > 96) {
+        acc += mix16B(input + 48, secret + 96, seed);
+        acc += mix16B(input + len - 64, secret + 112, seed);
+      }
+      acc += mix16B(input + 32, secret + 64, seed);
+      acc += mix16B(input + len - 48, secret + 80, seed);
+    }
+    acc += mix16B(input + 16, secret + 32, seed);
+    acc += mix16B(input + len - 32, secret + 48, seed);
+  }
+
+  acc += mix16B(input + 0, secret + 0, seed);
+  acc += mix16B(input + len - 16, secret + 16, seed);
+
+  return XXH3_avalanche(acc);
+}
+
+static uint64_t len_129to240 ( const uint8_t * input, size_t len, const uint8_t * secret, uint64_t seed )
+{
+  uint64_t acc = len * PRIME64_1;
+  int nbRounds = (int)len / 16;
+  int i;
+
+  for (i = 0; i < 8; i++) {
+    acc += mix16B(input + 16*i, secret + 16*i, seed);
+  }
+
+  acc = XXH3_avalanche(acc);
+
+  for (i = 8; i < nbRounds; i++) {
+    acc += mix16B(input + 16*i, secret + 16*(i - 8) + MIDSIZE_STARTOFFSET, seed);
+  }
+
+  acc += mix16B(input + len - 16, secret + SECRET_SIZE_MIN - MIDSIZE_LASTOFFSET, seed);
+
+  return XXH3_avalanche(acc);
+}
+
+//-----------------------------------------------------------------------------
+// Long inputs
+
+static inline void accumulate_512 ( uint64_t * acc, const uint8_t * input, const uint8_t * secret )
+{
+  for (int i = 0; i < ACC_NB; i++) {
+    uint64_t data_val = readLE64(input + 8*i);
+    uint64_t data_key = data_val ^ readLE64(secret + 8*i);
+    acc[i ^ 1] += data_val;
+    acc[i] += (data_key & 0xFFFFFFFF) * (data_key >> 32);
+  }
+}
+
+static inline void scramble ( uint64_t * acc, const uint8_t * secret )
+{
+  for (int i = 0; i < ACC_NB; i++) {
+    uint64_t a = acc[i];
+    a ^= a >> 47;
+    a ^= readLE64(secret + 8*i);
+    a *= PRIME32_1;
+    acc[i] = a;
+  }
+}
+
+static uint64_t hashLong ( const uint8_t * input, size_t len, const uint8_t * secret )
+{
+  uint64_t acc[ACC_NB] = { PRIME32_3, PRIME64_1, PRIME64_2, PRIME64_3, PRIME64_4, PRIME32_2, PRIME64_5, PRIME32_1 };
+  size_t nbStripesPerBlock = (SECRET_SIZE - STRIPE_LEN) / SECRET_CONSUME_RATE;
+  size_t blockLen = STRIPE_LEN * nbStripesPerBlock;
+  size_t nbBlocks = (len - 1) / blockLen;
+  size_t nbStripes;
+  size_t n, s;
+  uint64_t result;
+
+  for (n = 0; n < nbBlocks; n++) {
+    for (s = 0; s < nbStripesPerBlock; s++) {
+      accumulate_512(acc, input + n*blockLen + s*STRIPE_LEN, secret + s*SECRET_CONSUME_RATE);
+    }
+    scramble(acc, secret + SECRET_SIZE - STRIPE_LEN);
+  }
+
+  nbStripes = ((len - 1) - blockLen*nbBlocks) / STRIPE_LEN;
+
+  for (s = 0; s < nbStripes; s++) {
+    accumulate_512(acc, input + nbBlocks*blockLen + s*STRIPE_LEN, secret + s*SECRET_CONSUME_RATE);
+  }
+
+  accumulate_512(acc, input + len - STRIPE_LEN, secret + SECRET_SIZE - STRIPE_LEN - SECRET_LASTACC_START);
+
+  result = len * PRIME64_1;
+
+  for (int i = 0; i < 4; i++) {
+    const uint8_t * key = secret + SECRET_MERGEACCS_START + 16*i;
+    result += mul128_fold64(acc[2*i] ^ readLE64(key), acc[2*i + 1] ^ readLE64(key + 8));
+  }
+
+  return XXH3_avalanche(result);
+}
+
+//-----------------------------------------------------------------------------
+
+uint64_t XXH3_64bits_withSeed ( const void * key, size_t len, uint64_t seed )
+{
+  const uint8_t * input = (const uint8_t *)key;
+
+  if (len <= 16) return len_0to16(input, len, kSecret, seed);
+  if (len <= 128) return len_17to128(input, len, kSecret, seed);
+  if (len <= MIDSIZE_MAX) return len_129to240(input, len, kSecret, seed);
+
+  if (seed == 0) return hashLong(input, len, kSecret);
+
+  // Long inputs use a secret derived from the seed
+  uint8_t secret[SECRET_SIZE];
+
+  for (int i = 0; i < SECRET_SIZE / 16; i++) {
+    writeLE64(secret + 16*i, readLE64(kSecret + 16*i) + seed);
+    writeLE64(secret + 16*i + 8, readLE64(kSecret + 16*i + 8) - seed);
+  }
+
+  return hashLong(input, len, secret);
+}
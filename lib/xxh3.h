@@ -0,0 +1,17 @@
+//-----------------------------------------------------------------------------
+// XXH3 was written by Yann Collet and is released under the BSD 2-Clause
+// License. This is a portable implementation of the 64 bit variant.
+
+#ifndef _XXH3_H_
+#define _XXH3_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+//-----------------------------------------------------------------------------
+
+uint64_t XXH3_64bits_withSeed ( const void * key, size_t len, uint64_t seed );
+
+//-----------------------------------------------------------------------------
+
+#endif // _XXH3_H_
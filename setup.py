@@ -6,7 +6,7 @@ readme = (here/"README.md").read_text()
 
 module = Extension(
     'HLL',
-    sources=['src/hll.c', 'lib/murmur2.c'],
+    sources=['src/hll.c', 'src/libhll.c', 'lib/murmur2.c', 'lib/wyhash.c', 'lib/xxh3.c'],
     include_dirs=['src', 'lib']
 )
 
@@ -1,1046 +1,5681 @@
 #define PY_SSIZE_T_CLEAN
 #define HLL_VERSION "2.3.0"
-
+#define ADD_MANY_CHUNK_SIZE 4096 /* Elements collected per GIL release */
+#define ADD_MANY_THREAD_CHUNK_SIZE 65536 /* Elements per worker thread per GIL release */
+#define ADD_FILE_READ_SIZE (1 << 22) /* Bytes read at a time per worker thread by add_file() */
+#define LAYOUT_U6 0 /* Dense registers use 6 bits each */
+#define LAYOUT_U8 1 /* Dense registers use one byte each */
+#define LAYOUT_U4 2 /* Dense registers use 4 bits each relative to the minimum register */
+
+#include <errno.h>
 #include <math.h>
 #include <Python.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 #include "hll.h"
 #include "structmember.h"
-#include "../lib/murmur2.h"
+
+void printByte(uint8_t b);
+uint8_t isValidIndex(uint64_t index, uint64_t size);
 
 typedef struct {
     PyObject_HEAD
     uint8_t* registers; /* Densely encoded registers */
     unsigned short p; /* 2^p = number of registers */
     uint64_t * histogram; /* Register histogram */
-    uint64_t seed; /* MurmurHash64A seed */
+    uint64_t seed; /* Hash function seed */
+    uint8_t hashKind; /* Hash function and how hashes select registers, see HASH_MURMUR64A */
     uint64_t size; /* Number of registers */
     uint64_t cache; /* Cached cardinality estimate */
     uint64_t added; /* Number of elements added */
     bool isCached; /* If the cache is up to date */
     bool isSparse; /* If sparse encoding is currently in use */
+    uint8_t layout; /* Layout of dense registers, LAYOUT_U6, LAYOUT_U8 or LAYOUT_U4 */
+    bool isConcurrent; /* If registers are updated atomically and the histogram is counted on demand */
+    uint8_t curMin; /* Value all 4 bit registers are relative to */
+    struct AuxEntry* auxTable; /* Hash table of 4 bit registers that overflowed */
+    uint64_t auxCapacity; /* Number of slots in the table, a power of 2 */
+    uint64_t auxCount; /* Number of registers in the table */
+    bool isMapped; /* If the registers and histogram live in a mapped file */
+    bool isReadOnly; /* If the mapped file was opened read-only */
+    uint64_t busy; /* Number of running updates which released the GIL, see beginUpdate() */
+    uint64_t exports; /* Number of buffers exported by HyperLogLog_getbuffer() */
+    bool useHip; /* If the HIP estimator is enabled */
+    bool isHipValid; /* If every register update has been seen by the HIP estimator */
+    double hipEstimate; /* HIP cardinality estimate */
+    double hipProbability; /* Probability the next new element updates a register */
+    uint8_t* mapping; /* Start of the mapped file */
+    uint64_t mappingSize; /* Size of the mapped file in bytes */
+    uint64_t mappedAdded; /* Value of added when the mapped header was written */
 
     /* Fields used for sparse representation */
-    struct Node* sparseRegisterList; /* Linked list of registers */
-    struct Node* sparseRegisterBuffer; /* Temporary buffer of nodes to be added */
-    struct Node* nodeCache; /* The last sparse register accessed using _get() */
+    uint8_t* sparseRegisterList; /* Delta encoded registers sorted by index */
+    struct SparseEntry* sparseRegisterBuffer; /* Temporary buffer of registers to be added */
+    uint32_t* bufferSlots; /* Buffer position of recently added indices */
+    uint64_t slotMask; /* Number of buffer slots - 1 */
     uint64_t bufferSize; /* Number of elements in the temporary buffer */
-    uint64_t listSize; /* Number of elements in the linked list */
+    uint64_t listSize; /* Number of registers in the sparse list */
+    uint64_t listBytes; /* Number of bytes used by the sparse list */
     uint64_t maxBufferSize; /* Max number of elements for the temporary buffer */
-    uint64_t maxListSize; /* Max number of nodes in the sparse list */
+    uint64_t maxListSize; /* Max number of bytes in the sparse list */
+    uint64_t cacheIndex; /* The last sparse register accessed using get() */
+    uint64_t cacheNext; /* Offset of the register following the cached register */
+    uint8_t cacheFsb; /* Value of the cached register */
+    bool isCacheValid; /* If the sparse register cache can be used */
 } HyperLogLog;
 
-typedef struct Node {
-    struct Node* next;
+static PyTypeObject HyperLogLogType;
+
+typedef struct AuxEntry {
+    uint64_t index;
+    uint8_t fsb; /* 0 if the slot is empty */
+} AuxEntry;
+
+typedef struct SparseEntry {
     uint64_t index;
+    uint32_t seq; /* Position in the buffer when added */
     uint8_t fsb;
-} Node;
+} SparseEntry;
 
 
 /* ========================== Dense representation ========================= */
 /*
- * Since register values will never exceed 64 we store them using only 6 bits.
- * This encoding is diagrammed below:
- *
- *          b0        b1        b2        b3
- *          /         /         /         /
- *     +---------+---------+---------+---------+
- *     |0000 0011|1111 0011|0110 1110|1111 1011|
- *     +---------+---------+---------+---------+
- *      |_____||_____| |_____||_____| |_____|
- *         |      |       |      |       |
- *       offset   m1      m2     m3     m4
- *
- *      b = bytes, m = registers
- *
- * The first six bits in b0 are an unused offset. With the exception of byte
- * aligned registers (e.g. m4), registers will have bits in consecutive bytes.
- * For example, the register m2 has bits in b1 and b2. The higher order bits
- * of m2 are in b1 and the lower order bytes of m2 are in the b2.
- *
- * Getting a register
- * ------------------
- *
- * Suppose we want to get register m2 (e.g. m=2). First we determine the
- * indices of the enclosing bytes:
- *
- *     left byte  = (6*m + 6)/8 - 1                                         (1)
- *                = 1
- *
- *     right byte = left byte + 1                                           (2)
- *                = 2
- *
- * Next we compute the number of bits of m2 in each byte. The number of right
- * bits is:
- *
- *     rb = right bits                                                      (3)
- *        = (6*m + 6) % 8
- *        = 2
- *
- *     lb = left bits                                                       (4)
- *        = 6 - rb
- *        = 4
- *
- * This result is diagrammed below:
- *
- *         b1         b2
- *          \         /
- *     +---------+---------+
- *     |1111 0011|0110 1110|
- *     +---------+---------+
- *           ^^^^ ^^
- *           /      \
- *       left bits  right bits
- *
- *       m2 = "001101"
- *
- * Move the left bits into the higher order positions:
- *
- *     +---------+
- *     |1111 0011|   <-- b1
- *     |1100 1100|   <-- b1 << rb
- *     +---------+
- *
- * Move the right bits to the lower order position:
- *
- *     +---------+
- *     |0110 1110|   <-- b2
- *     |0000 0001|   <-- b2 >> (8 - rb)
- *     +---------+
- *
- * Bitwise OR the two bytes, b1 | b2:
- *
- *     +---------+
- *     |1100 1100|  <-- b1
- *     |0000 0001|  <-- b2
- *     |1100 1101|  <-- b1 | b2
- *     +---------+
- *
- * Finally use a mask to remove the bits not part of m2:
- *
- *     +---------+
- *     |1100 1101|  <-- b1 | b2
- *     |0011 1111|  <-- mask to isolate the register bits
- *     |0000 1101|  <-- m2 = b1 & mask
- *     +---------+
- *
- * Setting a register
- * ------------------
- *
- * Setting a register is similar to getting a register. We determine the
- * enclosing bytes using (1) and (2). Then the bits of each byte is
- * computed using (3) and (4). Continuing the previous example using register
- * m2, at this point we should have:
- *
- *         b1         b2
- *          \         /
- *     +---------+---------+
- *     |1111 0011|0110 1110|
- *     +---------+---------+
- *           ^^^^ ^^
- *           /      \
- *       left bits  right bits
- *
- *       lb = 4, rb = 2
- *       m2 = "001101"
- *
- * Let N be the value we want to set. Suppose we want to set m2 to 7 (N=7). We
- * start by zeroing out the left bits of m in b1 and the rights bits of m in
- * b2:
- *
- *     +---------+
- *     |1111 0011|  <- b1
- *     |0011 1100|  <- b1 = b1 >> lb
- *     |1111 0000|  <- b1 = b1 << lb
- *     |0110 1110|  <- b2
- *     |1011 1000|  <- b2 = b2 << rb
- *     |0010 1110|  <- b2 = b2 >> rb
- *     +---------+
- *
- * Now that we have made space for m2, we need to set the new bits. We can get
- * new bits by simplying shifting N:
- *
- *      new right bits
- *            \
- *            vv
- *    +---------+
- *    |0000 0111|  <- N=7
- *    +---------+
- *       ^^ ^^
- *        \ /
- *    new left bits
- *
- *    nlb = new left bits
- *        = N >> rb
- *        = 7 >> 2
- *
- *    nrb = new right bits
- *        = N << (8 - rb)
- *        = 7 << 6
- *
- * We can now set the left byte b1 using bitwise OR:
- *
- *    +---------+
- *    |1111 0000|  <- b1
- *    |0000 0001|  <- nlb
- *    |1111 0001|  <- b1 | nlb
- *    +---------+
- *
- * Setting the right byte b2 using bitwise OR:
- *
- *    +---------+
- *    |0010 1110|  <- b2
- *    |1100 0000|  <- nrb
- *    |1110 1110|  <- b2 | nrb
- *    +---------+
- *
- * The bytes have been updated so we're done. The final result is shown
- * below:
- *
- *         b1         b2
- *          \         /
- *     +---------+---------+
- *     |1111 0001|1110 1110|
- *     +---------+---------+
- *           ^^^^ ^^
- *           /      \
- *       left bits  right bits
- *
- *       lb = 4, rb = 2
- *       m2 = "000111"
+ * The encoding of 6 bit registers is described in hll.h.
  */
 
-
-/* Get register m. */
-static inline uint64_t getDenseRegister(uint64_t m, uint8_t* regs)
-{
-    uint64_t nBits = 6*m + 6;
-    uint64_t bytePos = nBits/8 - 1;
-    uint8_t leftByte = regs[bytePos];
-    uint8_t rightByte = regs[bytePos + 1];
-    uint8_t nrb = (uint8_t) (nBits % 8);
-    uint8_t reg;
-
-    leftByte <<= nrb; /* Move left bits into high order spots */
-    rightByte >>= (8 - nrb); /* Move rights bits into the low order spots */
-    reg = leftByte | rightByte; /* OR the result to get the register */
-    reg &= 63; /* Get rid of the 2 extra bits */
-
-    return (uint64_t) reg;
-}
-
-
-/* Set register m to n. */
-static inline void setDenseRegister(uint64_t m, uint8_t n, uint8_t* regs)
-{
-    uint64_t nBits = 6*m + 6;
-    uint64_t bytePos = nBits/8 - 1;
-    uint8_t nrb = (uint8_t) (nBits % 8);
-    uint8_t nlb = 6 - nrb;
-    uint8_t leftByte = regs[bytePos];
-    uint8_t rightByte = regs[bytePos + 1];
-
-    leftByte >>= nlb;
-    leftByte <<= nlb;
-    rightByte <<= nrb;
-    rightByte >>= nrb;
-    leftByte |= (n >> nrb); /* Set the new left bits */
-    rightByte |= (n << (8 - nrb)); /* Set the new right bits */
-    regs[bytePos] = leftByte;
-    regs[bytePos + 1] = rightByte;
-}
-
-
-/* ========================== Sparse representation ======================== */
 /*
- * When a HyperLogLog is created its register values are initialized to zero.
- * Because the registers share the same value it is inefficient to store
- * them individually. Instead only non-zero registers are stored. These
- * registers are stored as nodes in a sorted link list. For example the
- * registers
- *
- *     +-+-+-+-+-+-+-+-+
- *     |0|3|0|0|1|1|0|2|
- *     +-+-+-+-+-+-+-+-+
+ * 4 bit dense registers
+ * ---------------------
  *
- * are represented with the following linked list (sorted by index):
+ * Register values are concentrated in a narrow range once every register has
+ * been set, so registers can be stored using 4 bits relative to the smallest
+ * register value, curMin (the "u4" layout, as in HLL_4 of Apache
+ * DataSketches). Register m is stored in the low nibble of byte m/2 if m is
+ * even and the high nibble otherwise:
  *
- *            index
- *              |
- *              v
- *     +---+   +---+   +---+   +---+
- *     |1,3|-->|4,1|-->|5,1|-->|7,2|
- *     +---+   +---+   +---+   +---+
- *                ^
- *                |
- *              value
+ *     nibble = fsb - curMin      if fsb - curMin < 15
+ *     nibble = AUX_TOKEN (15)    otherwise
  *
- * To avoid the worst case of traversing the linked list every time add()
- * is called a temporary register buffer is used to store the new register
- * values. When the buffer is full it is sorted and the linked list is
- * updated. Because both the list and buffer are sorted this update can be
- * done in one pass.
+ * Registers with the value AUX_TOKEN are stored in a small open addressing
+ * hash table, the aux table. Since the histogram is maintained for dense
+ * registers, curMin is increased when its count drops to zero. All the
+ * registers are then re-encoded relative to the new minimum, which moves
+ * registers out of the aux table. This happens at most 64 times.
  *
- * Eventually the linked list grows too large to save memory. When this
- * happens the HyperLogLog switches to a dense representation.
+ * Bulk operations such as merges and serialization decode the registers to
+ * one byte per register, operate on those, and encode them again.
  */
 
+#define AUX_TOKEN 15
+#define AUX_MIN_CAPACITY 16
 
-/* Compares two sparse register nodes. */
-int compareNodes(const void* a, const void* b) {
 
-    int result = -1;
-    struct Node* A = (struct Node*) a;
-    struct Node* B = (struct Node*) b;
+/* Gets the slot of the aux table an index is stored in, or the empty slot it
+ * would be stored in. */
+static inline AuxEntry* findAuxEntry(const HyperLogLog* self, uint64_t index)
+{
+    uint64_t mask = self->auxCapacity - 1;
+    uint64_t i = (index*0x9E3779B97F4A7C15ULL) >> (64 - ctz(self->auxCapacity));
 
-    if (A->index == B->index) {
-        if (A->fsb > B->fsb) {
-            result = 1;
-        } else if (A->fsb < B->fsb) {
-            result = -1;
-        } else {
-            result = 0;
-        }
-    } else if (A->index > B->index) {
-        result = 1;
+    while (self->auxTable[i].fsb != 0 && self->auxTable[i].index != index) {
+        i = (i + 1) & mask;
     }
 
-    return result;
+    return &self->auxTable[i];
 }
 
 
-/* Updates the register list using the items in the buffer. */
-void flushRegisterBuffer(HyperLogLog* self)
+/* Stores a register in the aux table, growing the table if it is 3/4 full.
+ * Returns -1 on failure to allocate memory. */
+static int setAuxRegister(HyperLogLog* self, uint64_t index, uint8_t fsb)
 {
-    uint64_t i;
-    struct Node* node;
-    struct Node *current = self->sparseRegisterList;
-    struct Node *next = NULL;
-    struct Node *prev = NULL;
-
-    qsort(self->sparseRegisterBuffer, self->bufferSize, sizeof(struct Node), compareNodes);
-
-    for (i = 0; i < self->bufferSize; i++) {
-
-        /* Create the new node from the current item in the buffer */
-        node = (struct Node*)malloc(sizeof(struct Node));
-        node->fsb = self->sparseRegisterBuffer[i].fsb;
-        node->index = self->sparseRegisterBuffer[i].index;
-        node->next = NULL;
-
-        /* If head doesn't exist then set it */
-        if (self->sparseRegisterList == NULL) {
-            self->sparseRegisterList = node;
-            self->histogram[0]--;
-            self->histogram[(uint8_t)node->fsb]++;
-            self->listSize += 1;
-            prev = node;
-            continue;
-        }
-
-        /* Since both lists are sorted try to use the last node */
-        if (prev != NULL) {
-            current = prev;
-        } else {
-            current = self->sparseRegisterList;
-        }
-
-        while (current != NULL) {
+    AuxEntry* entry;
 
-            // Are we updating an existing node?
-            if (current->index == node->index) {
-                if (current->fsb < node->fsb) {
-                    self->histogram[current->fsb]--;
-                    self->histogram[node->fsb]++;
-                    current->fsb = node->fsb;
-                }
+    if (self->auxTable == NULL || 4*(self->auxCount + 1) > 3*self->auxCapacity) {
+        uint64_t capacity = self->auxTable == NULL ? AUX_MIN_CAPACITY : 2*self->auxCapacity;
+        AuxEntry* old = self->auxTable;
+        uint64_t oldCapacity = self->auxCapacity;
+        AuxEntry* table = (AuxEntry*)calloc(capacity, sizeof(AuxEntry));
 
-                prev = current;
+        if (table == NULL) return -1;
 
-                /* We don't need the new node */
-                free(node);
-                break;
-            }
+        self->auxTable = table;
+        self->auxCapacity = capacity;
 
-            // Are we creating a new head?
-            if (current->index > node->index) {
-                node->next = current;
-                self->histogram[0]--;
-                self->histogram[(uint8_t)node->fsb]++;
-                self->sparseRegisterList = node;
-                self->listSize += 1;
-                prev = node;
-                break;
+        for (uint64_t i = 0; i < oldCapacity; i++) {
+            if (old[i].fsb != 0) {
+                *findAuxEntry(self, old[i].index) = old[i];
             }
+        }
 
-            // Are we creating a new tail?
-            if (current->next == NULL) {
-                current->next = node;
-                self->histogram[0]--;
-                self->histogram[(uint8_t)node->fsb]++;
-                self->listSize += 1;
-                prev = node;
-                break;
-            }
+        free(old);
+    }
 
-            // Are inserting between nodes?
-            if (current->next->index > node->index) {
-                node->next = current->next;
-                current->next = node;
-                self->histogram[0]--;
-                self->histogram[(uint8_t)node->fsb]++;
-                self->listSize += 1;
-                prev = node;
-                break;
-            }
+    entry = findAuxEntry(self, index);
 
-            next = current->next;
-            current = next;
-        }
+    if (entry->fsb == 0) {
+        self->auxCount++;
     }
 
-    self->bufferSize = 0;
+    entry->index = index;
+    entry->fsb = fsb;
+
+    return 0;
 }
 
 
-/* Transforms a HyperLogLog from sparse to dense representation. */
-void transformToDense(HyperLogLog* self) {
-    uint64_t bytes = (self->size*6)/8 + 1;
-    self->registers = (uint8_t*)calloc(bytes, sizeof(uint8_t));
+/* Gets a 4 bit register. */
+static inline uint8_t getNibbleRegister(const HyperLogLog* self, uint64_t m)
+{
+    uint8_t nibble = (self->registers[m >> 1] >> ((m & 1) << 2)) & 15;
 
-    if (self->registers == NULL) {
-        char* msg = (char*)malloc(128 * sizeof(char));
-        sprintf(msg, "Failed to allocate %lu bytes.", bytes);
-        PyErr_SetString(PyExc_MemoryError, msg);
-        return;
+    if (nibble < AUX_TOKEN) {
+        return self->curMin + nibble;
     }
 
-    flushRegisterBuffer(self);
+    AuxEntry* entry = self->auxTable ? findAuxEntry(self, m) : NULL;
 
-    struct Node *next = NULL;
-    struct Node *current = self->sparseRegisterList;
-
-    while (current != NULL) {
-        setDenseRegister(current->index, current->fsb, self->registers);
-        next = current->next;
-        current = next;
-    }
+    /* Registers are only set to AUX_TOKEN once stored in the table */
+    return (entry && entry->fsb) ? entry->fsb : self->curMin + AUX_TOKEN;
+}
 
-    current = self->sparseRegisterList;
 
-    while (current != NULL) {
-        next = current;
-        current = current->next;
+/* Sets a 4 bit register to a value of at least curMin. Returns -1 on failure
+ * to allocate memory, leaving the register unchanged. */
+static inline int setNibbleRegister(HyperLogLog* self, uint64_t m, uint8_t fsb)
+{
+    uint8_t nibble = fsb - self->curMin;
+    uint8_t shift = (m & 1) << 2;
 
-        if (next != NULL) {
-            free(next);
-            next = NULL;
-        }
+    if (nibble >= AUX_TOKEN) {
+        nibble = AUX_TOKEN;
+        if (setAuxRegister(self, m, fsb) < 0) return -1;
     }
 
-    if (self->sparseRegisterBuffer != NULL) {
-        free(self->sparseRegisterBuffer);
-        self->sparseRegisterBuffer = NULL;
-    }
+    self->registers[m >> 1] = (self->registers[m >> 1] & ~(15 << shift)) | (nibble << shift);
 
-    self->sparseRegisterList = NULL;
-    self->nodeCache = NULL;
-    self->isSparse = 0;
+    return 0;
 }
 
 
-/* Gets the register value at the specified index. */
-static inline uint64_t
-getSparseRegister(HyperLogLog* self, uint64_t index)
+/* Encodes registers stored one per byte as 4 bit registers relative to their
+ * minimum. The aux table is built aside and the registers are only written
+ * once it is complete, so on failure to allocate memory -1 is returned and the
+ * registers are unchanged. */
+static int encodeNibbleRegisters(HyperLogLog* self, const uint8_t* values)
 {
-    struct Node *current = NULL;
+    AuxEntry* oldTable = self->auxTable;
+    uint64_t oldCapacity = self->auxCapacity;
+    uint64_t oldCount = self->auxCount;
+    uint8_t curMin = 64;
 
-    if (self->bufferSize > 0) {
-        flushRegisterBuffer(self);
+    for (uint64_t i = 0; i < self->size; i++) {
+        if (values[i] < curMin) curMin = values[i];
     }
 
-    current = self->sparseRegisterList;
+    self->auxTable = NULL;
+    self->auxCapacity = 0;
+    self->auxCount = 0;
 
-    /* Can we used the cache? */
-    if (self->nodeCache != NULL && self->nodeCache->index <= index) {
-        current = self->nodeCache;
+    for (uint64_t i = 0; i < self->size; i++) {
+        if (values[i] - curMin >= AUX_TOKEN && setAuxRegister(self, i, values[i]) < 0) {
+            free(self->auxTable);
+            self->auxTable = oldTable;
+            self->auxCapacity = oldCapacity;
+            self->auxCount = oldCount;
+            return -1;
+        }
     }
 
-    while (current != NULL) {
+    free(oldTable);
+    self->curMin = curMin;
 
-        if (current->index > index) {
-            return 0;
-        } else if (current->index == index) {
-            self->nodeCache = current;
-            return current->fsb;
-        }
+    for (uint64_t i = 0; i < self->size; i += 2) {
+        uint8_t lo = values[i] - curMin;
+        uint8_t hi = i + 1 < self->size ? values[i + 1] - curMin : 0;
 
-        current = current->next;
+        self->registers[i >> 1] = (lo < AUX_TOKEN ? lo : AUX_TOKEN) | ((hi < AUX_TOKEN ? hi : AUX_TOKEN) << 4);
     }
 
     return 0;
 }
 
 
-/* Sets a sparse register. This function does not set the register immediately
- * but instead adds it to the temporary buffer. Register updates will occur
- * when the buffer is next cleared. */
-static inline void setSparseRegister(HyperLogLog* self, uint64_t index, uint8_t fsb)
+/* Gets the number of bytes used by the dense registers of a HyperLogLog, not
+ * including the aux table. */
+static inline uint64_t layoutBytes(uint64_t size, uint8_t layout)
 {
-    /* Add an element to the buffer if there is room */
-    if (self->bufferSize < self->maxBufferSize) {
-        self->sparseRegisterBuffer[self->bufferSize].index = index;
-        self->sparseRegisterBuffer[self->bufferSize].fsb = fsb;
-        self->bufferSize++;
-    }
+    return layout == LAYOUT_U4 ? (size + 1)/2 : denseBytes(size, layout == LAYOUT_U8);
+}
 
-    /* Otherwise flush the buffer and then add */
-    else {
-        flushRegisterBuffer(self);
-        self->bufferSize = 1;
-        self->sparseRegisterBuffer[0].index = index;
-        self->sparseRegisterBuffer[0].fsb = fsb;
+
+/* Gets a dense register of a HyperLogLog using any layout. */
+static inline uint8_t getDense(const HyperLogLog* self, uint64_t m)
+{
+    if (self->layout == LAYOUT_U4) {
+        return getNibbleRegister(self, m);
     }
-}
 
+    return getRegisterIn(self->registers, self->layout == LAYOUT_U8, m);
+}
 
-/* ====================== HyperLogLog object methods ======================= */
 
+/* Sets a dense register of a HyperLogLog using any layout. Returns -1 on
+ * failure to allocate memory, see setNibbleRegister(). */
+static inline int setDense(HyperLogLog* self, uint64_t m, uint8_t fsb)
+{
+    if (self->layout == LAYOUT_U4) {
+        return setNibbleRegister(self, m, fsb);
+    }
 
-/* Set a HyperLogLog register. This is a convenience function intended to make
- * register updates representation agnostic. */
-static inline bool setRegister(HyperLogLog* self, uint64_t index, uint8_t newFsb) {
-    self->added++; /* Increment method call counter */
+    setRegisterIn(self->registers, self->layout == LAYOUT_U8, m, fsb);
 
-    if (self->isSparse) {
-        setSparseRegister(self, index, newFsb);
+    return 0;
+}
 
-        /* Switch to dense representation? */
-        if (self->listSize >= self->maxListSize) {
-            transformToDense(self);
-        }
 
-        self->isCached = 0;
+/* Copies the dense registers of a HyperLogLog to values, one byte per
+ * register. */
+static void copyDenseRegisters(const HyperLogLog* self, uint8_t* values)
+{
+    if (self->layout == LAYOUT_U8) {
+        memcpy(values, self->registers, self->size);
+    } else if (self->layout == LAYOUT_U6) {
+        unpackRegisters(values, self->registers, self->size);
     } else {
-        uint64_t fsb = getDenseRegister(index, self->registers);
+        for (uint64_t i = 0; i < self->size; i++) {
+            values[i] = getNibbleRegister(self, i);
+        }
+    }
+}
 
-        if (newFsb > fsb) {
-            setDenseRegister(index, (uint8_t)newFsb, self->registers);
-            self->histogram[newFsb] += 1; /* Increment the new count */
-            self->isCached = 0;
 
-            if (self->histogram[fsb] == 0) {
-                self->histogram[0] -= 1;
-            } else {
-                self->histogram[fsb] -= 1;
-            }
+/* Copies the dense registers of a HyperLogLog to an array with one byte per
+ * register. Returns the array, which must be freed, or NULL on failure to
+ * allocate memory. */
+static uint8_t* decodeDenseRegisters(const HyperLogLog* self)
+{
+    uint8_t* values = (uint8_t*)malloc(self->size);
 
-            return 1;
-        }
+    if (values != NULL) {
+        copyDenseRegisters(self, values);
     }
 
-    return 0;
+    return values;
 }
 
 
-/* Gets the a register value by index */
-static PyObject* HyperLogLog_get_register(HyperLogLog* self, PyObject* args)
+/* Gets the name of the hash function of a hash kind. */
+static inline const char* hashName(uint8_t hashKind)
 {
-    unsigned long index;
-    uint64_t fsb;
+    switch (hashKind) {
+    case HASH_REDIS:
+        return "redis";
+    case HASH_XXH3:
+        return "xxh3";
+    case HASH_WYHASH:
+        return "wyhash";
+    default:
+        return "murmur64a";
+    }
+}
 
-    if (!PyArg_ParseTuple(args, "k", &index)) return NULL;
-    if (!isValidIndex(index, self->size)) return NULL;
 
-    if (self->isSparse) {
-        fsb = getSparseRegister(self, index);
-    } else {
-        fsb = getDenseRegister(index, self->registers);
-    }
+/* Parses the name of a hash function. Returns -1 and sets a Python exception
+ * if the name is invalid. */
+static int parseHashKind(const char* name)
+{
+    if (strcmp(name, "murmur64a") == 0) return HASH_MURMUR64A;
+    if (strcmp(name, "xxh3") == 0) return HASH_XXH3;
+    if (strcmp(name, "wyhash") == 0) return HASH_WYHASH;
 
-    return Py_BuildValue("k", fsb);
+    PyErr_SetString(PyExc_ValueError, "hash must be 'murmur64a', 'xxh3' or 'wyhash'");
+    return -1;
 }
 
 
-/* Gets a dictionary of internal attributes and their values */
-static PyObject* HyperLogLog__get_meta(HyperLogLog* self, PyObject* args)
+/* Gets the name of a register layout. */
+static inline const char* layoutName(uint8_t layout)
 {
-    char version[8];
-    sprintf(version, "%u.%u.%u", PY_MAJOR_VERSION, PY_MINOR_VERSION, PY_MICRO_VERSION);
+    return layout == LAYOUT_U4 ? "u4" : layout == LAYOUT_U8 ? "u8" : "u6";
+}
 
-    uint64_t cacheIndex = self->nodeCache == NULL ? 0 : self->nodeCache->index;
-    uint64_t cacheValue = self->nodeCache == NULL ? 0 : self->nodeCache->fsb;
 
-    return Py_BuildValue("{s:k,s:k,s:k,s:k,s:i,s:i,s:k,s:k,s:k,s:k,s:s,s:s}",
-        "added", self->added,
-        "list_size", self->listSize,
-        "buffer_size", self->bufferSize,
-        "cache", self->cache,
-        "is_cached", self->isCached,
-        "is_sparse", self->isSparse,
-        "max_list_size", self->maxListSize,
-        "max_buffer_size", self->maxListSize,
-        "node_cache_index", cacheIndex,
-        "node_cache_value", cacheValue,
-        "py_version", version,
-        "hll_version", HLL_VERSION
-    );
+/* Parses the name of a register layout. Returns -1 and sets a Python
+ * exception if the name is invalid. */
+static int parseLayout(const char* name)
+{
+    if (strcmp(name, "u6") == 0) return LAYOUT_U6;
+    if (strcmp(name, "u8") == 0) return LAYOUT_U8;
+    if (strcmp(name, "u4") == 0) return LAYOUT_U4;
+
+    PyErr_SetString(PyExc_ValueError, "layout must be 'u4', 'u6' or 'u8'");
+    return -1;
 }
 
 
-/* Gets a histogram of first set bit positions as a list of ints. */
-static PyObject* HyperLogLog__histogram(HyperLogLog* self)
+/* Re-encodes 4 bit registers once no register has the value curMin. If
+ * memory can't be allocated the registers are left relative to the old
+ * minimum, which is still valid, and re-encoded by a later update. */
+static void rebaseNibbleRegisters(HyperLogLog* self)
 {
-    PyObject* histogram = PyList_New(65);
+    uint8_t* values;
 
-    for (int i = 0; i < 65; i++) {
-        PyObject* count = Py_BuildValue("i", self->histogram[i]);
-        PyList_SetItem(histogram, i, count);
+    if (self->histogram[self->curMin] > 0 || (values = decodeDenseRegisters(self)) == NULL) {
+        return;
     }
 
-    return histogram;
+    encodeNibbleRegisters(self, values);
+    free(values);
 }
 
 
-static void HyperLogLog_dealloc(HyperLogLog* self)
+/*
+ * Concurrent dense registers
+ * --------------------------
+ *
+ * With concurrent=True registers use one byte each and are raised using an
+ * atomic compare and swap, so any number of threads can add elements to the
+ * same HyperLogLog without a lock: add_many() and add_hashes() calls which
+ * release the GIL, or add() with free-threaded Python. A 6 bit register can't
+ * be updated this way since its read-modify-write spans two bytes. Registers
+ * only increase so a compare and swap is only retried when another thread
+ * raised the same register.
+ *
+ * Concurrent updates don't maintain the histogram or the cached estimate,
+ * which would be contended by every thread. Instead the histogram is counted
+ * from the registers when it is needed. Each register counted holds a value it
+ * had at some point during the count, so an estimate is never lower than one
+ * made before the count started.
+ */
+
+#if defined(__GNUC__) || defined(__clang__)
+#define HLL_ATOMICS /* Concurrent registers are supported */
+#endif
+
+
+/* Raises register m of unpacked registers to fsb. Returns true if the
+ * register was raised. */
+static inline bool raiseRegisterAtomic(uint8_t* regs, uint64_t m, uint8_t fsb)
 {
-    free(self->histogram);
-    free(self->registers);
+#ifdef HLL_ATOMICS
+    uint8_t cur = __atomic_load_n(regs + m, __ATOMIC_RELAXED);
 
-    if (self->isSparse) {
-        struct Node *next = NULL;
-        struct Node *current = self->sparseRegisterList;
-        while (current != NULL) {
-            next = current->next;
-            free(current);
-            current = next;
+    while (fsb > cur) {
+        if (__atomic_compare_exchange_n(regs + m, &cur, fsb, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            return 1;
         }
+    }
 
-        free(self->sparseRegisterBuffer);
+    return 0;
+#else
+    if (fsb > regs[m]) {
+        regs[m] = fsb;
+        return 1;
     }
 
-    Py_TYPE(self)->tp_free((PyObject*) self);
+    return 0;
+#endif
 }
 
 
-/* Add an element. */
-static PyObject* HyperLogLog_add(HyperLogLog* self, PyObject* args)
+/* Adds n to a counter shared between threads. */
+static inline void addAtomic(uint64_t* counter, uint64_t n)
 {
-    const uint8_t* data;
-    const uint64_t dataLen;
-    uint64_t hash, index, newFsb;
-
-    if (!PyArg_ParseTuple(args, "s#", &data, &dataLen)) return NULL;
-    hash = MurmurHash64A((void*)data, dataLen, self->seed);
-
-    index = (hash >> (64 - self->p)); /* Use the first p bits as an index */
-    newFsb = hash << self->p; /* Remove the first p bits */
-    newFsb = clz(newFsb) + 1; /* Find the first set bit in the remaining bits */
-    bool updated = setRegister(self, index, (uint8_t)newFsb);
-
-    if (updated) {
-        Py_RETURN_TRUE;
-    } else {
-        Py_RETURN_FALSE;
-    }
-};
+#ifdef HLL_ATOMICS
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+#else
+    *counter += n;
+#endif
+}
 
 
-/* Get a cardinality estimate */
-static PyObject* HyperLogLog_cardinality(HyperLogLog* self)
+/* Counts the values of concurrently updated registers. */
+static void countConcurrentRegisters(const HyperLogLog* self, uint64_t* histogram)
 {
-    if (self->isCached) {
-        return Py_BuildValue("K", self->cache);
-    } else if (self->isSparse && self->bufferSize > 0) {
-        flushRegisterBuffer(self);
-    }
-
-    double alpha = 0.7213475;
-    double m = (double)self->size;
-    double z = m*tau((m - (double)self->histogram[self->p + 1])/m);
+    memset(histogram, 0, 65*sizeof(uint64_t));
 
-    uint64_t k;
-    for (k = 64 - self->p; k >= 1; --k) {
-        z += self->histogram[k];
-        z *= 0.5;
+    for (uint64_t i = 0; i < self->size; i++) {
+#ifdef HLL_ATOMICS
+        histogram[__atomic_load_n(self->registers + i, __ATOMIC_RELAXED)]++;
+#else
+        histogram[self->registers[i]]++;
+#endif
     }
+}
 
-    z += m*sigma((double)self->histogram[0]/m);
-    uint64_t estimate = (uint64_t)round(alpha*m*(m/z));
 
-    self->cache = estimate;
-    self->isCached = 1;
+/* ============================ HIP estimation ============================= */
+/*
+ * The historic inverse probability (HIP) estimator [4] counts register
+ * updates as they happen. When an element updates a register the estimate is
+ * increased by the inverse of the probability that a new element would have
+ * updated any register. Register j is updated by a new element with
+ * probability 2^-K_j / m if K_j <= q and never once it reaches q + 1. The
+ * probability is maintained incrementally, so reading the estimate is O(1).
+ *
+ * The estimate depends on the order registers were updated in, so it can only
+ * be maintained while elements are added one at a time. Merging or loading
+ * registers invalidates it and the standard estimator is used instead.
+ */
 
-    return Py_BuildValue("K", estimate);
+/* Probability a new element updates a register with the given value, times
+ * the number of registers. */
+static inline double updateProbability(uint8_t fsb, unsigned short p)
+{
+    return fsb <= 64 - p ? ldexp(1.0, -fsb) : 0.0;
 }
 
 
-/* Get a Murmur64A hash of a string, buffer or bytes object. */
-static PyObject* HyperLogLog_hash(HyperLogLog* self, PyObject* args)
+/* Records a register update from oldFsb to newFsb. */
+static inline void hipUpdate(double* estimate, double* probability, uint8_t oldFsb, uint8_t newFsb,
+                             unsigned short p, uint64_t size)
 {
-    const uint8_t* data;
-    const uint64_t dataLen;
+    *estimate += 1.0/(*probability);
+    *probability -= (updateProbability(oldFsb, p) - updateProbability(newFsb, p))/(double)size;
+}
 
-    if (!PyArg_ParseTuple(args, "s#", &data, &dataLen)) return NULL;
 
-    uint64_t hash = MurmurHash64A((void*) data, dataLen, self->seed);
-    return Py_BuildValue("K", hash);
+/* ========================== Sparse representation ======================== */
+/*
+ * When a HyperLogLog is created its register values are initialized to zero.
+ * Because the registers share the same value it is inefficient to store
+ * them individually. Instead only non-zero registers are stored. These
+ * registers are stored in a single contiguous byte array sorted by index [3].
+ * For example the registers
+ *
+ *     +-+-+-+-+-+-+-+-+
+ *     |0|3|0|0|1|1|0|2|
+ *     +-+-+-+-+-+-+-+-+
+ *
+ * are represented with the following list (sorted by index):
+ *
+ *     (1,3) (4,1) (5,1) (7,2)
+ *       ^ ^
+ *       | |
+ *   index value
+ *
+ * Each register is encoded as the difference between its index and the index
+ * of the previous register (the first register is relative to 0), followed by
+ * a byte holding the register value. The difference is encoded as a varint:
+ * 7 bits per byte, least significant bits first, with the high bit set on
+ * every byte but the last. The list above is encoded as the bytes
+ *
+ *     +--+--+--+--+--+--+--+--+
+ *     |01|03|03|01|01|01|02|02|
+ *     +--+--+--+--+--+--+--+--+
+ *
+ * Since registers are sorted the differences are small, typically using a
+ * single byte. Reading the list is a linear scan over one block of memory.
+ *
+ * To avoid the worst case of re-encoding the list every time add() is called
+ * a temporary register buffer is used to store the new register values. When
+ * the buffer is full it is radix sorted and merged with the list. Because
+ * both the list and buffer are sorted this update can be done in one pass.
+ *
+ * Eventually the list grows too large to save memory. When the number of
+ * bytes used by the list reaches maxListSize the HyperLogLog switches to a
+ * dense representation.
+ */
+
+
+/* Starts iterating over a sparse list at the given offset. The index is the
+ * index of the register preceding the offset (0 at the start of the list). */
+static inline void initSparseIterator(SparseIterator* it, const HyperLogLog* self,
+                                      uint64_t offset, uint64_t index)
+{
+    it->pos = self->sparseRegisterList + offset;
+    it->end = self->sparseRegisterList + self->listBytes;
+    it->index = index;
+    it->fsb = 0;
 }
 
 
-static int HyperLogLog_init(HyperLogLog* self, PyObject* args, PyObject* kwds)
+/* Sorts buffered registers by index using a least significant digit radix
+ * sort, 8 bits of the index at a time. Digits shared by every register are
+ * skipped. Returns the sorted registers, which are either in buffer or in
+ * scratch. */
+static SparseEntry* sortEntries(SparseEntry* buffer, SparseEntry* scratch, uint64_t n, unsigned short p)
 {
-    static char* kwlist[] = {"p", "seed", "sparse", "max_sparse_list_size", "max_sparse_buffer_size", NULL};
-    uint64_t maxSparseListSize = 0;
-    uint64_t maxSparseBufferSize = 0;
-    int64_t sparse = 1;
+    uint64_t counts[256];
 
-    self->seed = 314;  /* Chosen arbitrarily */
-    self->p = 12;
+    for (int shift = 0; shift < p; shift += 8) {
+        uint64_t offset = 0;
+
+        memset(counts, 0, sizeof(counts));
+
+        for (uint64_t i = 0; i < n; i++) {
+            counts[(buffer[i].index >> shift) & 0xFF]++;
+        }
+
+        if (counts[(buffer[0].index >> shift) & 0xFF] == n) {
+            continue;
+        }
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|iiikk", kwlist, &self->p, &self->seed, &sparse, &maxSparseListSize, &maxSparseBufferSize)) {
+        for (int d = 0; d < 256; d++) {
+            uint64_t count = counts[d];
+            counts[d] = offset;
+            offset += count;
+        }
+
+        for (uint64_t i = 0; i < n; i++) {
+            scratch[counts[(buffer[i].index >> shift) & 0xFF]++] = buffer[i];
+        }
+
+        SparseEntry* sorted = scratch;
+        scratch = buffer;
+        buffer = sorted;
+    }
+
+    return buffer;
+}
+
+
+/* Records the register updates made by the buffered registers with the given
+ * index, starting at position i of the sorted buffer. cur is the value of the
+ * register in the list. The old and new value of each update are stored in
+ * updates at twice the position the register was added to the buffer. */
+static inline void recordHipUpdates(const SparseEntry* buffer, uint64_t i, uint64_t n, uint8_t cur, uint8_t* updates)
+{
+    uint64_t index = buffer[i].index;
+
+    /* The sort is stable so updates of a register are in the order they were
+     * added */
+    for (; i < n && buffer[i].index == index; i++) {
+        if (buffer[i].fsb > cur) {
+            updates[2*buffer[i].seq] = cur;
+            updates[2*buffer[i].seq + 1] = buffer[i].fsb;
+            cur = buffer[i].fsb;
+        }
+    }
+}
+
+
+/* Applies recorded register updates to a HIP estimate in the order they were
+ * added. */
+static void replayHipUpdates(const HyperLogLog* self, const uint8_t* updates, uint64_t n,
+                             double* estimate, double* probability)
+{
+    for (uint64_t i = 0; i < n; i++) {
+        if (updates[2*i + 1] > 0) {
+            hipUpdate(estimate, probability, updates[2*i], updates[2*i + 1], self->p, self->size);
+        }
+    }
+}
+
+
+/* Updates the register list using the items in the buffer. The list is
+ * re-encoded into a new array, if it can't be allocated the buffer is left
+ * unchanged and -1 is returned. */
+int flushRegisterBuffer(HyperLogLog* self)
+{
+    SparseIterator it;
+    SparseEntry* buffer;
+    SparseEntry* scratch;
+    uint64_t n = self->bufferSize;
+    uint64_t prev = 0;
+    uint64_t i = 0;
+    uint8_t* list;
+    uint8_t* out;
+    uint8_t* updates = NULL; /* Old and new value of the register updated by each buffered register */
+    bool hip = self->useHip && self->isHipValid;
+
+    if (n == 0) {
+        return 0;
+    }
+
+    list = (uint8_t*)malloc(self->listBytes + n*(MAX_VARINT_BYTES + 1));
+    scratch = (SparseEntry*)malloc(n*sizeof(SparseEntry));
+
+    if (hip) {
+        updates = (uint8_t*)calloc(2*n, sizeof(uint8_t));
+    }
+
+    if (list == NULL || scratch == NULL || (hip && updates == NULL)) {
+        free(list);
+        free(scratch);
+        free(updates);
         return -1;
     }
 
-    if (self->p < 2 || self->p > 63) {
-        char* msg = "p is out of range";
-        PyErr_SetString(PyExc_ValueError, msg);
+    buffer = sortEntries(self->sparseRegisterBuffer, scratch, n, self->p);
+
+    initSparseIterator(&it, self, 0, 0);
+    bool hasNext = nextSparseRegister(&it);
+    out = list;
+
+    while (hasNext || i < n) {
+        uint64_t index;
+        uint8_t fsb;
+
+        if (i < n && (!hasNext || buffer[i].index <= it.index)) {
+            index = buffer[i].index;
+            fsb = buffer[i].fsb;
+
+            if (hip) {
+                recordHipUpdates(buffer, i, n, (hasNext && it.index == index) ? it.fsb : 0, updates);
+            }
+
+            /* Collapse duplicates to their largest value */
+            while (++i < n && buffer[i].index == index) {
+                if (buffer[i].fsb > fsb) {
+                    fsb = buffer[i].fsb;
+                }
+            }
+
+            if (hasNext && it.index == index) { /* Update an existing register */
+                if (fsb > it.fsb) {
+                    self->histogram[it.fsb]--;
+                    self->histogram[fsb]++;
+                } else {
+                    fsb = it.fsb;
+                }
+
+                hasNext = nextSparseRegister(&it);
+            } else { /* Insert a new register */
+                self->histogram[0]--;
+                self->histogram[fsb]++;
+                self->listSize++;
+            }
+        } else { /* Copy an existing register */
+            index = it.index;
+            fsb = it.fsb;
+            hasNext = nextSparseRegister(&it);
+        }
+
+        out = writeSparseRegister(out, index - prev, fsb);
+        prev = index;
+    }
+
+    free(self->sparseRegisterList);
+    self->listBytes = out - list;
+    self->sparseRegisterList = (uint8_t*)realloc(list, self->listBytes); /* Release unused bytes */
+
+    if (self->sparseRegisterList == NULL) {
+        self->sparseRegisterList = list;
+    }
+
+    if (hip) {
+        replayHipUpdates(self, updates, n, &self->hipEstimate, &self->hipProbability);
+    }
+
+    free(scratch);
+    free(updates);
+    self->bufferSize = 0;
+    self->isCacheValid = 0;
+
+    return 0;
+}
+
+
+/* Transforms a HyperLogLog from sparse to dense representation. This may be
+ * called without holding the GIL so no Python exception is set on failure,
+ * instead -1 is returned and the HyperLogLog is left in sparse representation
+ * (the transformation will be retried on the next register update). */
+int transformToDense(HyperLogLog* self) {
+    SparseIterator it;
+    bool nibbles = self->layout == LAYOUT_U4;
+    uint8_t* registers = (uint8_t*)calloc(nibbles ? self->size : layoutBytes(self->size, self->layout), sizeof(uint8_t));
+
+    if (registers == NULL || flushRegisterBuffer(self) < 0) {
+        free(registers);
         return -1;
     }
 
-    self->added = 0;
-    self->cache = 0;
-    self->isCached = 0;
-    self->listSize = 0;
-    self->size = 1UL << self->p;
-    self->histogram = (uint64_t*)calloc(65, sizeof(uint64_t)); /* Keep a count of register values */
-    self->histogram[0] = self->size; /* Set the zeroes count */
-    self->nodeCache = NULL;
-    self->registers = NULL;
+    initSparseIterator(&it, self, 0, 0);
+
+    while (nextSparseRegister(&it)) {
+        setRegisterIn(registers, nibbles || self->layout == LAYOUT_U8, it.index, it.fsb);
+    }
+
+    if (nibbles) { /* Encode the registers relative to their minimum */
+        uint8_t* values = registers;
+        registers = (uint8_t*)malloc(layoutBytes(self->size, LAYOUT_U4));
+
+        if (registers == NULL) {
+            free(values);
+            return -1;
+        }
+
+        self->registers = registers;
+
+        if (encodeNibbleRegisters(self, values) < 0) {
+            self->registers = NULL;
+            free(registers);
+            free(values);
+            return -1;
+        }
+
+        free(values);
+    }
+
+    free(self->sparseRegisterList);
+    free(self->sparseRegisterBuffer);
+    free(self->bufferSlots);
+
+    self->registers = registers;
     self->sparseRegisterList = NULL;
     self->sparseRegisterBuffer = NULL;
+    self->bufferSlots = NULL;
+    self->listBytes = 0;
+    self->isCacheValid = 0;
+    self->isSparse = 0;
 
-    if (sparse) {
-        self->isSparse = 1;
+    return 0;
+}
 
-        if (maxSparseListSize > 0) {
-            self->maxListSize = maxSparseListSize;
-        } else {
-            uint64_t defaultSize = self->size/4;
-            uint64_t maxDefaultSize = 1 << 20;
 
-            if (maxDefaultSize < defaultSize) {
-                self->maxListSize = maxDefaultSize;
-            } else if (defaultSize <= 4) { /* This shouldn't happen, but do something reasonable if it does */
-                self->maxListSize = 2;
-            } else {
-                self->maxListSize = defaultSize;
-            }
+/* Computes the register histogram, and HIP estimate if enabled, that the
+ * HyperLogLog would have if the buffer were flushed without modifying the
+ * HyperLogLog. The buffer is sorted in a copy and the register list is only
+ * read. Returns -1 on failure to allocate memory. */
+static int foldRegisterBuffer(const HyperLogLog* self, uint64_t* histogram, double* hipEstimate)
+{
+    SparseIterator it;
+    SparseEntry* copy;
+    SparseEntry* buffer;
+    uint64_t n = self->bufferSize;
+    uint64_t i = 0;
+    uint8_t* updates = NULL;
+    double hipProbability = self->hipProbability;
+    bool hip = self->useHip && self->isHipValid;
+
+    if (self->isConcurrent) {
+        countConcurrentRegisters(self, histogram);
+        *hipEstimate = 0;
+        return 0;
+    }
+
+    if (self->isReadOnly) { /* The writer of the file may be updating the mapped histogram */
+        countDenseRegisters(self->registers, self->size, histogram);
+        *hipEstimate = 0;
+        return 0;
+    }
+
+    memcpy(histogram, self->histogram, 65*sizeof(uint64_t));
+    *hipEstimate = self->hipEstimate;
+
+    if (n == 0) {
+        return 0;
+    }
+
+    copy = (SparseEntry*)malloc(2*n*sizeof(SparseEntry));
+
+    if (hip) {
+        updates = (uint8_t*)calloc(2*n, sizeof(uint8_t));
+    }
+
+    if (copy == NULL || (hip && updates == NULL)) {
+        free(copy);
+        free(updates);
+        return -1;
+    }
+
+    memcpy(copy, self->sparseRegisterBuffer, n*sizeof(SparseEntry));
+    buffer = sortEntries(copy, copy + n, n, self->p);
+
+    initSparseIterator(&it, self, 0, 0);
+    bool hasNext = nextSparseRegister(&it);
+
+    while (i < n) {
+        uint64_t index = buffer[i].index;
+        uint8_t fsb = 0;
+        uint8_t cur = 0;
+
+        while (hasNext && it.index < index) {
+            hasNext = nextSparseRegister(&it);
         }
 
-        if (maxSparseBufferSize > 0) {
-            self->maxBufferSize = maxSparseBufferSize;
-        } else {
-            uint64_t defaultSize = self->maxListSize/2;
-            uint64_t maxDefaultSize = 200000;
+        if (hasNext && it.index == index) {
+            cur = it.fsb;
+        }
 
-            if (maxDefaultSize < defaultSize) {
-                self->maxBufferSize = maxDefaultSize;
-            } else {
-                self->maxBufferSize = defaultSize;
+        if (hip) {
+            recordHipUpdates(buffer, i, n, cur, updates);
+        }
+
+        for (; i < n && buffer[i].index == index; i++) {
+            if (buffer[i].fsb > fsb) {
+                fsb = buffer[i].fsb;
             }
         }
 
-        self->sparseRegisterBuffer = (struct Node*)malloc(sizeof(struct Node) * self->maxBufferSize);
+        if (fsb > cur) {
+            histogram[cur]--;
+            histogram[fsb]++;
+        }
+    }
+
+    if (hip) {
+        replayHipUpdates(self, updates, n, hipEstimate, &hipProbability);
+    }
+
+    free(copy);
+    free(updates);
+
+    return 0;
+}
+
+
+/* Gets the register value at the specified index. */
+static inline uint64_t
+getSparseRegister(HyperLogLog* self, uint64_t index)
+{
+    SparseIterator it;
+
+    if (self->bufferSize > 0) {
+        flushRegisterBuffer(self);
+    }
+
+    /* Can we used the cache? */
+    if (self->isCacheValid && self->cacheIndex <= index) {
+        if (self->cacheIndex == index) {
+            return self->cacheFsb;
+        }
+
+        initSparseIterator(&it, self, self->cacheNext, self->cacheIndex);
     } else {
-        uint64_t bytes = (self->size*6)/8 + 1;
-        self->registers = (uint8_t*)calloc(bytes, sizeof(uint8_t));
+        initSparseIterator(&it, self, 0, 0);
+    }
 
-        if (self->registers == NULL) {
-            char* msg = (char*)malloc(128 * sizeof(char));
-            sprintf(msg, "Failed to allocate %lu bytes. Use a smaller p.", bytes);
-            PyErr_SetString(PyExc_MemoryError, msg);
-            return -1;
+    while (nextSparseRegister(&it)) {
+
+        if (it.index > index) {
+            return 0;
+        } else if (it.index == index) {
+            self->cacheIndex = it.index;
+            self->cacheFsb = it.fsb;
+            self->cacheNext = it.pos - self->sparseRegisterList;
+            self->isCacheValid = 1;
+            return it.fsb;
+        }
+    }
+
+    return 0;
+}
+
+
+/* Sets a sparse register. This function does not set the register immediately
+ * but instead adds it to the temporary buffer. Register updates will occur
+ * when the buffer is next cleared.
+ *
+ * Repeated indices are combined in the buffer so that frequently added
+ * elements don't fill it. Each index maps to a slot holding the buffer
+ * position where the index was last added. If the register at that position
+ * still has the same index it is updated in place. Slots are not cleared on
+ * flush since positions past the end of the buffer are ignored, and a stale
+ * position holding the same index is still a valid place to update. */
+static inline void setSparseRegister(HyperLogLog* self, uint64_t index, uint8_t fsb)
+{
+    uint32_t* slot = &self->bufferSlots[index & self->slotMask];
+    SparseEntry* buffer = self->sparseRegisterBuffer;
+
+    if (*slot < self->bufferSize && buffer[*slot].index == index) {
+        if (fsb <= buffer[*slot].fsb) {
+            return;
+        }
+
+        /* The HIP estimator needs every update so these are kept */
+        if (!self->useHip || !self->isHipValid) {
+            buffer[*slot].fsb = fsb;
+            return;
         }
     }
 
+    /* Flush the buffer if it is full. If that fails the register is dropped
+     * rather than overwriting a buffered register. */
+    if (self->bufferSize >= self->maxBufferSize && flushRegisterBuffer(self) < 0) {
+        return;
+    }
+
+    buffer[self->bufferSize].index = index;
+    buffer[self->bufferSize].seq = (uint32_t)self->bufferSize;
+    buffer[self->bufferSize].fsb = fsb;
+    *slot = (uint32_t)self->bufferSize;
+    self->bufferSize++;
+}
+
+
+/* ====================== HyperLogLog object methods ======================= */
+
+
+/*
+ * Updates without the GIL
+ * -----------------------
+ *
+ * add_many(), add_hashes() and add_file() update the registers with the GIL
+ * released. Nothing stops another Python thread from using the HyperLogLog
+ * meanwhile, which could free or reallocate the registers or the sparse list
+ * underneath the update. Each such update is counted in busy, and while busy
+ * is nonzero other methods raise RuntimeError. Concurrent HyperLogLogs update
+ * registers atomically and never reallocate them, so they can be used during
+ * these updates, except by methods which replace the registers.
+ */
+
+/* Checks that the HyperLogLog isn't being updated without the GIL. Methods
+ * which replace the registers set exclusive to also refuse concurrent
+ * HyperLogLogs. Returns -1 and raises RuntimeError if busy. */
+static int checkNotBusy(const HyperLogLog* self, bool exclusive)
+{
+    if (self->busy > 0 && (exclusive || !self->isConcurrent)) {
+        PyErr_SetString(PyExc_RuntimeError, "HyperLogLog is being updated by another thread");
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/* Checks that the HyperLogLog may be updated. Returns -1 and raises TypeError
+ * if it is a memory-mapped HyperLogLog opened read-only. */
+static int checkWritable(const HyperLogLog* self)
+{
+    if (self->isReadOnly) {
+        PyErr_SetString(PyExc_TypeError, "Cannot update a read-only memory-mapped HyperLogLog");
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/* Marks the start of an update which releases the GIL. Must be called while
+ * holding the GIL and followed by endUpdate(). Returns -1 and raises
+ * RuntimeError if another update of a non-concurrent HyperLogLog is running. */
+static int beginUpdate(HyperLogLog* self)
+{
+    if (checkNotBusy(self, false) < 0) return -1;
+
+    self->busy++;
+
     return 0;
 }
 
 
-/* Merges another HyperLogLog into the current HyperLogLog. The registers of
- * the other HyperLogLog are unaffected. */
-static PyObject* HyperLogLog_merge(HyperLogLog* self, PyObject* args)
+/* Marks the end of an update started by beginUpdate(). */
+static void endUpdate(HyperLogLog* self)
+{
+    self->busy--;
+}
+
+
+/* Set a HyperLogLog register. This is a convenience function intended to make
+ * register updates representation agnostic. Returns 1 if the register was
+ * raised, 0 if not and -1 on failure to allocate memory, in which case the
+ * register is unchanged. */
+static inline int setRegister(HyperLogLog* self, uint64_t index, uint8_t newFsb) {
+    if (self->isConcurrent) {
+        addAtomic(&self->added, 1);
+        return raiseRegisterAtomic(self->registers, index, newFsb);
+    }
+
+    self->added++; /* Increment method call counter */
+
+    if (self->isSparse) {
+        setSparseRegister(self, index, newFsb);
+
+        /* Switch to dense representation? */
+        if (self->listBytes >= self->maxListSize) {
+            transformToDense(self);
+        }
+
+        self->isCached = 0;
+    } else {
+        uint64_t fsb = getDense(self, index);
+
+        if (newFsb > fsb) {
+            if (setDense(self, index, newFsb) < 0) {
+                return -1;
+            }
+
+            if (self->useHip && self->isHipValid) {
+                hipUpdate(&self->hipEstimate, &self->hipProbability, (uint8_t)fsb, newFsb, self->p, self->size);
+            }
+
+            self->histogram[newFsb] += 1; /* Increment the new count */
+            self->isCached = 0;
+
+            if (self->histogram[fsb] == 0) {
+                self->histogram[0] -= 1;
+            } else {
+                self->histogram[fsb] -= 1;
+            }
+
+            if (self->layout == LAYOUT_U4 && fsb == self->curMin) {
+                rebaseNibbleRegisters(self);
+            }
+
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/* Gets the a register value by index */
+static PyObject* HyperLogLog_get_register(HyperLogLog* self, PyObject* args)
+{
+    unsigned long index;
+    uint64_t fsb;
+
+    if (!PyArg_ParseTuple(args, "k", &index)) return NULL;
+    if (!isValidIndex(index, self->size)) return NULL;
+    if (checkNotBusy(self, false) < 0) return NULL;
+
+    if (self->isSparse) {
+        fsb = getSparseRegister(self, index);
+    } else {
+        fsb = getDense(self, index);
+    }
+
+    return Py_BuildValue("k", fsb);
+}
+
+
+/* Writes the value of every register to values, one byte per register.
+ * Returns -1 and sets an exception on failure. */
+static int copyRegisters(HyperLogLog* self, uint8_t* values)
+{
+    SparseIterator it;
+
+    if (!self->isSparse) {
+        copyDenseRegisters(self, values);
+        return 0;
+    }
+
+    if (flushRegisterBuffer(self) < 0) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    memset(values, 0, self->size);
+    initSparseIterator(&it, self, 0, 0);
+
+    while (nextSparseRegister(&it)) {
+        values[it.index] = it.fsb;
+    }
+
+    return 0;
+}
+
+
+/* Gets the values of every register as a bytearray, or writes them to a
+ * writable buffer of size() bytes and returns it. */
+static PyObject* HyperLogLog_get_registers(HyperLogLog* self, PyObject* args)
+{
+    PyObject* out = Py_None;
+    Py_buffer view;
+
+    if (!PyArg_ParseTuple(args, "|O", &out)) return NULL;
+    if (checkNotBusy(self, false) < 0) return NULL;
+
+    if (out == Py_None) {
+        PyObject* values = PyByteArray_FromStringAndSize(NULL, (Py_ssize_t)self->size);
+
+        if (values != NULL && copyRegisters(self, (uint8_t*)PyByteArray_AS_STRING(values)) < 0) {
+            Py_CLEAR(values);
+        }
+
+        return values;
+    }
+
+    if (PyObject_GetBuffer(out, &view, PyBUF_WRITABLE | PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) < 0) {
+        return NULL;
+    }
+
+    if (view.itemsize != 1 || (uint64_t)view.len != self->size) {
+        PyErr_Format(PyExc_ValueError, "out must be a buffer of %llu one byte items",
+                     (unsigned long long)self->size);
+        PyBuffer_Release(&view);
+        return NULL;
+    }
+
+    if (copyRegisters(self, (uint8_t*)view.buf) < 0) {
+        PyBuffer_Release(&view);
+        return NULL;
+    }
+
+    PyBuffer_Release(&view);
+    Py_INCREF(out);
+
+    return out;
+}
+
+
+/* Gets a read-only memoryview of the registers, see HyperLogLog_getbuffer(). */
+static PyObject* HyperLogLog_registers_view(HyperLogLog* self, PyObject* args)
+{
+    return PyMemoryView_FromObject((PyObject*)self);
+}
+
+
+/* Exports the registers as a read-only buffer of unsigned bytes, one per
+ * register. Dense registers using the u8 layout are exported without copying
+ * and reflect later updates. Other layouts and sparse registers are exported
+ * as a copy made when the buffer is requested, which is freed when the buffer
+ * is released. */
+static int HyperLogLog_getbuffer(HyperLogLog* self, Py_buffer* view, int flags)
+{
+    uint8_t* values = self->registers;
+
+    if (checkNotBusy(self, false) < 0) {
+        view->obj = NULL;
+        return -1;
+    }
+
+    if (self->isSparse || self->layout != LAYOUT_U8) {
+        if ((values = (uint8_t*)malloc(self->size)) == NULL) {
+            view->obj = NULL;
+            PyErr_NoMemory();
+            return -1;
+        }
+
+        if (copyRegisters(self, values) < 0) {
+            view->obj = NULL;
+            free(values);
+            return -1;
+        }
+    }
+
+    if (PyBuffer_FillInfo(view, (PyObject*)self, values, (Py_ssize_t)self->size, 1, flags) < 0) {
+        if (values != self->registers) free(values);
+        return -1;
+    }
+
+    view->internal = values != self->registers ? values : NULL; /* Copy to free on release */
+    self->exports++;
+
+    return 0;
+}
+
+
+static void HyperLogLog_releasebuffer(HyperLogLog* self, Py_buffer* view)
+{
+    free(view->internal);
+    self->exports--;
+}
+
+
+static PyBufferProcs HyperLogLog_as_buffer = {
+    (getbufferproc)HyperLogLog_getbuffer,     /* bf_getbuffer */
+    (releasebufferproc)HyperLogLog_releasebuffer, /* bf_releasebuffer */
+};
+
+
+/* Gets a dictionary of internal attributes and their values */
+static PyObject* HyperLogLog__get_meta(HyperLogLog* self, PyObject* args)
+{
+    char version[8];
+    sprintf(version, "%u.%u.%u", PY_MAJOR_VERSION, PY_MINOR_VERSION, PY_MICRO_VERSION);
+
+    uint64_t cacheIndex = self->isCacheValid ? self->cacheIndex : 0;
+    uint64_t cacheValue = self->isCacheValid ? self->cacheFsb : 0;
+
+    return Py_BuildValue("{s:k,s:k,s:k,s:k,s:k,s:i,s:i,s:i,s:s,s:s,s:i,s:i,s:k,s:k,s:k,s:k,s:s,s:s}",
+        "added", self->added,
+        "list_size", self->listSize,
+        "list_bytes", self->listBytes,
+        "buffer_size", self->bufferSize,
+        "cache", self->cache,
+        "is_cached", self->isCached,
+        "is_sparse", self->isSparse,
+        "is_mapped", self->isMapped,
+        "layout", layoutName(self->layout),
+        "hash", hashName(self->hashKind),
+        "hip", self->useHip && self->isHipValid,
+        "concurrent", self->isConcurrent,
+        "max_list_size", self->maxListSize,
+        "max_buffer_size", self->maxBufferSize,
+        "node_cache_index", cacheIndex,
+        "node_cache_value", cacheValue,
+        "py_version", version,
+        "hll_version", HLL_VERSION
+    );
+}
+
+
+/* Gets a histogram of first set bit positions as a list of ints. */
+static PyObject* HyperLogLog__histogram(HyperLogLog* self)
+{
+    PyObject* histogram;
+    uint64_t counts[65];
+    double hipEstimate;
+
+    if (checkNotBusy(self, false) < 0) return NULL;
+
+    if (foldRegisterBuffer(self, counts, &hipEstimate) < 0) {
+        return PyErr_NoMemory();
+    }
+
+    histogram = PyList_New(65);
+
+    for (int i = 0; i < 65; i++) {
+        PyObject* count = Py_BuildValue("i", counts[i]);
+        PyList_SetItem(histogram, i, count);
+    }
+
+    return histogram;
+}
+
+
+static void unmapFile(HyperLogLog* self);
+
+static void HyperLogLog_dealloc(HyperLogLog* self)
+{
+    if (self->isMapped) {
+        unmapFile(self);
+    } else {
+        free(self->histogram);
+        free(self->registers);
+    }
+
+    free(self->sparseRegisterList);
+    free(self->sparseRegisterBuffer);
+    free(self->bufferSlots);
+    free(self->auxTable);
+
+    Py_TYPE(self)->tp_free((PyObject*) self);
+}
+
+
+/* Updates the register selected by a hash. Returns 1 if a register was
+ * updated, 0 if not and -1 on failure to allocate memory. This does not use
+ * the Python API so it is safe to call without holding the GIL. */
+static inline int addHash(HyperLogLog* self, uint64_t hash)
+{
+    uint64_t index;
+    uint8_t newFsb;
+
+    splitHash(hash, self->p, self->hashKind, &index, &newFsb);
+
+    return setRegister(self, index, newFsb);
+}
+
+
+/* Merges densely encoded registers, using either the 6 bit or the one byte
+ * per register layout, into a HyperLogLog. Returns the number of registers
+ * updated (updates are only counted in dense representation) or -1 on failure
+ * to allocate memory. */
+static int64_t mergeDenseRegisters(HyperLogLog* self, const uint8_t* regs, bool unpacked)
+{
+    int64_t updated = 0;
+    uint8_t* values;
+
+    if (self->isConcurrent) {
+        for (uint64_t i = 0; i < self->size; i++) {
+            updated += raiseRegisterAtomic(self->registers, i, getRegisterIn(regs, unpacked, i));
+        }
+
+        return updated;
+    } else if (!self->isSparse && self->layout == LAYOUT_U4 && (values = decodeDenseRegisters(self)) != NULL) {
+        updated = maxRegisters(values, true, regs, unpacked, self->size);
+
+        if (updated == 0 || encodeNibbleRegisters(self, values) == 0) {
+            if (updated > 0) {
+                countRegisters(values, true, self->size, self->histogram);
+                self->isCached = 0;
+            }
+
+            free(values);
+            return updated;
+        }
+
+        free(values); /* Fall back to setting the registers one at a time */
+        updated = 0;
+    } else if (!self->isSparse && self->layout != LAYOUT_U4) {
+        updated = maxRegisters(self->registers, self->layout == LAYOUT_U8, regs, unpacked, self->size);
+
+        if (updated > 0) {
+            countRegisters(self->registers, self->layout == LAYOUT_U8, self->size, self->histogram);
+            self->isCached = 0;
+        }
+
+        return updated;
+    }
+
+    /* Sparse, or out of memory to re-encode 4 bit registers */
+
+    for (uint64_t i = 0; i < self->size; i++) {
+        uint8_t fsb = getRegisterIn(regs, unpacked, i);
+        int status;
+
+        if (fsb > 0) {
+            if ((status = setRegister(self, i, fsb)) < 0) return -1;
+            updated += status;
+        }
+    }
+
+    return updated;
+}
+
+
+/* Gets the bytes an element is hashed from. str is hashed as UTF-8, bytes
+ * and other bytes-like objects as their bytes and int as the 8 bytes of its
+ * 64 bit two's complement value in little-endian order. Integers are written
+ * to scratch. Bytes-like objects other than bytes are exported to view, which
+ * must be released using PyBuffer_Release() if view->obj is not NULL. Returns
+ * -1 and sets an exception if the element can't be hashed. */
+static int getElementBytes(PyObject* item, const char** data, Py_ssize_t* len, uint8_t* scratch, Py_buffer* view)
+{
+    view->obj = NULL;
+
+    if (PyUnicode_Check(item)) {
+        *data = PyUnicode_AsUTF8AndSize(item, len);
+        return *data == NULL ? -1 : 0;
+    } else if (PyBytes_Check(item)) {
+        *data = PyBytes_AS_STRING(item);
+        *len = PyBytes_GET_SIZE(item);
+        return 0;
+    } else if (PyLong_Check(item)) {
+        int overflow;
+        uint64_t value = (uint64_t)PyLong_AsLongLongAndOverflow(item, &overflow);
+
+        if (overflow > 0) { /* Unsigned 64 bit integers are also accepted */
+            value = PyLong_AsUnsignedLongLong(item);
+        }
+
+        if (overflow < 0 || PyErr_Occurred()) {
+            PyErr_Clear();
+            PyErr_SetString(PyExc_OverflowError, "int elements must fit in 64 bits");
+            return -1;
+        }
+
+        for (int i = 0; i < 8; i++) {
+            scratch[i] = (uint8_t)(value >> (8*i));
+        }
+
+        *data = (const char*)scratch;
+        *len = 8;
+        return 0;
+    } else if (PyObject_CheckBuffer(item)) {
+        if (PyObject_GetBuffer(item, view, PyBUF_SIMPLE) < 0) {
+            view->obj = NULL;
+            return -1;
+        }
+
+        *data = (const char*)view->buf;
+        *len = view->len;
+        return 0;
+    }
+
+    PyErr_Format(PyExc_TypeError, "elements must be str, bytes-like or int, not %.100s", Py_TYPE(item)->tp_name);
+    return -1;
+}
+
+
+/* Hashes an element of any supported type. Returns -1 and sets an exception
+ * if the element can't be hashed. */
+static int hashObject(PyObject* item, uint64_t seed, uint8_t hashKind, uint64_t* hash)
+{
+    const char* data;
+    Py_ssize_t dataLen;
+    uint8_t scratch[8];
+    Py_buffer view;
+
+    if (getElementBytes(item, &data, &dataLen, scratch, &view) < 0) return -1;
+
+    *hash = hashElement(data, dataLen, seed, hashKind);
+
+    if (view.obj != NULL) {
+        PyBuffer_Release(&view);
+    }
+
+    return 0;
+}
+
+
+/* Add an element. */
+static PyObject* HyperLogLog_add(HyperLogLog* self, PyObject* args)
+{
+    PyObject* item;
+    uint64_t hash;
+
+    if (!PyArg_ParseTuple(args, "O", &item)) return NULL;
+    if (checkNotBusy(self, false) < 0 || checkWritable(self) < 0) return NULL;
+    if (hashObject(item, self->seed, self->hashKind, &hash) < 0) return NULL;
+
+    int updated = addHash(self, hash);
+
+    if (updated < 0) {
+        return PyErr_NoMemory();
+    } else if (updated) {
+        Py_RETURN_TRUE;
+    } else {
+        Py_RETURN_FALSE;
+    }
+};
+
+
+/*
+ * Parallel ingestion
+ * ------------------
+ *
+ * A HyperLogLog can only be updated by one thread at a time. To ingest on
+ * multiple cores each worker thread is given a slice of the elements and a
+ * private, densely encoded register array. Workers never share memory they
+ * write to so no locking is required. Once all elements have been processed
+ * the private arrays are merged into the HyperLogLog by taking the maximum of
+ * each register. Because a HyperLogLog union is exact the result is the same
+ * as if the elements were added one at a time.
+ */
+typedef struct {
+    const char** data; /* Elements to hash */
+    Py_ssize_t* lengths; /* Length of each element */
+    Py_ssize_t count; /* Number of elements */
+    uint64_t seed; /* Hash function seed */
+    uint8_t hashKind; /* Hash function and how hashes select registers */
+    unsigned short p; /* 2^p = number of registers */
+    uint8_t* registers; /* Private densely encoded registers */
+    bool unpacked; /* If the private registers use one byte each */
+#ifndef _WIN32
+    pthread_t thread;
+    bool started; /* If the worker is running on its own thread */
+#endif
+} IngestWorker;
+
+
+/* Hashes a slice of elements into the worker's private registers. */
+static void* runIngestWorker(void* arg)
+{
+    IngestWorker* worker = (IngestWorker*)arg;
+    uint64_t index;
+    uint8_t fsb;
+
+    for (Py_ssize_t i = 0; i < worker->count; i++) {
+        uint64_t hash = hashElement(worker->data[i], worker->lengths[i], worker->seed, worker->hashKind);
+        splitHash(hash, worker->p, worker->hashKind, &index, &fsb);
+
+        if (fsb > getRegisterIn(worker->registers, worker->unpacked, index)) {
+            setRegisterIn(worker->registers, worker->unpacked, index, fsb);
+        }
+    }
+
+    return NULL;
+}
+
+
+/* Splits n elements between the workers and waits for them to finish. The
+ * first worker runs on the calling thread. If a thread can't be started (or
+ * threads aren't available) the worker runs on the calling thread instead. */
+static void runIngestWorkers(IngestWorker* workers, int nWorkers,
+                             const char** data, Py_ssize_t* lengths, Py_ssize_t n)
+{
+    Py_ssize_t offset = 0;
+
+    for (int i = 0; i < nWorkers; i++) {
+        Py_ssize_t count = n/nWorkers + (i < n % nWorkers ? 1 : 0);
+        workers[i].data = data + offset;
+        workers[i].lengths = lengths + offset;
+        workers[i].count = count;
+        offset += count;
+    }
+
+#ifndef _WIN32
+    for (int i = 1; i < nWorkers; i++) {
+        workers[i].started = pthread_create(&workers[i].thread, NULL, runIngestWorker, &workers[i]) == 0;
+    }
+
+    runIngestWorker(&workers[0]);
+
+    for (int i = 1; i < nWorkers; i++) {
+        if (workers[i].started) {
+            pthread_join(workers[i].thread, NULL);
+        } else {
+            runIngestWorker(&workers[i]);
+        }
+    }
+#else
+    for (int i = 0; i < nWorkers; i++) {
+        runIngestWorker(&workers[i]);
+    }
+#endif
+}
+
+
+/*
+ * Add every element of an iterable of strings or bytes.
+ *
+ * Calling add() once per element is dominated by the cost of the Python to C
+ * transition. Instead elements are pulled from the iterator in chunks: while
+ * holding the GIL we take a reference to each element and a pointer to its
+ * raw bytes, then release the GIL while the chunk is hashed and the registers
+ * are updated. Holding a reference keeps the bytes (and the cached UTF-8 form
+ * of a str) alive until the chunk has been processed.
+ *
+ * If threads > 1 each chunk is split between that many worker threads (see
+ * "Parallel ingestion" above) and the workers' registers are merged into the
+ * HyperLogLog after the last chunk.
+ *
+ * Returns the number of registers updated. As with add() register updates are
+ * only reported in dense representation. If an element has an unsupported
+ * type, or the iterator raises, the elements preceding it are still added.
+ */
+static PyObject* HyperLogLog_add_many(HyperLogLog* self, PyObject* args, PyObject* kwds)
+{
+    static char* kwlist[] = {"iterable", "threads", NULL};
+    PyObject* iterable;
+    PyObject* iterator;
+    PyObject* item;
+    PyObject** items;
+    IngestWorker* workers = NULL;
+    const char** data;
+    Py_ssize_t* lengths;
+    uint8_t (*ints)[8]; /* Bytes of int elements */
+    Py_buffer* views = NULL; /* Exported bytes-like elements, allocated when first needed */
+    Py_buffer view;
+    Py_ssize_t chunkSize = ADD_MANY_CHUNK_SIZE;
+    Py_ssize_t n, i;
+    uint64_t updated = 0;
+    uint64_t added = 0;
+    bool done = 0;
+    int threads = 1;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|i", kwlist, &iterable, &threads)) return NULL;
+    if (checkNotBusy(self, false) < 0 || checkWritable(self) < 0) return NULL;
+
+    if (threads < 1) {
+        PyErr_SetString(PyExc_ValueError, "threads must be at least 1");
+        return NULL;
+    }
+
+    if (self->useHip && self->isHipValid) { /* HIP needs elements in arrival order */
+        threads = 1;
+    }
+
+    if (threads > 1) {
+        bool unpacked = self->isSparse || self->layout != LAYOUT_U6; /* Workers use the fastest layout which can be merged */
+        uint64_t bytes = denseBytes(self->size, unpacked);
+        chunkSize = (Py_ssize_t)threads * ADD_MANY_THREAD_CHUNK_SIZE;
+        workers = (IngestWorker*)calloc(threads, sizeof(IngestWorker));
+
+        if (workers == NULL) return PyErr_NoMemory();
+
+        for (i = 0; i < threads; i++) {
+            workers[i].seed = self->seed;
+            workers[i].hashKind = self->hashKind;
+            workers[i].p = self->p;
+            workers[i].unpacked = unpacked;
+            workers[i].registers = (uint8_t*)calloc(bytes, sizeof(uint8_t));
+
+            if (workers[i].registers == NULL) {
+                while (i >= 0) free(workers[i--].registers);
+                free(workers);
+                return PyErr_NoMemory();
+            }
+        }
+    }
+
+    iterator = PyObject_GetIter(iterable);
+    items = (PyObject**)malloc(chunkSize * sizeof(PyObject*));
+    data = (const char**)malloc(chunkSize * sizeof(char*));
+    lengths = (Py_ssize_t*)malloc(chunkSize * sizeof(Py_ssize_t));
+    ints = (uint8_t (*)[8])malloc(chunkSize * sizeof(*ints));
+
+    if (iterator == NULL) {
+        done = 1;
+    } else if (items == NULL || data == NULL || lengths == NULL || ints == NULL) {
+        PyErr_NoMemory();
+        done = 1;
+    }
+
+    while (!done) {
+
+        /* Collect the next chunk of elements while holding the GIL */
+        for (n = 0; n < chunkSize; n++) {
+            item = PyIter_Next(iterator);
+
+            if (item == NULL) {
+                done = 1;
+                break;
+            }
+
+            if (getElementBytes(item, &data[n], &lengths[n], ints[n], &view) < 0) {
+                Py_DECREF(item);
+                done = 1;
+                break;
+            }
+
+            if (view.obj != NULL) { /* Keep the buffer exported while hashing without the GIL */
+                if (views == NULL && (views = (Py_buffer*)calloc(chunkSize, sizeof(Py_buffer))) == NULL) {
+                    PyBuffer_Release(&view);
+                    Py_DECREF(item);
+                    PyErr_NoMemory();
+                    done = 1;
+                    break;
+                }
+
+                views[n] = view;
+            }
+
+            items[n] = item;
+        }
+
+        /* Hash and update the registers without the GIL. Workers only
+         * update their private registers so don't need to mark the update. */
+        if (workers != NULL) {
+            Py_BEGIN_ALLOW_THREADS
+            runIngestWorkers(workers, threads, data, lengths, n);
+            Py_END_ALLOW_THREADS
+            added += n;
+        } else if (beginUpdate(self) == 0) {
+            int status = 0;
+
+            Py_BEGIN_ALLOW_THREADS
+            for (i = 0; i < n; i++) {
+                uint64_t hash = hashElement(data[i], lengths[i], self->seed, self->hashKind);
+
+                if ((status = addHash(self, hash)) < 0) break;
+                updated += status;
+            }
+            Py_END_ALLOW_THREADS
+            endUpdate(self);
+            added += n;
+
+            if (status < 0) {
+                PyErr_NoMemory();
+                done = 1;
+            }
+        } else {
+            done = 1;
+        }
+
+        for (i = 0; i < n; i++) {
+            if (views != NULL && views[i].obj != NULL) {
+                PyBuffer_Release(&views[i]);
+            }
+
+            Py_DECREF(items[i]);
+        }
+    }
+
+    if (workers != NULL && beginUpdate(self) == 0) {
+        int64_t merged;
+
+        /* Reduce the workers' registers into the first worker then merge the
+         * result. The element count is kept rather than the number of merged
+         * registers. */
+        Py_BEGIN_ALLOW_THREADS
+        for (i = 1; i < threads; i++) {
+            maxRegisters(workers[0].registers, workers[0].unpacked, workers[i].registers, workers[i].unpacked, self->size);
+        }
+
+        if (self->isConcurrent) {
+            merged = mergeDenseRegisters(self, workers[0].registers, workers[0].unpacked);
+            addAtomic(&self->added, added);
+        } else {
+            added += self->added;
+            merged = mergeDenseRegisters(self, workers[0].registers, workers[0].unpacked);
+            self->added = added;
+        }
+        Py_END_ALLOW_THREADS
+
+        endUpdate(self);
+
+        if (merged < 0) {
+            PyErr_NoMemory();
+        } else {
+            updated = merged;
+        }
+    }
+
+    if (workers != NULL) {
+        for (i = 0; i < threads; i++) {
+            free(workers[i].registers);
+        }
+
+        free(workers);
+    }
+
+    free(items);
+    free(data);
+    free(lengths);
+    free(ints);
+    free(views);
+    Py_XDECREF(iterator);
+
+    if (PyErr_Occurred()) return NULL;
+
+    return Py_BuildValue("K", updated);
+}
+
+
+/*
+ * Adding the records of a file
+ * ----------------------------
+ *
+ * add_file() adds every record of a file without creating a Python object per
+ * record. On POSIX systems regular files are memory-mapped and records are
+ * hashed straight from the mapped pages. Other files (pipes, or any file on
+ * Windows) are read in large blocks, and a record split by the end of a block
+ * is carried over to the next block. Records are found using memchr() and the
+ * GIL is released while the file is read and hashed.
+ *
+ * If threads > 1 the mapped file, or each block, is split between the worker
+ * threads at record boundaries. As with add_many() the workers hash into
+ * private registers which are merged into the HyperLogLog at the end.
+ */
+typedef struct {
+    const char* start; /* First record */
+    const char* end; /* End of the last record */
+    char delimiter; /* Byte which ends each record */
+    bool skipEmpty; /* If empty records are skipped */
+    HyperLogLog* hll; /* HyperLogLog to update, or NULL to use private registers */
+    uint64_t seed; /* Hash function seed */
+    uint8_t hashKind; /* Hash function and how hashes select registers */
+    unsigned short p; /* 2^p = number of registers */
+    uint8_t* registers; /* Private densely encoded registers */
+    bool unpacked; /* If the private registers use one byte each */
+    uint64_t records; /* Number of records hashed */
+    uint64_t updated; /* Number of registers of hll updated */
+    bool failed; /* If hll couldn't be updated for lack of memory */
+#ifndef _WIN32
+    pthread_t thread;
+    bool started; /* If the worker is running on its own thread */
+#endif
+} FileWorker;
+
+
+/* Hashes the records between start and end. The last record does not need
+ * to be followed by a delimiter. */
+static void* runFileWorker(void* arg)
+{
+    FileWorker* worker = (FileWorker*)arg;
+    const char* pos = worker->start;
+    uint64_t index;
+    uint8_t fsb;
+
+    while (pos < worker->end) {
+        const char* next = (const char*)memchr(pos, worker->delimiter, worker->end - pos);
+        size_t len = (next != NULL ? next : worker->end) - pos;
+
+        if (len > 0 || !worker->skipEmpty) {
+            uint64_t hash = hashElement(pos, len, worker->seed, worker->hashKind);
+            worker->records++;
+
+            if (worker->hll != NULL) {
+                int status = addHash(worker->hll, hash);
+
+                if (status < 0) {
+                    worker->failed = 1;
+                    return NULL;
+                }
+
+                worker->updated += status;
+            } else {
+                splitHash(hash, worker->p, worker->hashKind, &index, &fsb);
+
+                if (fsb > getRegisterIn(worker->registers, worker->unpacked, index)) {
+                    setRegisterIn(worker->registers, worker->unpacked, index, fsb);
+                }
+            }
+        }
+
+        if (next == NULL) break;
+        pos = next + 1;
+    }
+
+    return NULL;
+}
+
+
+/* Splits the records between start and end evenly between the workers, moving
+ * each split past the next delimiter, and waits for the workers to finish. As
+ * in runIngestWorkers() the first worker runs on the calling thread. */
+static void runFileWorkers(FileWorker* workers, int nWorkers, const char* start, const char* end)
+{
+    const char* pos = start;
+
+    for (int i = 0; i < nWorkers; i++) {
+        const char* split = end;
+
+        if (i < nWorkers - 1) {
+            split = start + (end - start)/nWorkers*(i + 1);
+
+            if (split <= pos) {
+                split = pos;
+            } else {
+                const char* next = (const char*)memchr(split - 1, workers[i].delimiter, end - split + 1);
+                split = next != NULL ? next + 1 : end;
+            }
+        }
+
+        workers[i].start = pos;
+        workers[i].end = split;
+        pos = split;
+    }
+
+#ifndef _WIN32
+    for (int i = 1; i < nWorkers; i++) {
+        workers[i].started = pthread_create(&workers[i].thread, NULL, runFileWorker, &workers[i]) == 0;
+    }
+
+    runFileWorker(&workers[0]);
+
+    for (int i = 1; i < nWorkers; i++) {
+        if (workers[i].started) {
+            pthread_join(workers[i].thread, NULL);
+        } else {
+            runFileWorker(&workers[i]);
+        }
+    }
+#else
+    for (int i = 0; i < nWorkers; i++) {
+        runFileWorker(&workers[i]);
+    }
+#endif
+}
+
+
+/* Hashes every record of a file using the workers. Returns 0 or an errno
+ * value on failure, ENOMEM if a worker failed to update its HyperLogLog.
+ * Records preceding a read error are still hashed. This does not use the
+ * Python API. */
+static int addFileRecords(FileWorker* workers, int nWorkers, FILE* file)
+{
+    char delimiter = workers[0].delimiter;
+    size_t capacity = (size_t)nWorkers*ADD_FILE_READ_SIZE;
+    size_t carry = 0;
+    size_t n;
+    char* buffer;
+    int err = 0;
+
+#ifndef _WIN32
+    struct stat st;
+
+    if (fstat(fileno(file), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+
+        if (mapping != MAP_FAILED) {
+            posix_madvise(mapping, st.st_size, POSIX_MADV_SEQUENTIAL);
+            runFileWorkers(workers, nWorkers, (const char*)mapping, (const char*)mapping + st.st_size);
+            munmap(mapping, st.st_size);
+            return workers[0].failed ? ENOMEM : 0;
+        }
+    }
+#endif
+
+    /* The file can't be mapped, read it in blocks */
+    if ((buffer = (char*)malloc(capacity)) == NULL) return ENOMEM;
+
+    while ((n = fread(buffer + carry, 1, capacity - carry, file)) > 0) {
+        const char* end = buffer + carry + n;
+        const char* last = end; /* End of the last whole record */
+
+        while (last > buffer && last[-1] != delimiter) last--;
+
+        if (last == buffer) { /* No whole record yet, grow the buffer if it is full */
+            carry += n;
+
+            if (carry == capacity) {
+                char* grown = (char*)realloc(buffer, 2*capacity);
+
+                if (grown == NULL) {
+                    err = ENOMEM;
+                    break;
+                }
+
+                buffer = grown;
+                capacity *= 2;
+            }
+
+            continue;
+        }
+
+        runFileWorkers(workers, nWorkers, buffer, last);
+        carry = end - last;
+        memmove(buffer, last, carry);
+
+        if (workers[0].failed) {
+            err = ENOMEM;
+            break;
+        }
+    }
+
+    if (err == 0 && ferror(file)) {
+        err = EIO;
+    } else if (err == 0 && carry > 0) { /* Last record without a delimiter */
+        runFileWorkers(workers, nWorkers, buffer, buffer + carry);
+        if (workers[0].failed) err = ENOMEM;
+    }
+
+    free(buffer);
+
+    return err;
+}
+
+
+/*
+ * Add every record of a file. Records are separated by a one byte delimiter,
+ * a newline by default, which isn't part of the record. Empty records are
+ * skipped unless skip_empty is False. Records are hashed as bytes, so a line
+ * of a text file is added the same as add() adds its bytes.
+ *
+ * Returns the number of registers updated, as add_many(). If the file can't
+ * be read OSError is raised but records read before the error are still
+ * added.
+ */
+static PyObject* HyperLogLog_add_file(HyperLogLog* self, PyObject* args, PyObject* kwds)
+{
+    static char* kwlist[] = {"path", "delimiter", "skip_empty", "threads", NULL};
+    PyObject* pathObj = NULL;
+    FileWorker* workers;
+    FILE* file;
+    char delimiter = '\n';
+    int skipEmpty = 1;
+    int threads = 1;
+    uint64_t updated = 0;
+    uint64_t records = 0;
+    int64_t merged;
+    int err = 0;
+    int i;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&|cpi", kwlist, PyUnicode_FSConverter, &pathObj,
+                                     &delimiter, &skipEmpty, &threads)) {
+        return NULL;
+    }
+
+    if (checkWritable(self) < 0) {
+        Py_DECREF(pathObj);
+        return NULL;
+    }
+
+    if (threads < 1) {
+        Py_DECREF(pathObj);
+        PyErr_SetString(PyExc_ValueError, "threads must be at least 1");
+        return NULL;
+    }
+
+    if (self->useHip && self->isHipValid) { /* HIP needs elements in arrival order */
+        threads = 1;
+    }
+
+    if ((workers = (FileWorker*)calloc(threads, sizeof(FileWorker))) == NULL) {
+        Py_DECREF(pathObj);
+        return PyErr_NoMemory();
+    }
+
+    for (i = 0; i < threads; i++) {
+        workers[i].delimiter = delimiter;
+        workers[i].skipEmpty = skipEmpty;
+        workers[i].seed = self->seed;
+        workers[i].hashKind = self->hashKind;
+        workers[i].p = self->p;
+
+        if (threads == 1) {
+            workers[i].hll = self;
+            break;
+        }
+
+        workers[i].unpacked = self->isSparse || self->layout != LAYOUT_U6; /* Fastest layout which can be merged */
+        workers[i].registers = (uint8_t*)calloc(denseBytes(self->size, workers[i].unpacked), sizeof(uint8_t));
+
+        if (workers[i].registers == NULL) {
+            while (i >= 0) free(workers[i--].registers);
+            free(workers);
+            Py_DECREF(pathObj);
+            return PyErr_NoMemory();
+        }
+    }
+
+    if (beginUpdate(self) < 0) {
+        for (i = 0; i < threads; i++) {
+            free(workers[i].registers);
+        }
+
+        free(workers);
+        Py_DECREF(pathObj);
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    if ((file = fopen(PyBytes_AS_STRING(pathObj), "rb")) == NULL) {
+        err = errno;
+    } else {
+        err = addFileRecords(workers, threads, file);
+        fclose(file);
+    }
+
+    if (threads > 1) {
+
+        /* Reduce the workers' registers into the first worker then merge the
+         * result, as in add_many() */
+        for (i = 1; i < threads; i++) {
+            maxRegisters(workers[0].registers, workers[0].unpacked, workers[i].registers, workers[i].unpacked, self->size);
+        }
+
+        for (i = 0; i < threads; i++) {
+            records += workers[i].records;
+        }
+
+        if (self->isConcurrent) {
+            merged = mergeDenseRegisters(self, workers[0].registers, workers[0].unpacked);
+            addAtomic(&self->added, records);
+        } else {
+            records += self->added;
+            merged = mergeDenseRegisters(self, workers[0].registers, workers[0].unpacked);
+            self->added = records;
+        }
+
+        if (merged < 0 && err == 0) {
+            err = ENOMEM;
+        } else if (merged >= 0) {
+            updated = merged;
+        }
+    } else {
+        updated = workers[0].updated;
+    }
+    Py_END_ALLOW_THREADS
+
+    endUpdate(self);
+
+    for (i = 0; i < threads; i++) {
+        free(workers[i].registers);
+    }
+
+    free(workers);
+
+    if (err != 0) {
+        errno = err;
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, pathObj);
+        Py_DECREF(pathObj);
+        return NULL;
+    }
+
+    Py_DECREF(pathObj);
+
+    return Py_BuildValue("K", updated);
+}
+
+
+/* Checks if a buffer holds 64 bit integers. Raw byte buffers are accepted if
+ * their length is a multiple of 8. */
+static bool isHashBuffer(Py_buffer* view)
+{
+    const char* format = view->format == NULL ? "B" : view->format;
+
+    if (*format == '@' || *format == '=' || *format == '<' || *format == '>' || *format == '!') {
+        format++;
+    }
+
+    if (view->itemsize == 8 && strchr("qQlLnN", *format) != NULL && format[1] == '\0') {
+        return 1;
+    }
+
+    return strchr("bBc", *format) != NULL && format[1] == '\0' && view->len % 8 == 0;
+}
+
+
+/*
+ * Add pre-computed 64 bit hashes from an object supporting the buffer
+ * protocol, e.g. a numpy uint64 array, array('Q') or memoryview. Each value is
+ * used as the hash of an element so the registers are updated exactly as if
+ * add() had produced that hash. Values are read in native byte order.
+ *
+ * No Python objects are touched while the buffer is processed so the GIL is
+ * released for the whole loop. Returns the number of registers updated.
+ */
+static PyObject* HyperLogLog_add_hashes(HyperLogLog* self, PyObject* args)
+{
+    Py_buffer view;
+    PyObject* obj;
+    uint64_t updated = 0;
+    int status = 0;
+
+    if (!PyArg_ParseTuple(args, "O", &obj)) return NULL;
+    if (checkWritable(self) < 0) return NULL;
+    if (PyObject_GetBuffer(obj, &view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) < 0) return NULL;
+
+    if (!isHashBuffer(&view)) {
+        PyBuffer_Release(&view);
+        PyErr_SetString(PyExc_ValueError, "Expected a buffer of 64 bit integers");
+        return NULL;
+    }
+
+    const char* data = (const char*)view.buf;
+    Py_ssize_t n = view.len / 8;
+
+    if (beginUpdate(self) < 0) {
+        PyBuffer_Release(&view);
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    for (Py_ssize_t i = 0; i < n; i++) {
+        uint64_t hash;
+        memcpy(&hash, data + 8*i, sizeof(uint64_t)); /* The buffer may be unaligned */
+
+        if ((status = addHash(self, hash)) < 0) break;
+        updated += status;
+    }
+    Py_END_ALLOW_THREADS
+
+    endUpdate(self);
+
+    PyBuffer_Release(&view);
+
+    if (status < 0) return PyErr_NoMemory();
+
+    return Py_BuildValue("K", updated);
+}
+
+
+/* Get a cardinality estimate */
+static PyObject* HyperLogLog_cardinality(HyperLogLog* self)
+{
+    const uint64_t* histogram = self->histogram;
+    uint64_t pending[65];
+    double hipEstimate = self->hipEstimate;
+    uint64_t estimate;
+
+    if (checkNotBusy(self, false) < 0) return NULL;
+
+    if (self->isConcurrent) { /* Other threads may be updating the registers */
+        countConcurrentRegisters(self, pending);
+        return Py_BuildValue("K", estimateCardinality(pending, self->p));
+    }
+
+    if (self->isReadOnly) { /* The writer of the file may be updating the mapped histogram */
+        countDenseRegisters(self->registers, self->size, pending);
+        return Py_BuildValue("K", estimateCardinality(pending, self->p));
+    }
+
+    if (self->isCached && !self->isMapped) { /* Mapped files may be updated by other processes */
+        return Py_BuildValue("K", self->cache);
+    }
+
+    /* Include buffered registers without flushing the buffer */
+    if (self->isSparse && self->bufferSize > 0) {
+        if (foldRegisterBuffer(self, pending, &hipEstimate) < 0) {
+            return PyErr_NoMemory();
+        }
+
+        histogram = pending;
+    }
+
+    if (self->useHip && self->isHipValid) {
+        estimate = (uint64_t)round(hipEstimate);
+    } else {
+        estimate = estimateCardinality(histogram, self->p);
+    }
+
+    self->cache = estimate;
+    self->isCached = 1;
+
+    return Py_BuildValue("K", estimate);
+}
+
+
+/* Get a hash of an element using the hash function of the HyperLogLog. */
+static PyObject* HyperLogLog_hash(HyperLogLog* self, PyObject* args)
+{
+    PyObject* item;
+    uint64_t hash;
+
+    if (!PyArg_ParseTuple(args, "O", &item)) return NULL;
+    if (hashObject(item, self->seed, self->hashKind, &hash) < 0) return NULL;
+
+    return Py_BuildValue("K", hash);
+}
+
+
+static int HyperLogLog_init(HyperLogLog* self, PyObject* args, PyObject* kwds)
+{
+    static char* kwlist[] = {"p", "seed", "sparse", "max_sparse_list_size", "max_sparse_buffer_size", "hip", "layout", "hash", "concurrent", NULL};
+    uint64_t maxSparseListSize = 0;
+    uint64_t maxSparseBufferSize = 0;
+    int64_t sparse = 1;
+    int hip = 0;
+    int concurrent = 0;
+    const char* layout = NULL;
+    const char* hash = "murmur64a";
+
+    if (checkNotBusy(self, true) < 0) return -1;
+
+    self->seed = 314;  /* Chosen arbitrarily */
+    self->hashKind = HASH_MURMUR64A;
+    self->p = 12;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|iiikkpssp", kwlist, &self->p, &self->seed, &sparse, &maxSparseListSize, &maxSparseBufferSize, &hip, &layout, &hash, &concurrent)) {
+        return -1;
+    }
+
+    int layoutKind = parseLayout(layout != NULL ? layout : concurrent ? "u8" : "u6");
+    int hashKind = parseHashKind(hash);
+
+    if (layoutKind < 0 || hashKind < 0) {
+        return -1;
+    }
+
+    if (concurrent) {
+#ifndef HLL_ATOMICS
+        PyErr_SetString(PyExc_ValueError, "concurrent is not supported by this build");
+        return -1;
+#endif
+        if (layoutKind != LAYOUT_U8 || hip) {
+            PyErr_SetString(PyExc_ValueError, "concurrent requires layout='u8' and can't be used with hip");
+            return -1;
+        }
+
+        sparse = 0; /* Sparse registers can't be updated atomically */
+    }
+
+    self->hashKind = (uint8_t)hashKind;
+
+    if (self->p < 2 || self->p > 63) {
+        char* msg = "p is out of range";
+        PyErr_SetString(PyExc_ValueError, msg);
+        return -1;
+    }
+
+    self->added = 0;
+    self->cache = 0;
+    self->isCached = 0;
+    self->listSize = 0;
+    self->listBytes = 0;
+    self->size = 1UL << self->p;
+    self->histogram = (uint64_t*)calloc(65, sizeof(uint64_t)); /* Keep a count of register values */
+    self->histogram[0] = self->size; /* Set the zeroes count */
+    self->isCacheValid = 0;
+    self->registers = NULL;
+    self->sparseRegisterList = NULL;
+    self->sparseRegisterBuffer = NULL;
+    self->bufferSlots = NULL;
+    self->isMapped = 0;
+    self->isReadOnly = 0;
+    self->mapping = NULL;
+    self->mappingSize = 0;
+    self->mappedAdded = 0;
+    self->layout = (uint8_t)layoutKind;
+    self->isConcurrent = concurrent;
+    self->curMin = 0;
+    self->auxTable = NULL;
+    self->auxCapacity = 0;
+    self->auxCount = 0;
+    self->useHip = hip;
+    self->isHipValid = hip;
+    self->hipEstimate = 0;
+    self->hipProbability = 1.0;
+
+    if (maxSparseBufferSize > UINT32_MAX) {
+        PyErr_SetString(PyExc_ValueError, "max_sparse_buffer_size is out of range");
+        return -1;
+    }
+
+    if (sparse) {
+        uint64_t denseBytes = (self->size*6)/8 + 1;
+        self->isSparse = 1;
+
+        if (maxSparseBufferSize > 0) {
+            self->maxBufferSize = maxSparseBufferSize;
+        } else { /* Use about a quarter of the memory of the list */
+            uint64_t listBytes = maxSparseListSize > 0 ? maxSparseListSize : denseBytes;
+            uint64_t defaultSize = listBytes/(4*sizeof(struct SparseEntry));
+            uint64_t maxDefaultSize = 200000;
+
+            if (maxDefaultSize < defaultSize) {
+                self->maxBufferSize = maxDefaultSize;
+            } else if (defaultSize < 4) {
+                self->maxBufferSize = 4;
+            } else {
+                self->maxBufferSize = defaultSize;
+            }
+        }
+
+        /* Use one slot per buffered register, up to 2^16 slots */
+        uint64_t slots = 1;
+
+        while (slots < self->maxBufferSize && slots < (1 << 16)) {
+            slots <<= 1;
+        }
+
+        self->slotMask = slots - 1;
+
+        if (maxSparseListSize > 0) {
+            self->maxListSize = maxSparseListSize;
+        } else { /* The list and buffer should use less memory than dense representation */
+            uint64_t bufferBytes = self->maxBufferSize*sizeof(struct SparseEntry) + slots*sizeof(uint32_t);
+            uint64_t maxDefaultSize = 1 << 22;
+
+            if (bufferBytes >= denseBytes) { /* Switch to dense representation on the first flush */
+                self->maxListSize = 1;
+            } else if (maxDefaultSize < denseBytes - bufferBytes) {
+                self->maxListSize = maxDefaultSize;
+            } else {
+                self->maxListSize = denseBytes - bufferBytes;
+            }
+        }
+
+        self->sparseRegisterBuffer = (struct SparseEntry*)malloc(sizeof(struct SparseEntry) * self->maxBufferSize);
+        self->bufferSlots = (uint32_t*)calloc(slots, sizeof(uint32_t));
+
+        if (self->sparseRegisterBuffer == NULL || self->bufferSlots == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+    } else {
+        uint64_t bytes = layoutBytes(self->size, self->layout);
+        self->registers = (uint8_t*)calloc(bytes, sizeof(uint8_t));
+
+        if (self->registers == NULL) {
+            char* msg = (char*)malloc(128 * sizeof(char));
+            sprintf(msg, "Failed to allocate %lu bytes. Use a smaller p.", bytes);
+            PyErr_SetString(PyExc_MemoryError, msg);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+/* Creates an empty HyperLogLog of the given type using the given
+ * representation and layout. */
+static HyperLogLog* newHyperLogLog(PyTypeObject* type, int p, bool sparse, uint8_t layout)
+{
+    PyObject* args = Py_BuildValue("(iii)", p, 0, sparse);
+    PyObject* kwds = layout != LAYOUT_U6 ? Py_BuildValue("{s:s}", "layout", layoutName(layout)) : NULL;
+    PyObject* hll = NULL;
+
+    if (args != NULL && (kwds != NULL || layout == LAYOUT_U6)) {
+        hll = PyObject_Call((PyObject*)type, args, kwds);
+    }
+
+    Py_XDECREF(args);
+    Py_XDECREF(kwds);
+
+    return (HyperLogLog*)hll;
+}
+
+
+/* Creates a HyperLogLog with 2^p registers from the registers of a
+ * HyperLogLog with at least as many registers, see foldRegister(). The
+ * result uses the same representation, layout and hash function. Returns
+ * NULL and sets an exception on failure. */
+static HyperLogLog* foldHyperLogLog(HyperLogLog* self, int p)
+{
+    HyperLogLog* result = newHyperLogLog(Py_TYPE(self), p, self->isSparse, self->layout);
+    int64_t merged;
+    uint64_t index;
+    uint8_t fsb;
+
+    if (result == NULL) return NULL;
+
+    result->seed = self->seed;
+    result->hashKind = self->hashKind;
+
+    if (self->isSparse) {
+        SparseIterator it;
+
+        if (flushRegisterBuffer(self) < 0) {
+            Py_DECREF(result);
+            return (HyperLogLog*)PyErr_NoMemory();
+        }
+
+        initSparseIterator(&it, self, 0, 0);
+
+        while (nextSparseRegister(&it)) {
+            foldRegister(it.index, it.fsb, self->p, p, self->hashKind, &index, &fsb);
+
+            if (setRegister(result, index, fsb) < 0) {
+                Py_DECREF(result);
+                return (HyperLogLog*)PyErr_NoMemory();
+            }
+        }
+    } else {
+        uint8_t* values = decodeDenseRegisters(self);
+        uint8_t* folded = (uint8_t*)calloc(result->size, sizeof(uint8_t));
+
+        if (values == NULL || folded == NULL) {
+            free(values);
+            free(folded);
+            Py_DECREF(result);
+            return (HyperLogLog*)PyErr_NoMemory();
+        }
+
+        foldRegisters(folded, p, values, self->p, self->hashKind);
+        merged = mergeDenseRegisters(result, folded, true);
+        free(values);
+        free(folded);
+
+        if (merged < 0) {
+            Py_DECREF(result);
+            return (HyperLogLog*)PyErr_NoMemory();
+        }
+    }
+
+    result->added = self->added;
+    result->isConcurrent = self->isConcurrent;
+    result->useHip = self->useHip;
+    result->isHipValid = 0; /* The HIP estimate can't be folded */
+
+    return result;
+}
+
+
+/* Folds the registers of a HyperLogLog to 2^p registers in place by swapping
+ * its fields with those of a folded copy. Returns -1 and sets an exception on
+ * failure. */
+static int foldInPlace(HyperLogLog* self, int p)
+{
+    HyperLogLog* folded;
+    HyperLogLog tmp;
+    size_t offset = offsetof(HyperLogLog, registers); /* Leave the object header alone */
+
+    if (self->isMapped) {
+        PyErr_SetString(PyExc_TypeError, "Cannot fold a memory-mapped HyperLogLog");
+        return -1;
+    }
+
+    if (self->exports > 0) {
+        PyErr_SetString(PyExc_BufferError, "Cannot fold a HyperLogLog while its registers are exported");
+        return -1;
+    }
+
+    if (checkNotBusy(self, true) < 0) return -1;
+
+    if ((folded = foldHyperLogLog(self, p)) == NULL) return -1;
+
+    memcpy((char*)&tmp + offset, (char*)self + offset, sizeof(HyperLogLog) - offset);
+    memcpy((char*)self + offset, (char*)folded + offset, sizeof(HyperLogLog) - offset);
+    memcpy((char*)folded + offset, (char*)&tmp + offset, sizeof(HyperLogLog) - offset);
+    Py_DECREF(folded); /* Frees the old registers */
+
+    return 0;
+}
+
+
+/* Parses the p argument of fold() and reduce_precision(). Returns -1 and sets
+ * an exception if p is invalid. */
+static int parseFoldPrecision(HyperLogLog* self, PyObject* args, int* p)
+{
+    if (!PyArg_ParseTuple(args, "i", p)) return -1;
+    if (checkNotBusy(self, false) < 0) return -1;
+
+    if (*p < 2 || *p > self->p) {
+        PyErr_Format(PyExc_ValueError, "p must be between 2 and %d", (int)self->p);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/* Reduces the number of registers to 2^p in place. The registers are the same
+ * as if every element had been added with 2^p registers. */
+static PyObject* HyperLogLog_fold(HyperLogLog* self, PyObject* args)
+{
+    int p;
+
+    if (parseFoldPrecision(self, args, &p) < 0) return NULL;
+
+    if (p < self->p && foldInPlace(self, p) < 0) return NULL;
+
+    Py_RETURN_NONE;
+}
+
+
+/* Gets a copy of the HyperLogLog with 2^p registers, see fold(). */
+static PyObject* HyperLogLog_reduce_precision(HyperLogLog* self, PyObject* args)
+{
+    int p;
+
+    if (parseFoldPrecision(self, args, &p) < 0) return NULL;
+
+    return (PyObject*)foldHyperLogLog(self, p);
+}
+
+
+/* Merges the registers of another HyperLogLog of the same size. Returns -1
+ * and sets an exception on failure. */
+static int mergeHyperLogLog(HyperLogLog* self, HyperLogLog* otherHLL)
+{
+    self->isCached = 0;
+
+    if (otherHLL == self) {
+        return 0;
+    }
+
+    self->isHipValid = 0; /* Registers are no longer updated in arrival order */
+
+    if (!otherHLL->isSparse) {
+        uint8_t* values = NULL;
+        int64_t merged;
+
+        if (otherHLL->layout == LAYOUT_U4 && (values = decodeDenseRegisters(otherHLL)) == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+
+        if (values != NULL) {
+            merged = mergeDenseRegisters(self, values, true);
+        } else {
+            merged = mergeDenseRegisters(self, otherHLL->registers, otherHLL->layout == LAYOUT_U8);
+        }
+
+        free(values);
+
+        if (merged < 0) {
+            PyErr_NoMemory();
+            return -1;
+        }
+
+        return 0;
+    }
+
+    /* Walk the sparse list of the other HyperLogLog in one pass */
+    if (flushRegisterBuffer(otherHLL) < 0) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    SparseIterator it;
+    initSparseIterator(&it, otherHLL, 0, 0);
+
+    while (nextSparseRegister(&it)) {
+        if (setRegister(self, it.index, it.fsb) < 0) {
+            PyErr_NoMemory();
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+/* Merges another HyperLogLog into the current HyperLogLog. The registers of
+ * the other HyperLogLog are unaffected. If the other HyperLogLog has more
+ * registers a folded copy of it is merged. The current HyperLogLog is never
+ * folded implicitly, fold() it first to merge a HyperLogLog with fewer
+ * registers. */
+static PyObject* HyperLogLog_merge(HyperLogLog* self, PyObject* args)
+{
+    HyperLogLog* otherHLL;
+    HyperLogLog* folded = NULL;
+    int status;
+
+    if (!PyArg_ParseTuple(args, "O!", &HyperLogLogType, &otherHLL)) return NULL;
+    if (checkNotBusy(self, false) < 0 || checkNotBusy(otherHLL, false) < 0) return NULL;
+    if (checkWritable(self) < 0) return NULL;
+
+    if (otherHLL->hashKind != self->hashKind) {
+        PyErr_SetString(PyExc_ValueError, "Cannot merge HyperLogLogs using different hash functions");
+        return NULL;
+    }
+
+    if (self->p > otherHLL->p) {
+        PyErr_Format(PyExc_ValueError,
+            "Cannot merge a HyperLogLog with fewer registers, fold(%d) this HyperLogLog first",
+            (int)otherHLL->p);
+        return NULL;
+    }
+
+    if (otherHLL->p > self->p) {
+        if ((folded = foldHyperLogLog(otherHLL, self->p)) == NULL) return NULL;
+        otherHLL = folded;
+    }
+
+    status = mergeHyperLogLog(self, otherHLL);
+    Py_XDECREF(folded);
+
+    if (status < 0) return NULL;
+
+    Py_RETURN_NONE;
+}
+
+
+/*
+ * N-way unions
+ * ------------
+ *
+ * Merging many HyperLogLogs one at a time with merge() updates the histogram
+ * after every merge. Instead the registers of all the HyperLogLogs are merged
+ * into a single densely encoded array and the histogram is counted once.
+ * Dense registers are merged a block at a time and sparse registers are
+ * streamed from their sorted lists without being expanded.
+ */
+
+
+/* Checks the arguments of union() and union_cardinality() are HyperLogLogs
+ * which can be merged. Returns the first HyperLogLog or NULL and sets an
+ * exception. HyperLogLogs of different sizes can be merged, see
+ * foldUnionArgs(). */
+static HyperLogLog* checkUnionArgs(PyObject* args)
+{
+    Py_ssize_t n = PyTuple_GET_SIZE(args);
+    HyperLogLog* first;
+
+    if (n == 0) {
+        PyErr_SetString(PyExc_TypeError, "At least one HyperLogLog is required");
+        return NULL;
+    }
+
+    for (Py_ssize_t i = 0; i < n; i++) {
+        if (!PyObject_TypeCheck(PyTuple_GET_ITEM(args, i), &HyperLogLogType)) {
+            PyErr_SetString(PyExc_TypeError, "Arguments must be HyperLogLogs");
+            return NULL;
+        }
+
+        if (checkNotBusy((HyperLogLog*)PyTuple_GET_ITEM(args, i), false) < 0) return NULL;
+    }
+
+    first = (HyperLogLog*)PyTuple_GET_ITEM(args, 0);
+
+    for (Py_ssize_t i = 1; i < n; i++) {
+        HyperLogLog* hll = (HyperLogLog*)PyTuple_GET_ITEM(args, i);
+
+        if (hll->hashKind != first->hashKind) {
+            PyErr_SetString(PyExc_ValueError, "Cannot merge HyperLogLogs using different hash functions");
+            return NULL;
+        }
+    }
+
+    return first;
+}
+
+
+/* Gets a tuple of the HyperLogLogs in args, with those that have more
+ * registers than the smallest folded to its size as in merge(). Returns a new
+ * reference or NULL and sets an exception. */
+static PyObject* foldUnionArgs(PyObject* args)
+{
+    Py_ssize_t n = PyTuple_GET_SIZE(args);
+    unsigned short p = ((HyperLogLog*)PyTuple_GET_ITEM(args, 0))->p;
+    bool equal = 1;
+    PyObject* folded;
+
+    for (Py_ssize_t i = 1; i < n; i++) {
+        HyperLogLog* hll = (HyperLogLog*)PyTuple_GET_ITEM(args, i);
+        equal &= hll->p == p;
+        if (hll->p < p) p = hll->p;
+    }
+
+    if (equal) {
+        Py_INCREF(args);
+        return args;
+    }
+
+    if ((folded = PyTuple_New(n)) == NULL) return NULL;
+
+    for (Py_ssize_t i = 0; i < n; i++) {
+        HyperLogLog* hll = (HyperLogLog*)PyTuple_GET_ITEM(args, i);
+
+        if (hll->p == p) {
+            Py_INCREF(hll);
+        } else if ((hll = foldHyperLogLog(hll, p)) == NULL) {
+            Py_DECREF(folded);
+            return NULL;
+        }
+
+        PyTuple_SET_ITEM(folded, i, (PyObject*)hll);
+    }
+
+    return folded;
+}
+
+
+/* Takes the maximum of each register of the HyperLogLogs in args and a
+ * densely encoded array of registers. Returns -1 on failure to allocate
+ * memory. */
+static int maxUnionRegisters(PyObject* args, uint8_t* regs, bool unpacked)
+{
+    for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(args); i++) {
+        HyperLogLog* hll = (HyperLogLog*)PyTuple_GET_ITEM(args, i);
+        SparseIterator it;
+
+        if (!hll->isSparse && hll->layout == LAYOUT_U4) {
+            for (uint64_t j = 0; j < hll->size; j++) {
+                uint8_t fsb = getNibbleRegister(hll, j);
+
+                if (fsb > getRegisterIn(regs, unpacked, j)) {
+                    setRegisterIn(regs, unpacked, j, fsb);
+                }
+            }
+            continue;
+        } else if (!hll->isSparse) {
+            maxRegisters(regs, unpacked, hll->registers, hll->layout == LAYOUT_U8, hll->size);
+            continue;
+        }
+
+        if (flushRegisterBuffer(hll) < 0) return -1;
+
+        initSparseIterator(&it, hll, 0, 0);
+
+        while (nextSparseRegister(&it)) {
+            if (it.fsb > getRegisterIn(regs, unpacked, it.index)) {
+                setRegisterIn(regs, unpacked, it.index, it.fsb);
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+/* Creates a new HyperLogLog which is the union of HyperLogLogs of the same
+ * size. The result uses sparse representation if all of the HyperLogLogs do. */
+static PyObject* unionHyperLogLogs(PyObject* args)
+{
+    HyperLogLog* first = (HyperLogLog*)PyTuple_GET_ITEM(args, 0);
+    HyperLogLog* result;
+    bool sparse = 1;
+    uint64_t added = 0;
+
+    for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(args); i++) {
+        HyperLogLog* hll = (HyperLogLog*)PyTuple_GET_ITEM(args, i);
+        sparse &= hll->isSparse;
+        added += hll->added;
+    }
+
+    result = newHyperLogLog(Py_TYPE(first), first->p, sparse, first->layout);
+    if (result == NULL) return NULL;
+
+    result->seed = first->seed;
+    result->hashKind = first->hashKind;
+
+    if (!sparse && result->layout == LAYOUT_U4) {
+        uint8_t* values = (uint8_t*)calloc(result->size, sizeof(uint8_t));
+
+        if (values == NULL || maxUnionRegisters(args, values, true) < 0 || encodeNibbleRegisters(result, values) < 0) {
+            free(values);
+            Py_DECREF(result);
+            return PyErr_NoMemory();
+        }
+
+        countRegisters(values, true, result->size, result->histogram);
+        free(values);
+    } else if (!sparse) {
+        bool unpacked = result->layout == LAYOUT_U8;
+
+        if (maxUnionRegisters(args, result->registers, unpacked) < 0) {
+            Py_DECREF(result);
+            return PyErr_NoMemory();
+        }
+
+        countRegisters(result->registers, unpacked, result->size, result->histogram);
+    } else {
+        for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(args); i++) {
+            HyperLogLog* hll = (HyperLogLog*)PyTuple_GET_ITEM(args, i);
+            SparseIterator it;
+
+            if (flushRegisterBuffer(hll) < 0) {
+                Py_DECREF(result);
+                return PyErr_NoMemory();
+            }
+
+            initSparseIterator(&it, hll, 0, 0);
+
+            while (nextSparseRegister(&it)) {
+                if (setRegister(result, it.index, it.fsb) < 0) {
+                    Py_DECREF(result);
+                    return PyErr_NoMemory();
+                }
+            }
+        }
+    }
+
+    result->added = added;
+
+    return (PyObject*)result;
+}
+
+
+/* Estimates the cardinality of the union of HyperLogLogs of the same size
+ * without creating a new HyperLogLog. */
+static PyObject* unionCardinality(PyObject* args)
+{
+    HyperLogLog* first = (HyperLogLog*)PyTuple_GET_ITEM(args, 0);
+    uint64_t histogram[65];
+    uint8_t* regs;
+    bool unpacked;
+
+    unpacked = first->layout != LAYOUT_U6;
+    regs = (uint8_t*)calloc(denseBytes(first->size, unpacked), sizeof(uint8_t));
+
+    if (regs == NULL || maxUnionRegisters(args, regs, unpacked) < 0) {
+        free(regs);
+        return PyErr_NoMemory();
+    }
+
+    countRegisters(regs, unpacked, first->size, histogram);
+    free(regs);
+
+    return Py_BuildValue("K", estimateCardinality(histogram, first->p));
+}
+
+
+/* Creates a new HyperLogLog which is the union of the given HyperLogLogs. If
+ * their sizes differ the result has the size of the smallest. */
+static PyObject* HyperLogLog_union(PyObject* unused, PyObject* args)
+{
+    PyObject* folded;
+    PyObject* result;
+
+    if (checkUnionArgs(args) == NULL || (folded = foldUnionArgs(args)) == NULL) return NULL;
+
+    result = unionHyperLogLogs(folded);
+    Py_DECREF(folded);
+
+    return result;
+}
+
+
+/* Estimates the cardinality of the union of the given HyperLogLogs without
+ * creating a new HyperLogLog. If their sizes differ the union is estimated
+ * with the size of the smallest. */
+static PyObject* HyperLogLog_union_cardinality(PyObject* unused, PyObject* args)
+{
+    PyObject* folded;
+    PyObject* result;
+
+    if (checkUnionArgs(args) == NULL || (folded = foldUnionArgs(args)) == NULL) return NULL;
+
+    result = unionCardinality(folded);
+    Py_DECREF(folded);
+
+    return result;
+}
+
+
+/*
+ * Joint cardinality estimation
+ * ----------------------------
+ *
+ * The cardinalities of A \ B, B \ A and A ∩ B are estimated together using
+ * the joint maximum likelihood method of [2]. Elements of the three sets are
+ * modelled as Poisson processes with rates a, b and x per register. A
+ * register of A is the maximum of an A \ B and an A ∩ B register, and
+ * similarly for B, so the probability of a pair of registers (k1, k2) only
+ * depends on a, b, x and which of k1 < k2, k1 > k2 or k1 = k2 holds. The
+ * likelihood can therefore be evaluated from the number of registers of each
+ * value in these three cases, which are counted in a single pass over both
+ * HyperLogLogs:
+ *
+ *     lt1[k]  registers where k1 = k < k2
+ *     gt2[k]  registers where k2 = k > k1
+ *     gt1[k]  registers where k1 = k > k2
+ *     lt2[k]  registers where k2 = k < k1
+ *     eq[k]   registers where k1 = k2 = k
+ *
+ * The log likelihood is maximized over log(a), log(b) and log(x) using the
+ * Nelder-Mead method.
+ */
+
+typedef struct {
+    uint64_t lt1[65];
+    uint64_t gt2[65];
+    uint64_t gt1[65];
+    uint64_t lt2[65];
+    uint64_t eq[65];
+    unsigned short p;
+} JointStatistics;
+
+
+/* Reads registers of a HyperLogLog in order of increasing index. */
+typedef struct {
+    HyperLogLog* hll;
+    SparseIterator it;
+    bool hasNext; /* If the sparse iterator is at an unread register */
+} RegisterCursor;
+
+
+/* Starts reading the registers of a HyperLogLog. Returns -1 on failure to
+ * allocate memory. */
+static int initRegisterCursor(RegisterCursor* cursor, HyperLogLog* hll)
+{
+    memset(cursor, 0, sizeof(RegisterCursor));
+    cursor->hll = hll;
+
+    if (hll->isSparse) {
+        if (flushRegisterBuffer(hll) < 0) return -1;
+        initSparseIterator(&cursor->it, hll, 0, 0);
+        cursor->hasNext = nextSparseRegister(&cursor->it);
+    }
+
+    return 0;
+}
+
+
+/* Gets register i. Registers must be read in order. */
+static inline uint8_t readRegister(RegisterCursor* cursor, uint64_t i)
+{
+    uint8_t fsb;
+
+    if (!cursor->hll->isSparse) {
+        return getDense(cursor->hll, i);
+    }
+
+    if (!cursor->hasNext || cursor->it.index != i) {
+        return 0;
+    }
+
+    fsb = cursor->it.fsb;
+    cursor->hasNext = nextSparseRegister(&cursor->it);
+
+    return fsb;
+}
+
+
+/* Computes log(F(k) - F(k - 1)) where F(k) = exp(-r*z(k)) is the probability
+ * a register with rate r has a value of at most k. */
+static inline double logRegisterProbability(double r, const double* z, int k)
+{
+    if (k == 0) {
+        return -r;
+    }
+
+    return -r*z[k] + log(-expm1(-r*(z[k - 1] - z[k])));
+}
+
+
+/* Computes the log probability that both registers have the value k. */
+static inline double logEqualProbability(double a, double b, double x, const double* z, int k)
+{
+    if (k == 0) {
+        return -(a + b + x);
+    }
+
+    double d = z[k - 1] - z[k];
+    double both = expm1(-(a + x)*d)*expm1(-(b + x)*d);
+    double shared = exp(-(a + b + x)*d)*-expm1(-x*d);
+
+    return -(a + b + x)*z[k] + log(both + shared);
+}
+
+
+/* Computes the negative log likelihood of the rates exp(v[0]), exp(v[1]) and
+ * exp(v[2]). */
+static double jointNegativeLogLikelihood(const JointStatistics* stats, const double* z, const double* v)
+{
+    double a = exp(v[0]);
+    double b = exp(v[1]);
+    double x = exp(v[2]);
+    double result = 0;
+    int q = 64 - stats->p;
+
+    for (int k = 0; k <= q + 1; k++) {
+        if (stats->lt1[k]) result += stats->lt1[k]*logRegisterProbability(a + x, z, k);
+        if (stats->gt2[k]) result += stats->gt2[k]*logRegisterProbability(b, z, k);
+        if (stats->gt1[k]) result += stats->gt1[k]*logRegisterProbability(a, z, k);
+        if (stats->lt2[k]) result += stats->lt2[k]*logRegisterProbability(b + x, z, k);
+        if (stats->eq[k]) result += stats->eq[k]*logEqualProbability(a, b, x, z, k);
+    }
+
+    return -result;
+}
+
+
+/* Minimizes the negative log likelihood using the Nelder-Mead method starting
+ * from the point v. The minimum is stored in v. */
+static void maximizeJointLikelihood(const JointStatistics* stats, double* v)
+{
+    double z[66];
+    double simplex[4][3];
+    double f[4];
+    int q = 64 - stats->p;
+
+    for (int k = 0; k <= q; k++) {
+        z[k] = ldexp(1.0, -k);
+    }
+
+    z[q + 1] = 0;
+
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 3; j++) {
+            simplex[i][j] = v[j] + (i == j + 1 ? 1.0 : 0.0);
+        }
+
+        f[i] = jointNegativeLogLikelihood(stats, z, simplex[i]);
+    }
+
+    for (int iteration = 0; iteration < 2000; iteration++) {
+        double centroid[3] = {0, 0, 0};
+        double reflected[3];
+        double candidate[3];
+        double fr;
+        double fc;
+        int best = 0;
+        int worst = 0;
+        int second = 0;
+
+        for (int i = 1; i < 4; i++) {
+            if (f[i] < f[best]) best = i;
+            if (f[i] > f[worst]) worst = i;
+        }
+
+        second = best;
+
+        for (int i = 0; i < 4; i++) {
+            if (i != worst && f[i] > f[second]) second = i;
+        }
+
+        if (f[worst] - f[best] <= 1e-12*(fabs(f[best]) + 1e-12)) break;
+
+        for (int i = 0; i < 4; i++) {
+            if (i == worst) continue;
+
+            for (int j = 0; j < 3; j++) {
+                centroid[j] += simplex[i][j]/3;
+            }
+        }
+
+        for (int j = 0; j < 3; j++) {
+            reflected[j] = centroid[j] + (centroid[j] - simplex[worst][j]);
+        }
+
+        fr = jointNegativeLogLikelihood(stats, z, reflected);
+
+        if (fr < f[best]) { /* Expand */
+            for (int j = 0; j < 3; j++) {
+                candidate[j] = centroid[j] + 2*(centroid[j] - simplex[worst][j]);
+            }
+
+            fc = jointNegativeLogLikelihood(stats, z, candidate);
+
+            if (fc < fr) {
+                memcpy(simplex[worst], candidate, sizeof(candidate));
+                f[worst] = fc;
+            } else {
+                memcpy(simplex[worst], reflected, sizeof(reflected));
+                f[worst] = fr;
+            }
+
+            continue;
+        }
+
+        if (fr < f[second]) { /* Reflect */
+            memcpy(simplex[worst], reflected, sizeof(reflected));
+            f[worst] = fr;
+            continue;
+        }
+
+        /* Contract towards the better of the worst and reflected points */
+        for (int j = 0; j < 3; j++) {
+            if (fr < f[worst]) {
+                candidate[j] = centroid[j] + 0.5*(reflected[j] - centroid[j]);
+            } else {
+                candidate[j] = centroid[j] + 0.5*(simplex[worst][j] - centroid[j]);
+            }
+        }
+
+        fc = jointNegativeLogLikelihood(stats, z, candidate);
+
+        if (fc < (fr < f[worst] ? fr : f[worst])) {
+            memcpy(simplex[worst], candidate, sizeof(candidate));
+            f[worst] = fc;
+            continue;
+        }
+
+        /* Shrink towards the best point */
+        for (int i = 0; i < 4; i++) {
+            if (i == best) continue;
+
+            for (int j = 0; j < 3; j++) {
+                simplex[i][j] = simplex[best][j] + 0.5*(simplex[i][j] - simplex[best][j]);
+            }
+
+            f[i] = jointNegativeLogLikelihood(stats, z, simplex[i]);
+        }
+    }
+
+    int best = 0;
+
+    for (int i = 1; i < 4; i++) {
+        if (f[i] < f[best]) best = i;
+    }
+
+    memcpy(v, simplex[best], 3*sizeof(double));
+}
+
+
+/* Estimates the cardinalities of A \ B, B \ A and A ∩ B. Returns -1 and sets
+ * an exception on failure. */
+static int estimateJointCardinalities(HyperLogLog* self, PyObject* other, double* estimates)
+{
+    HyperLogLog* otherHLL;
+    RegisterCursor c1;
+    RegisterCursor c2;
+    JointStatistics* stats;
+    uint64_t h1[65] = {0};
+    uint64_t h2[65] = {0};
+    uint64_t hu[65] = {0};
+    double v[3];
+
+    if (!PyObject_TypeCheck(other, &HyperLogLogType)) {
+        PyErr_SetString(PyExc_TypeError, "Argument must be a HyperLogLog");
+        return -1;
+    }
+
+    otherHLL = (HyperLogLog*)other;
+
+    if (checkNotBusy(self, false) < 0 || checkNotBusy(otherHLL, false) < 0) return -1;
+
+    if (otherHLL->hashKind != self->hashKind) {
+        PyErr_SetString(PyExc_ValueError, "Cannot compare HyperLogLogs using different hash functions");
+        return -1;
+    }
+
+    if (otherHLL->p != self->p) { /* Compare at the lower precision */
+        HyperLogLog* folded;
+        int status;
+
+        if (self->p > otherHLL->p) {
+            if ((folded = foldHyperLogLog(self, otherHLL->p)) == NULL) return -1;
+            status = estimateJointCardinalities(folded, other, estimates);
+        } else {
+            if ((folded = foldHyperLogLog(otherHLL, self->p)) == NULL) return -1;
+            status = estimateJointCardinalities(self, (PyObject*)folded, estimates);
+        }
+
+        Py_DECREF(folded);
+        return status;
+    }
+
+    stats = (JointStatistics*)calloc(1, sizeof(JointStatistics));
+
+    if (stats == NULL || initRegisterCursor(&c1, self) < 0 || initRegisterCursor(&c2, otherHLL) < 0) {
+        free(stats);
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    stats->p = self->p;
+
+    for (uint64_t i = 0; i < self->size; i++) {
+        uint8_t k1 = readRegister(&c1, i);
+        uint8_t k2 = readRegister(&c2, i);
+
+        if (k1 < k2) {
+            stats->lt1[k1]++;
+            stats->gt2[k2]++;
+            hu[k2]++;
+        } else if (k1 > k2) {
+            stats->gt1[k1]++;
+            stats->lt2[k2]++;
+            hu[k1]++;
+        } else {
+            stats->eq[k1]++;
+            hu[k1]++;
+        }
+
+        h1[k1]++;
+        h2[k2]++;
+    }
+
+    /* Start from the inclusion-exclusion estimates */
+    double m = (double)self->size;
+    double n1 = (double)estimateCardinality(h1, self->p);
+    double n2 = (double)estimateCardinality(h2, self->p);
+    double nu = (double)estimateCardinality(hu, self->p);
+
+    v[0] = log(fmax(nu - n2, 1.0)/m);
+    v[1] = log(fmax(nu - n1, 1.0)/m);
+    v[2] = log(fmax(n1 + n2 - nu, 1.0)/m);
+
+    maximizeJointLikelihood(stats, v);
+    free(stats);
+
+    for (int i = 0; i < 3; i++) {
+        estimates[i] = m*exp(v[i]);
+    }
+
+    return 0;
+}
+
+
+/* Estimates the cardinality of the intersection with another HyperLogLog. */
+static PyObject* HyperLogLog_intersection_cardinality(HyperLogLog* self, PyObject* args)
+{
+    PyObject* other;
+    double estimates[3];
+
+    if (!PyArg_ParseTuple(args, "O", &other)) return NULL;
+    if (estimateJointCardinalities(self, other, estimates) < 0) return NULL;
+
+    return Py_BuildValue("K", (uint64_t)round(estimates[2]));
+}
+
+
+/* Estimates the Jaccard index (size of the intersection divided by the size
+ * of the union) with another HyperLogLog. */
+static PyObject* HyperLogLog_jaccard(HyperLogLog* self, PyObject* args)
+{
+    PyObject* other;
+    double estimates[3];
+    double total;
+
+    if (!PyArg_ParseTuple(args, "O", &other)) return NULL;
+    if (estimateJointCardinalities(self, other, estimates) < 0) return NULL;
+
+    total = estimates[0] + estimates[1] + estimates[2];
+
+    return PyFloat_FromDouble(total >= 0.5 ? estimates[2]/total : 0.0);
+}
+
+
+static PyObject* HyperLogLog_new(PyTypeObject* type, PyObject*args, PyObject* kwds)
+{
+    HyperLogLog* self;
+    self = (HyperLogLog*)type->tp_alloc(type, 0);
+    return (PyObject*)self;
+}
+
+
+/* Serializes a HyperLogLog to bytes using the format described in hll.h. */
+static PyObject* HyperLogLog_to_bytes(HyperLogLog* self)
+{
+    uint64_t registerBytes;
+    uint8_t flags;
+    PyObject* bytes;
+    uint8_t* out;
+
+    if (checkNotBusy(self, false) < 0) return NULL;
+
+    if (self->isSparse) {
+        if (flushRegisterBuffer(self) < 0) return PyErr_NoMemory(); /* Also brings the HIP estimate up to date */
+        registerBytes = self->listBytes;
+    } else {
+        registerBytes = (self->size*6)/8 + 1;
+    }
+
+    flags = (self->isSparse ? FORMAT_SPARSE : 0) | (self->useHip ? FORMAT_HIP : 0) |
+            (self->useHip && self->isHipValid ? FORMAT_HIP_VALID : 0);
+
+    bytes = PyBytes_FromStringAndSize(NULL, formatRegistersOffset(flags) + registerBytes);
+    if (bytes == NULL) return NULL;
+
+    out = (uint8_t*)PyBytes_AS_STRING(bytes);
+    memcpy(out, FORMAT_MAGIC, 4);
+    out[4] = FORMAT_VERSION;
+    out[5] = (uint8_t)self->p;
+    out[6] = flags;
+    out[7] = self->hashKind;
+    writeUint64(out + 8, self->seed);
+    writeUint64(out + 16, self->added);
+    writeUint64(out + 24, self->isSparse ? self->listSize : 0);
+
+    if (flags & FORMAT_HIP_VALID) {
+        writeDouble(out + FORMAT_HEADER_SIZE, self->hipEstimate);
+        writeDouble(out + FORMAT_HEADER_SIZE + 8, self->hipProbability);
+        out += FORMAT_HIP_SIZE; /* Registers follow the HIP estimate */
+    }
+
+    if (self->layout == LAYOUT_U4 && !self->isSparse) { /* Always serialize 6 bit registers */
+        uint8_t* values = decodeDenseRegisters(self);
+
+        if (values == NULL) {
+            Py_DECREF(bytes);
+            return PyErr_NoMemory();
+        }
+
+        memset(out + FORMAT_HEADER_SIZE, 0, registerBytes);
+        packRegisters(out + FORMAT_HEADER_SIZE, values, self->size);
+        free(values);
+    } else if (self->layout == LAYOUT_U8 && !self->isSparse) {
+        memset(out + FORMAT_HEADER_SIZE, 0, registerBytes);
+        packRegisters(out + FORMAT_HEADER_SIZE, self->registers, self->size);
+    } else if (registerBytes > 0) {
+        memcpy(out + FORMAT_HEADER_SIZE, self->isSparse ? self->sparseRegisterList : self->registers, registerBytes);
+    }
+
+    return bytes;
+}
+
+
+/* Restores the registers of a HyperLogLog created with the p and
+ * representation of a serialized HyperLogLog. Returns -1 and sets an
+ * exception if the registers are invalid. */
+static int loadRegisters(HyperLogLog* self, const uint8_t* data, uint64_t len, uint64_t listSize)
+{
+    int64_t count;
+
+    if (!self->isSparse) {
+        if (len != (self->size*6)/8 + 1) {
+            PyErr_SetString(PyExc_ValueError, "Invalid serialized HyperLogLog: wrong number of registers");
+            return -1;
+        }
+
+        if (self->layout == LAYOUT_U4) {
+            uint8_t* values = (uint8_t*)malloc(self->size);
+
+            if (values == NULL) {
+                PyErr_NoMemory();
+                return -1;
+            }
+
+            unpackRegisters(values, data, self->size);
+            countRegisters(values, true, self->size, self->histogram);
+
+            if (!checkRegisterHistogram(self->histogram, self->p)) {
+                free(values);
+                PyErr_SetString(PyExc_ValueError, "Invalid serialized HyperLogLog: register value out of range");
+                return -1;
+            }
+
+            if (encodeNibbleRegisters(self, values) < 0) {
+                free(values);
+                PyErr_NoMemory();
+                return -1;
+            }
+
+            free(values);
+            return 0;
+        } else if (self->layout == LAYOUT_U8) {
+            unpackRegisters(self->registers, data, self->size);
+        } else {
+            memcpy(self->registers, data, len);
+        }
+
+        countRegisters(self->registers, self->layout == LAYOUT_U8, self->size, self->histogram);
+
+        if (!checkRegisterHistogram(self->histogram, self->p)) {
+            PyErr_SetString(PyExc_ValueError, "Invalid serialized HyperLogLog: register value out of range");
+            return -1;
+        }
+
+        return 0;
+    }
+
+    self->sparseRegisterList = (uint8_t*)malloc(len + 1);
+    if (self->sparseRegisterList == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    memcpy(self->sparseRegisterList, data, len);
+    self->listBytes = len;
+    count = checkSparseRegisters(self->sparseRegisterList, len, self->size, self->histogram);
+
+    if (count < 0) {
+        PyErr_SetString(PyExc_ValueError, "Invalid serialized HyperLogLog: corrupt sparse registers");
+        return -1;
+    }
+
+    if ((uint64_t)count != listSize) {
+        PyErr_SetString(PyExc_ValueError, "Invalid serialized HyperLogLog: wrong number of registers");
+        return -1;
+    }
+
+    self->listSize = count;
+
+    return 0;
+}
+
+
+/* Deserializes a HyperLogLog from bytes created by to_bytes(). Accepts any
+ * object supporting the buffer protocol. Dense registers use the given
+ * layout. Concurrent HyperLogLogs are loaded with the u8 layout and switched
+ * to dense representation, and don't keep the HIP estimate. */
+static PyObject* HyperLogLog_from_bytes(PyTypeObject* type, PyObject* args, PyObject* kwds)
+{
+    static char* kwlist[] = {"data", "layout", "concurrent", NULL};
+    Py_buffer view;
+    HyperLogLog* hll;
+    const uint8_t* data;
+    const char* layout = NULL;
+    uint64_t offset;
+    uint8_t flags;
+    int concurrent = 0;
+    int layoutKind;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "y*|sp", kwlist, &view, &layout, &concurrent)) return NULL;
+
+    if ((layoutKind = parseLayout(layout != NULL ? layout : concurrent ? "u8" : "u6")) < 0) {
+        PyBuffer_Release(&view);
+        return NULL;
+    }
+
+    if (concurrent && layoutKind != LAYOUT_U8) {
+        PyBuffer_Release(&view);
+        PyErr_SetString(PyExc_ValueError, "concurrent requires layout='u8' and can't be used with hip");
+        return NULL;
+    }
+
+    data = (const uint8_t*)view.buf;
+
+    if (view.len < FORMAT_HEADER_SIZE || memcmp(data, FORMAT_MAGIC, 4) != 0) {
+        PyBuffer_Release(&view);
+        PyErr_SetString(PyExc_ValueError, "Invalid serialized HyperLogLog: bad header");
+        return NULL;
+    }
+
+    if (data[4] != FORMAT_VERSION) {
+        PyBuffer_Release(&view);
+        PyErr_Format(PyExc_ValueError, "Unsupported serialization format version %d", data[4]);
+        return NULL;
+    }
+
+    flags = data[6];
+    offset = formatRegistersOffset(flags);
+
+    if (!isValidFormatFlags(flags) || data[7] > HASH_WYHASH || (uint64_t)view.len < offset) {
+        PyBuffer_Release(&view);
+        PyErr_SetString(PyExc_ValueError, "Invalid serialized HyperLogLog: bad header");
+        return NULL;
+    }
+
+    hll = newHyperLogLog(type, data[5], flags & FORMAT_SPARSE, (uint8_t)layoutKind);
+
+    if (hll == NULL) {
+        PyBuffer_Release(&view);
+        return NULL;
+    }
+
+    hll->seed = readUint64(data + 8);
+    hll->hashKind = data[7];
+    hll->added = readUint64(data + 16);
+    hll->useHip = !concurrent && (flags & FORMAT_HIP); /* Concurrent HyperLogLogs can't use HIP */
+
+    if (hll->useHip && (flags & FORMAT_HIP_VALID)) {
+        hll->isHipValid = 1;
+        hll->hipEstimate = readDouble(data + FORMAT_HEADER_SIZE);
+        hll->hipProbability = readDouble(data + FORMAT_HEADER_SIZE + 8);
+
+        if (!(hll->hipEstimate >= 0) || !(hll->hipProbability > 0 && hll->hipProbability <= 1)) {
+            PyBuffer_Release(&view);
+            Py_DECREF(hll);
+            PyErr_SetString(PyExc_ValueError, "Invalid serialized HyperLogLog: bad HIP estimate");
+            return NULL;
+        }
+    }
+
+    if (loadRegisters(hll, data + offset, view.len - offset, readUint64(data + 24)) < 0) {
+        PyBuffer_Release(&view);
+        Py_DECREF(hll);
+        return NULL;
+    }
+
+    PyBuffer_Release(&view);
+
+    if (concurrent) {
+        if (hll->isSparse && transformToDense(hll) < 0) {
+            Py_DECREF(hll);
+            return PyErr_NoMemory();
+        }
+
+        hll->isConcurrent = 1;
+    }
+
+    return (PyObject*)hll;
+}
+
+
+/* Serialization method used by pickle and copy. HyperLogLogs are pickled
+ * using to_bytes(). With pickle protocol 5 the bytes are wrapped in a
+ * PickleBuffer so that they can be transferred out-of-band. */
+static PyObject* HyperLogLog_reduce_ex(HyperLogLog* self, PyObject* args)
+{
+    PyObject* bytes;
+    PyObject* constructor;
+    int protocol;
+
+    if (!PyArg_ParseTuple(args, "i", &protocol)) return NULL;
+
+    bytes = HyperLogLog_to_bytes(self);
+    if (bytes == NULL) return NULL;
+
+#if PY_VERSION_HEX >= 0x03080000
+    if (protocol >= 5) {
+        PyObject* buffer = PyPickleBuffer_FromObject(bytes);
+        Py_DECREF(bytes);
+        if (buffer == NULL) return NULL;
+        bytes = buffer;
+    }
+#endif
+
+    constructor = PyObject_GetAttrString((PyObject*)Py_TYPE(self), "from_bytes");
+
+    if (constructor == NULL) {
+        Py_DECREF(bytes);
+        return NULL;
+    }
+
+    if (self->isConcurrent) {
+        return Py_BuildValue("(N(NsO))", constructor, bytes, layoutName(self->layout), Py_True);
+    } else if (self->layout != LAYOUT_U6) {
+        return Py_BuildValue("(N(Ns))", constructor, bytes, layoutName(self->layout));
+    }
+
+    return Py_BuildValue("(N(N))", constructor, bytes);
+}
+
+
+/*
+ * Memory-mapped HyperLogLogs
+ * --------------------------
+ *
+ * Dense registers can be stored in a file which is mapped into memory, so a
+ * HyperLogLog can be opened without reading or deserializing its registers and
+ * updates persist through the page cache. The file contains a header, the
+ * register histogram and the registers in their in-memory representation:
+ *
+ *     Offset  Size  Description
+ *     ------  ----  -----------
+ *     0       4     magic bytes "HLLM"
+ *     4       1     format version (1)
+ *     5       1     p
+ *     6       2     reserved (0)
+ *     8       8     seed
+ *     16      8     added field
+ *     24      8     byte order mark
+ *     32      520   register histogram, 65 64 bit integers
+ *     552     N     registers
+ *
+ * Integers are stored in native byte order since the histogram is updated in
+ * place. The byte order mark is checked when a file is opened. Elements added
+ * since the header was last written are added to the stored added field by
+ * flush() and when the HyperLogLog is deallocated, so readers of the file do
+ * not overwrite it.
+ */
+
+#define MAPPED_MAGIC "HLLM"
+#define MAPPED_VERSION 1
+#define MAPPED_BYTE_ORDER 0x0102030405060708ULL
+#define MAPPED_HISTOGRAM_OFFSET 32
+#define MAPPED_REGISTERS_OFFSET (MAPPED_HISTOGRAM_OFFSET + 65*sizeof(uint64_t))
+
+
+#ifndef _WIN32
+/* Writes the fields of a HyperLogLog that are not updated in place to the
+ * header of its mapped file. */
+static void writeMappedHeader(HyperLogLog* self)
+{
+    uint64_t fields[3] = {self->seed, 0, MAPPED_BYTE_ORDER};
+
+    memcpy(&fields[1], self->mapping + 16, sizeof(uint64_t));
+    fields[1] += self->added - self->mappedAdded;
+    self->mappedAdded = self->added;
+
+    memcpy(self->mapping, MAPPED_MAGIC, 4);
+    self->mapping[4] = MAPPED_VERSION;
+    self->mapping[5] = (uint8_t)self->p;
+    self->mapping[6] = 0;
+    self->mapping[7] = 0;
+    memcpy(self->mapping + 8, fields, sizeof(fields));
+}
+#endif
+
+
+/* Writes the header and unmaps the file of a mapped HyperLogLog. */
+static void unmapFile(HyperLogLog* self)
+{
+#ifndef _WIN32
+    if (self->mapping != NULL) {
+        if (!self->isReadOnly) writeMappedHeader(self);
+        munmap(self->mapping, self->mappingSize);
+    }
+#endif
+
+    self->mapping = NULL;
+    self->registers = NULL;
+    self->histogram = NULL;
+}
+
+
+/* Opens a HyperLogLog stored in a file. If create is set the file is created
+ * if it does not exist, using p and seed. If the file exists they are
+ * optional but must match the stored values. Read-only HyperLogLogs map the
+ * file without write access, refuse updates and count the registers instead
+ * of trusting the mapped histogram, which the writer may be updating. */
+static PyObject* HyperLogLog_open(PyTypeObject* type, PyObject* args, PyObject* kwds)
+{
+#ifdef _WIN32
+    PyErr_SetString(PyExc_NotImplementedError, "Memory-mapped HyperLogLogs are not supported on Windows");
+    return NULL;
+#else
+    static char* kwlist[] = {"path", "p", "seed", "readonly", "create", NULL};
+    PyObject* pathObj = NULL;
+    PyObject* seedObj = NULL;
+    HyperLogLog* hll = NULL;
+    uint64_t histogram[65];
+    uint64_t seed = 314;
+    uint64_t fileSize;
+    uint8_t* mapping;
+    struct stat st;
+    int readOnly = 0;
+    int create = 0;
+    int p = 0;
+    int fd;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&|iOpp", kwlist, PyUnicode_FSConverter, &pathObj, &p, &seedObj,
+                                     &readOnly, &create)) {
+        return NULL;
+    }
+
+    if (readOnly && create) {
+        Py_DECREF(pathObj);
+        PyErr_SetString(PyExc_ValueError, "Cannot create a read-only memory-mapped HyperLogLog");
+        return NULL;
+    }
+
+    if (seedObj != NULL) {
+        seed = PyLong_AsUnsignedLongLong(seedObj);
+
+        if (PyErr_Occurred()) {
+            Py_DECREF(pathObj);
+            return NULL;
+        }
+    }
+
+    fd = open(PyBytes_AS_STRING(pathObj), readOnly ? O_RDONLY : O_RDWR | (create ? O_CREAT : 0), 0644);
+
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, pathObj);
+        goto error;
+    }
+
+    if (st.st_size == 0 && create) { /* Create a new file */
+        if (p == 0) p = 12;
+
+        if (p < 2 || p > 40) {
+            PyErr_SetString(PyExc_ValueError, "p is out of range");
+            goto error;
+        }
+
+        fileSize = MAPPED_REGISTERS_OFFSET + ((1ULL << p)*6)/8 + 1;
+
+        if (ftruncate(fd, fileSize) < 0) {
+            PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, pathObj);
+            goto error;
+        }
+    } else {
+        uint8_t header[MAPPED_HISTOGRAM_OFFSET];
+        uint64_t fields[3];
+
+        if (pread(fd, header, sizeof(header), 0) != sizeof(header) ||
+                memcmp(header, MAPPED_MAGIC, 4) != 0 || header[4] != MAPPED_VERSION ||
+                header[5] < 2 || header[5] > 40) {
+            PyErr_SetString(PyExc_ValueError, "Invalid memory-mapped HyperLogLog file");
+            goto error;
+        }
+
+        memcpy(fields, header + 8, sizeof(fields));
+
+        if (fields[2] != MAPPED_BYTE_ORDER) {
+            PyErr_SetString(PyExc_ValueError, "Memory-mapped HyperLogLog file has a different byte order");
+            goto error;
+        }
+
+        if ((p != 0 && p != header[5]) || (seedObj != NULL && seed != fields[0])) {
+            PyErr_SetString(PyExc_ValueError, "p and seed must match the memory-mapped HyperLogLog file");
+            goto error;
+        }
+
+        p = header[5];
+        seed = fields[0];
+        fileSize = MAPPED_REGISTERS_OFFSET + ((1ULL << p)*6)/8 + 1;
+
+        if ((uint64_t)st.st_size != fileSize) {
+            PyErr_SetString(PyExc_ValueError, "Invalid memory-mapped HyperLogLog file");
+            goto error;
+        }
+    }
+
+    mapping = (uint8_t*)mmap(NULL, fileSize, readOnly ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (mapping == MAP_FAILED) {
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, pathObj);
+        goto error;
+    }
+
+    close(fd);
+    fd = -1;
+
+    /* The mapped histogram isn't trusted, the registers are counted instead */
+    if (st.st_size == 0) {
+        memset(histogram, 0, sizeof(histogram));
+        histogram[0] = 1ULL << p;
+    } else {
+        countDenseRegisters(mapping + MAPPED_REGISTERS_OFFSET, 1ULL << p, histogram);
+    }
+
+    if (!checkRegisterHistogram(histogram, (unsigned short)p)) {
+        munmap(mapping, fileSize);
+        PyErr_SetString(PyExc_ValueError, "Invalid memory-mapped HyperLogLog file");
+        goto error;
+    }
+
+    /* Start with a small sparse HyperLogLog so no registers are allocated */
+    hll = (HyperLogLog*)PyObject_CallFunction((PyObject*)type, "iiiii", p, 0, 1, 1, 1);
+
+    if (hll == NULL) {
+        munmap(mapping, fileSize);
+        goto error;
+    }
+
+    free(hll->histogram);
+    free(hll->sparseRegisterBuffer);
+    free(hll->bufferSlots);
+    hll->sparseRegisterBuffer = NULL;
+    hll->bufferSlots = NULL;
+    hll->isSparse = 0;
+    hll->isMapped = 1;
+    hll->isReadOnly = (bool)readOnly;
+    hll->mapping = mapping;
+    hll->mappingSize = fileSize;
+    hll->histogram = (uint64_t*)(mapping + MAPPED_HISTOGRAM_OFFSET);
+    hll->registers = mapping + MAPPED_REGISTERS_OFFSET;
+    hll->seed = seed;
+
+    if (!readOnly) {
+        memcpy(hll->histogram, histogram, sizeof(histogram));
+    }
+
+    if (st.st_size == 0) {
+        writeMappedHeader(hll);
+    } else {
+        memcpy(&hll->added, mapping + 16, sizeof(uint64_t));
+        hll->mappedAdded = hll->added;
+    }
+
+    Py_DECREF(pathObj);
+
+    return (PyObject*)hll;
+
+error:
+    if (fd >= 0) close(fd);
+    Py_DECREF(pathObj);
+    return NULL;
+#endif
+}
+
+
+/* Writes all changes of a mapped HyperLogLog to its file. Does nothing if the
+ * HyperLogLog is not mapped or is read-only. */
+static PyObject* HyperLogLog_flush(HyperLogLog* self)
+{
+#ifndef _WIN32
+    int result;
+
+    if (checkNotBusy(self, false) < 0) return NULL;
+
+    if (!self->isMapped || self->isReadOnly) {
+        Py_RETURN_NONE;
+    }
+
+    writeMappedHeader(self);
+
+    Py_BEGIN_ALLOW_THREADS
+    result = msync(self->mapping, self->mappingSize, MS_SYNC);
+    Py_END_ALLOW_THREADS
+
+    if (result < 0) {
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+#endif
+
+    Py_RETURN_NONE;
+}
+
+
+/*
+ * Redis encoding
+ * --------------
+ *
+ * Redis stores HyperLogLogs created with PFADD as strings with a 16 byte
+ * header followed by either dense or sparse registers:
+ *
+ *     Offset  Size  Description
+ *     ------  ----  -----------
+ *     0       4     magic bytes "HYLL"
+ *     4       1     encoding, 0 = dense, 1 = sparse
+ *     5       3     unused (0)
+ *     8       8     cached cardinality, little endian. The most significant
+ *                   bit is set if the cached value is invalid
+ *     16      N     registers
+ *
+ * Redis always uses 2^14 registers. Dense registers use 6 bits each but,
+ * unlike this module, are stored starting from the least significant bit of
+ * each byte. Sparse registers are a sequence of run length encoded opcodes:
+ *
+ *     00xxxxxx           ZERO, xxxxxx + 1 registers are set to 0
+ *     01xxxxxx yyyyyyyy  XZERO, xxxxxxyyyyyyyy + 1 registers are set to 0
+ *     1vvvvvxx           VAL, xx + 1 registers are set to vvvvv + 1
+ *
+ * Redis hashes elements with MurmurHash64A using the seed 0xadc83b19 but
+ * selects the register from the low 14 bits of the hash and counts the
+ * trailing zeroes of the remaining bits. HyperLogLogs imported from Redis
+ * split hashes the same way (HASH_REDIS) so elements can still be added.
+ */
+
+#define REDIS_MAGIC "HYLL"
+#define REDIS_HEADER_SIZE 16
+#define REDIS_P 14
+#define REDIS_REGISTERS (1 << REDIS_P)
+#define REDIS_DENSE_BYTES ((REDIS_REGISTERS*6 + 7)/8)
+#define REDIS_SEED 0xadc83b19ULL
+#define REDIS_SPARSE_MAX_BYTES 3000 /* Redis' default hll-sparse-max-bytes */
+#define REDIS_MAX_VAL 32 /* Largest register value of a VAL opcode */
+#define REDIS_MAX_ZERO 64 /* Longest run of a ZERO opcode */
+#define REDIS_MAX_XZERO 16384 /* Longest run of a XZERO opcode */
+#define REDIS_MAX_VAL_RUN 4 /* Longest run of a VAL opcode */
+
+
+/* Gets register m of a Redis dense encoding. */
+static inline uint8_t getRedisRegister(const uint8_t* regs, uint64_t m)
+{
+    uint64_t byte = m*6/8;
+    uint8_t fb = (m*6) & 7;
+    uint16_t b0 = regs[byte];
+    uint16_t b1 = byte + 1 < REDIS_DENSE_BYTES ? regs[byte + 1] : 0;
+
+    return ((b0 >> fb) | (b1 << (8 - fb))) & 63;
+}
+
+
+/* Sets register m of a Redis dense encoding. */
+static inline void setRedisRegister(uint8_t* regs, uint64_t m, uint8_t val)
+{
+    uint64_t byte = m*6/8;
+    uint8_t fb = (m*6) & 7;
+
+    regs[byte] &= ~(63 << fb);
+    regs[byte] |= val << fb;
+
+    if (fb > 2) {
+        regs[byte + 1] &= ~(63 >> (8 - fb));
+        regs[byte + 1] |= val >> (8 - fb);
+    }
+}
+
+
+/* Decodes the registers of a Redis HyperLogLog into an array with one byte per
+ * register. Returns -1 and sets an exception if the encoding is invalid. */
+static int decodeRedisRegisters(const uint8_t* data, Py_ssize_t len, uint8_t* values)
+{
+    const uint8_t* pos = data + REDIS_HEADER_SIZE;
+    const uint8_t* end = data + len;
+    uint64_t index = 0;
+
+    if (data[4] == 0) {
+        if (len != REDIS_HEADER_SIZE + REDIS_DENSE_BYTES) {
+            PyErr_SetString(PyExc_ValueError, "Invalid Redis HyperLogLog: wrong number of registers");
+            return -1;
+        }
+
+        for (uint64_t i = 0; i < REDIS_REGISTERS; i++) {
+            values[i] = getRedisRegister(pos, i);
+
+            if (values[i] > 64 - REDIS_P + 1) {
+                PyErr_SetString(PyExc_ValueError, "Invalid Redis HyperLogLog: register out of range");
+                return -1;
+            }
+        }
+
+        return 0;
+    }
+
+    memset(values, 0, REDIS_REGISTERS);
+
+    while (pos < end) {
+        const uint8_t* op = pos;
+        uint64_t run;
+        uint8_t val = 0;
+
+        if ((*pos & 0xC0) == 0x00) { /* ZERO */
+            run = (*pos & 0x3F) + 1;
+            pos++;
+        } else if ((*pos & 0xC0) == 0x40) { /* XZERO */
+            if (pos + 1 >= end) break;
+            run = (((uint64_t)(*pos & 0x3F) << 8) | pos[1]) + 1;
+            pos += 2;
+        } else { /* VAL */
+            run = (*pos & 0x03) + 1;
+            val = ((*pos >> 2) & 0x1F) + 1;
+            pos++;
+        }
+
+        if (index + run > REDIS_REGISTERS) {
+            pos = op;
+            break;
+        }
+
+        if (val > 0) {
+            memset(values + index, val, run);
+        }
+
+        index += run;
+    }
+
+    if (pos != end || index != REDIS_REGISTERS) {
+        PyErr_SetString(PyExc_ValueError, "Invalid Redis HyperLogLog: corrupt sparse registers");
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/* Creates a HyperLogLog from a Redis HyperLogLog (the value of a key created
+ * with PFADD, e.g. as returned by GET). */
+static PyObject* HyperLogLog_from_redis_bytes(PyTypeObject* type, PyObject* args)
+{
+    Py_buffer view;
+    HyperLogLog* hll;
+    const uint8_t* data;
+    uint8_t* values;
+    uint64_t count = 0;
+    int sparse;
+
+    if (!PyArg_ParseTuple(args, "y*", &view)) return NULL;
+
+    data = (const uint8_t*)view.buf;
+
+    if (view.len < REDIS_HEADER_SIZE || memcmp(data, REDIS_MAGIC, 4) != 0 || data[4] > 1) {
+        PyBuffer_Release(&view);
+        PyErr_SetString(PyExc_ValueError, "Invalid Redis HyperLogLog: bad header");
+        return NULL;
+    }
+
+    values = (uint8_t*)malloc(REDIS_REGISTERS);
+
+    if (values == NULL) {
+        PyBuffer_Release(&view);
+        return PyErr_NoMemory();
+    }
+
+    if (decodeRedisRegisters(data, view.len, values) < 0) {
+        PyBuffer_Release(&view);
+        free(values);
+        return NULL;
+    }
+
+    sparse = data[4];
+    PyBuffer_Release(&view);
+
+    for (uint64_t i = 0; i < REDIS_REGISTERS; i++) {
+        if (values[i] > 64 - REDIS_P + 1) { /* Can't be produced by a hash, see splitHash() */
+            free(values);
+            PyErr_SetString(PyExc_ValueError, "Invalid Redis HyperLogLog: register value out of range");
+            return NULL;
+        }
+
+        count += values[i] > 0;
+    }
+
+    hll = (HyperLogLog*)PyObject_CallFunction((PyObject*)type, "iii", REDIS_P, 0, sparse);
+
+    if (hll == NULL) {
+        free(values);
+        return NULL;
+    }
+
+    hll->seed = REDIS_SEED;
+    hll->hashKind = HASH_REDIS;
+
+    if (hll->isSparse) {
+        uint8_t* out;
+        uint64_t prev = 0;
+
+        hll->sparseRegisterList = (uint8_t*)malloc(count*(MAX_VARINT_BYTES + 1) + 1);
+
+        if (hll->sparseRegisterList == NULL) {
+            free(values);
+            Py_DECREF(hll);
+            return PyErr_NoMemory();
+        }
+
+        out = hll->sparseRegisterList;
+
+        for (uint64_t i = 0; i < REDIS_REGISTERS; i++) {
+            if (values[i] > 0) {
+                out = writeSparseRegister(out, i - prev, values[i]);
+                hll->histogram[0]--;
+                hll->histogram[values[i]]++;
+                prev = i;
+            }
+        }
+
+        hll->listSize = count;
+        hll->listBytes = out - hll->sparseRegisterList;
+
+        if (hll->listBytes >= hll->maxListSize && transformToDense(hll) < 0) {
+            free(values);
+            Py_DECREF(hll);
+            return PyErr_NoMemory();
+        }
+    } else {
+        for (uint64_t i = 0; i < REDIS_REGISTERS; i++) {
+            if (values[i] > 0) {
+                setDenseRegister(i, values[i], hll->registers);
+            }
+        }
+
+        countDenseRegisters(hll->registers, hll->size, hll->histogram);
+    }
+
+    free(values);
+
+    return (PyObject*)hll;
+}
+
+
+/* Encodes registers using Redis' sparse encoding. Returns the number of
+ * bytes written, or 0 if the registers can't be encoded in max bytes. */
+static uint64_t encodeRedisSparse(const uint8_t* values, uint8_t* out, uint64_t max)
+{
+    uint64_t n = 0;
+    uint64_t i = 0;
+
+    while (i < REDIS_REGISTERS) {
+        uint64_t run = 1;
+
+        while (i + run < REDIS_REGISTERS && values[i + run] == values[i]) {
+            run++;
+        }
+
+        if (values[i] > REDIS_MAX_VAL) {
+            return 0;
+        }
+
+        if (values[i] == 0) {
+            while (run > 0) {
+                uint64_t len = run < REDIS_MAX_XZERO ? run : REDIS_MAX_XZERO;
+
+                if (len > REDIS_MAX_ZERO) {
+                    if (n + 2 > max) return 0;
+                    out[n++] = 0x40 | (uint8_t)((len - 1) >> 8);
+                    out[n++] = (uint8_t)(len - 1);
+                } else {
+                    if (n + 1 > max) return 0;
+                    out[n++] = (uint8_t)(len - 1);
+                }
+
+                run -= len;
+                i += len;
+            }
+        } else {
+            while (run > 0) {
+                uint64_t len = run < REDIS_MAX_VAL_RUN ? run : REDIS_MAX_VAL_RUN;
+
+                if (n + 1 > max) return 0;
+                out[n++] = 0x80 | (uint8_t)((values[i] - 1) << 2) | (uint8_t)(len - 1);
+                run -= len;
+                i += len;
+            }
+        }
+    }
+
+    return n;
+}
+
+
+/* Encodes a HyperLogLog using the format Redis uses for PFADD keys. The
+ * result can be stored in Redis using SET. Sparse encoding is used if it fits
+ * in Redis' default hll-sparse-max-bytes. */
+static PyObject* HyperLogLog_to_redis_bytes(HyperLogLog* self)
+{
+    uint8_t header[REDIS_HEADER_SIZE] = {'H', 'Y', 'L', 'L', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x80};
+    uint8_t sparse[REDIS_SPARSE_MAX_BYTES];
+    uint8_t* values;
+    uint8_t* out;
+    uint64_t sparseBytes;
+    PyObject* bytes;
+
+    if (checkNotBusy(self, false) < 0) return NULL;
+
+    if (self->hashKind != HASH_REDIS || self->p != REDIS_P) {
+        PyErr_SetString(PyExc_ValueError, "Only HyperLogLogs created with from_redis_bytes() can be encoded for Redis");
+        return NULL;
+    }
+
+    values = (uint8_t*)calloc(REDIS_REGISTERS, 1);
+
+    if (values == NULL) return PyErr_NoMemory();
+
+    if (self->isSparse) {
+        SparseIterator it;
+
+        if (flushRegisterBuffer(self) < 0) {
+            free(values);
+            return PyErr_NoMemory();
+        }
+
+        initSparseIterator(&it, self, 0, 0);
+
+        while (nextSparseRegister(&it)) {
+            values[it.index] = it.fsb;
+        }
+    } else {
+        for (uint64_t i = 0; i < REDIS_REGISTERS; i++) {
+            values[i] = getDense(self, i);
+        }
+    }
+
+    sparseBytes = encodeRedisSparse(values, sparse, REDIS_SPARSE_MAX_BYTES);
+
+    if (sparseBytes > 0) {
+        header[4] = 1;
+        bytes = PyBytes_FromStringAndSize(NULL, REDIS_HEADER_SIZE + sparseBytes);
+    } else {
+        bytes = PyBytes_FromStringAndSize(NULL, REDIS_HEADER_SIZE + REDIS_DENSE_BYTES);
+    }
+
+    if (bytes == NULL) {
+        free(values);
+        return NULL;
+    }
+
+    out = (uint8_t*)PyBytes_AS_STRING(bytes);
+    memcpy(out, header, REDIS_HEADER_SIZE); /* Redis recomputes the invalid cached cardinality */
+
+    if (sparseBytes > 0) {
+        memcpy(out + REDIS_HEADER_SIZE, sparse, sparseBytes);
+    } else {
+        memset(out + REDIS_HEADER_SIZE, 0, REDIS_DENSE_BYTES);
+
+        for (uint64_t i = 0; i < REDIS_REGISTERS; i++) {
+            setRedisRegister(out + REDIS_HEADER_SIZE, i, values[i]);
+        }
+    }
+
+    free(values);
+
+    return bytes;
+}
+
+
+/*
+ * Serialization method to pickle a HyperLogLog object.
+ *
+ * HyperLogLog's are serialized using a single list. The first 7 elements
+ * are fields, the next 65 elements are the histogram, and the remaining
+ * elements represent the registers. Let N be the total number of elements in
+ * in the list, then the serialization schema is:
+ *
+ *     Index  Description
+ *     -----  -----------
+ *     0      version
+ *     1      isSparse field
+ *     2      added field
+ *     3      listSize field
+ *     4      isCached field
+ *     5      cache field
+ *     6      index of node that is currently cached
+ *     7-72   register histogram values
+ *     73-N   register values, if sparse then tuples of the form (register
+ *            index, register value) otherwise integers
+ */
+static PyObject* HyperLogLog_reduce(HyperLogLog* self)
+{
+    PyObject* val;
+    PyObject* state;
+    uint64_t dumpSize;
+    uint64_t histogram[65];
+    double hipEstimate;
+
+    if (checkNotBusy(self, false) < 0) return NULL;
+
+    if (self->isSparse) {
+        flushRegisterBuffer(self);
+        dumpSize = self->listSize + 65 + 7;
+    } else {
+        dumpSize = self->size + 65 + 7;
+    }
+
+    state = PyList_New(dumpSize);
+
+    for (uint64_t i = 0; i < dumpSize; i++) {
+        val = Py_BuildValue("k", 0);
+        PyList_SetItem(state, i, val);
+    }
+
+    PyList_SetItem(state, 0, Py_BuildValue("k", (uint64_t)self->isSparse));
+    PyList_SetItem(state, 1, Py_BuildValue("k", self->added));
+    PyList_SetItem(state, 2, Py_BuildValue("k", self->listSize));
+    PyList_SetItem(state, 3, Py_BuildValue("k", self->isCached));
+    PyList_SetItem(state, 4, Py_BuildValue("k", self->cache));
+    PyList_SetItem(state, 5, Py_BuildValue("k", 0));
+    PyList_SetItem(state, 6, Py_BuildValue("k", 0)); /* reserved */
+
+    /* Set histogram values, counted from the registers if they're concurrent */
+    foldRegisterBuffer(self, histogram, &hipEstimate);
+
+    for (int i = 7; i < 72; i++) {
+        val = Py_BuildValue("k", histogram[i - 7]);
+        PyList_SetItem(state, i, val);
+    }
+
+    if (self->isSparse) { /* Handle sparse representation */
+        if (self->isCacheValid) {
+            PyList_SetItem(state, 5, Py_BuildValue("k", self->cacheIndex));
+        }
+
+        SparseIterator it;
+        PyObject *pyList = NULL;
+        uint64_t j = 72;
+
+        initSparseIterator(&it, self, 0, 0);
+
+        while (nextSparseRegister(&it)) {
+            pyList = PyList_New(2);
+            PyList_SetItem(pyList, 0, Py_BuildValue("k", it.index));
+            PyList_SetItem(pyList, 1, Py_BuildValue("k", it.fsb));
+            PyList_SetItem(state, j, pyList);
+            j++;
+        }
+    } else { /* Handle dense representation */
+        for (uint64_t i = 72; i < self->size + 72; i++) {
+            val = Py_BuildValue("k", getDense(self, i - 72));
+            PyList_SetItem(state, i, val);
+        }
+    }
+
+    PyObject* args = Py_BuildValue("(iii)", self->p, self->seed, self->isSparse);
+    return Py_BuildValue("(ONN)", Py_TYPE(self), args, state);
+}
+
+
+/* Gets the seed value used in the Murmur hash. */
+static PyObject* HyperLogLog_seed(HyperLogLog* self)
+{
+    return Py_BuildValue("k", self->seed);
+}
+
+
+/* De-serialization method used to restore pickled objects. */
+static PyObject* HyperLogLog_set_state(HyperLogLog* self, PyObject* state)
+{
+
+    PyObject* dump;
+    PyObject* valPtr;
+    unsigned long val;
+
+    if (!PyArg_ParseTuple(state, "O:setstate", &dump)) return NULL;
+    if (checkNotBusy(self, true) < 0) return NULL;
+
+    if (self->isMapped) {
+        PyErr_SetString(PyExc_TypeError, "Cannot restore the state of a memory-mapped HyperLogLog");
+        return NULL;
+    }
+
+    self->isHipValid = 0;
+
+    self->isSparse = (bool) PyLong_AsUnsignedLong(PyList_GetItem(dump, 0));
+    self->added    = PyLong_AsUnsignedLong(PyList_GetItem(dump, 1));
+    self->listSize = PyLong_AsUnsignedLong(PyList_GetItem(dump, 2));
+    self->isCached = (bool) PyLong_AsUnsignedLong(PyList_GetItem(dump, 3));
+    self->cache    = PyLong_AsUnsignedLong(PyList_GetItem(dump, 4));
+
+    uint64_t dumpSize = self->isSparse ? self->listSize : self->size;
+    dumpSize += 65 + 7;
+
+    for (int i = 7; i < 65 + 7; i++) {
+        valPtr = PyList_GetItem(dump, i);
+        val = PyLong_AsUnsignedLong(valPtr);
+        self->histogram[i - 7] = val;
+    }
+
+    if (self->isSparse) {
+        uint64_t index;
+        uint64_t fsb;
+        uint64_t prev = 0;
+        uint8_t* out;
+        PyObject *lst = NULL;
+
+        /* Registers are stored in order so they can be encoded directly */
+        free(self->sparseRegisterList);
+        self->sparseRegisterList = (uint8_t*)malloc(self->listSize*(MAX_VARINT_BYTES + 1) + 1);
+
+        if (self->sparseRegisterList == NULL) {
+            self->listSize = 0;
+            return PyErr_NoMemory();
+        }
+
+        out = self->sparseRegisterList;
+
+        for (uint64_t i = 65 + 7; i < dumpSize; i++) {
+            lst = PyList_GetItem(dump, i);
+            index = PyLong_AsUnsignedLong(PyList_GetItem(lst, 0));
+            fsb = PyLong_AsUnsignedLong(PyList_GetItem(lst, 1));
+            out = writeSparseRegister(out, index - prev, (uint8_t)fsb);
+            prev = index;
+        }
+
+        self->listBytes = out - self->sparseRegisterList;
+        self->isCacheValid = 0;
+        out = (uint8_t*)realloc(self->sparseRegisterList, self->listBytes + 1); /* Release unused bytes */
+
+        if (out != NULL) {
+            self->sparseRegisterList = out;
+        }
+    } else {
+        bool nibbles = self->layout == LAYOUT_U4;
+        uint8_t* regs = nibbles ? (uint8_t*)calloc(self->size, sizeof(uint8_t)) : self->registers;
+
+        if (regs == NULL) return PyErr_NoMemory();
+
+        for (uint64_t i = 65 + 7; i < dumpSize; i++) {
+            valPtr = PyList_GetItem(dump, i);
+            val = PyLong_AsUnsignedLong(valPtr);
+            setRegisterIn(regs, nibbles || self->layout == LAYOUT_U8, i - 72, (uint8_t)val);
+        }
+
+        if (nibbles) { /* Encode the registers relative to their minimum */
+            int err = encodeNibbleRegisters(self, regs);
+            free(regs);
+            if (err < 0) return PyErr_NoMemory();
+        }
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+/* Gets the number of registers. */
+static PyObject* HyperLogLog_size(HyperLogLog* self)
+{
+    return Py_BuildValue("i", self->size);
+}
+
+
+static PyMemberDef HyperLogLog_members[] = {
+    {NULL} /* Sentinel */
+};
+
+
+static PyMethodDef HyperLogLog_methods[] = {
+    {"add", (PyCFunction)HyperLogLog_add, METH_VARARGS,
+     "Add an element."
+    },
+    {"add_many", (PyCFunction)HyperLogLog_add_many, METH_VARARGS | METH_KEYWORDS,
+     "Add every element of an iterable, optionally using multiple threads. Returns the number of registers updated."
+    },
+    {"add_file", (PyCFunction)HyperLogLog_add_file, METH_VARARGS | METH_KEYWORDS,
+     "Add every record of a file, optionally using multiple threads. Returns the number of registers updated."
+    },
+    {"add_hashes", (PyCFunction)HyperLogLog_add_hashes, METH_VARARGS,
+     "Add pre-computed 64 bit hashes from a buffer. Returns the number of registers updated."
+    },
+    {"cardinality", (PyCFunction)HyperLogLog_cardinality, METH_NOARGS,
+     "Get the cardinality."
+    },
+    {"merge", (PyCFunction)HyperLogLog_merge, METH_VARARGS,
+     "Merge another HyperLogLog. A HyperLogLog with more registers is folded to this size first,\n"
+     "merging one with fewer registers raises ValueError unless this HyperLogLog is fold()ed first."
+    },
+    {"fold", (PyCFunction)HyperLogLog_fold, METH_VARARGS,
+     "Reduce the number of registers to 2^p in place."
+    },
+    {"reduce_precision", (PyCFunction)HyperLogLog_reduce_precision, METH_VARARGS,
+     "Get a copy with 2^p registers."
+    },
+    {"hash", (PyCFunction)HyperLogLog_hash, METH_VARARGS,
+     "Get a hash using the hash function of the HyperLogLog."
+    },
+    {"seed", (PyCFunction)HyperLogLog_seed, METH_NOARGS,
+     "Get the hash function seed."
+    },
+    {"size", (PyCFunction)HyperLogLog_size, METH_NOARGS,
+     "Get the number of registers."
+    },
+    {"get_register", (PyCFunction)HyperLogLog_get_register, METH_VARARGS,
+     "Get the value of a register."
+    },
+    {"get_registers", (PyCFunction)HyperLogLog_get_registers, METH_VARARGS,
+     "Get the value of every register as a bytearray, or write them to a writable buffer."
+    },
+    {"registers_view", (PyCFunction)HyperLogLog_registers_view, METH_NOARGS,
+     "Get a read-only memoryview of the registers with one byte per register."
+    },
+    {"_histogram", (PyCFunction)HyperLogLog__histogram, METH_NOARGS,
+     "Get a histogram of the register values."
+    },
+    {"_get_meta", (PyCFunction)HyperLogLog__get_meta, METH_NOARGS,
+     "Get the values of internal attributes."
+    },
+    {"__reduce__", (PyCFunction)HyperLogLog_reduce, METH_NOARGS,
+     "Serialization helper function for pickling."
+    },
+    {"__reduce_ex__", (PyCFunction)HyperLogLog_reduce_ex, METH_VARARGS,
+     "Serialization helper function for pickling using to_bytes()."
+    },
+    {"to_bytes", (PyCFunction)HyperLogLog_to_bytes, METH_NOARGS,
+     "Serialize to bytes."
+    },
+    {"from_bytes", (PyCFunction)HyperLogLog_from_bytes, METH_VARARGS | METH_KEYWORDS | METH_CLASS,
+     "Deserialize from bytes created by to_bytes()."
+    },
+    {"open", (PyCFunction)HyperLogLog_open, METH_VARARGS | METH_KEYWORDS | METH_CLASS,
+     "Open a HyperLogLog stored in a memory-mapped file, optionally read-only or creating the file."
+    },
+    {"flush", (PyCFunction)HyperLogLog_flush, METH_NOARGS,
+     "Write changes of a memory-mapped HyperLogLog to its file."
+    },
+    {"from_redis_bytes", (PyCFunction)HyperLogLog_from_redis_bytes, METH_VARARGS | METH_CLASS,
+     "Create a HyperLogLog from the value of a Redis HyperLogLog key."
+    },
+    {"to_redis_bytes", (PyCFunction)HyperLogLog_to_redis_bytes, METH_NOARGS,
+     "Encode using the Redis HyperLogLog format."
+    },
+    {"union", (PyCFunction)HyperLogLog_union, METH_VARARGS | METH_STATIC,
+     "Create a HyperLogLog which is the union of the given HyperLogLogs, with the size of the smallest."
+    },
+    {"union_cardinality", (PyCFunction)HyperLogLog_union_cardinality, METH_VARARGS | METH_STATIC,
+     "Estimate the cardinality of the union of the given HyperLogLogs."
+    },
+    {"intersection_cardinality", (PyCFunction)HyperLogLog_intersection_cardinality, METH_VARARGS,
+     "Estimate the cardinality of the intersection with another HyperLogLog."
+    },
+    {"jaccard", (PyCFunction)HyperLogLog_jaccard, METH_VARARGS,
+     "Estimate the Jaccard index with another HyperLogLog."
+    },
+    {"__setstate__", (PyCFunction)HyperLogLog_set_state, METH_VARARGS,
+    "De-serialization helper function for pickling."
+    },
+    {NULL}  /* Sentinel */
+};
+
+
+static PyTypeObject HyperLogLogType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "HLL.HyperLogLog",                        /* tp_name */
+    sizeof(HyperLogLog),                      /* tp_basicsize */
+    0,                                        /* tp_itemsize */
+    (destructor)HyperLogLog_dealloc,          /* tp_dealloc */
+    0,                                        /* tp_print */
+    0,                                        /* tp_getattr */
+    0,                                        /* tp_setattr */
+    0,                                        /* tp_compare */
+    0,                                        /* tp_repr */
+    0,                                        /* tp_as_number */
+    0,                                        /* tp_as_sequence */
+    0,                                        /* tp_as_mapping */
+    0,                                        /* tp_hash */
+    0,                                        /* tp_call */
+    0,                                        /* tp_str */
+    0,                                        /* tp_getattro */
+    0,                                        /* tp_setattro */
+    &HyperLogLog_as_buffer,                   /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /* tp_flags */
+    "HyperLogLog object",                     /* tp_doc */
+    0,                                        /* tp_traverse */
+    0,                                        /* tp_clear */
+    0,                                        /* tp_richcompare */
+    0,                                        /* tp_weaklistoffset */
+    0,                                        /* tp_iter */
+    0,                                        /* tp_iternext */
+    HyperLogLog_methods,                      /* tp_methods */
+    HyperLogLog_members,                      /* tp_members */
+    0,                                        /* tp_getset */
+    0,                                        /* tp_base */
+    0,                                        /* tp_dict */
+    0,                                        /* tp_descr_get */
+    0,                                        /* tp_descr_set */
+    0,                                        /* tp_dictoffset */
+    (initproc)HyperLogLog_init,               /* tp_init */
+    0,                                        /* tp_alloc */
+    HyperLogLog_new,                          /* tp_new */
+};
+
+
+/*
+ * HyperLogLogMap
+ * --------------
+ *
+ * A HyperLogLogMap stores many HyperLogLogs, one per key, without a Python
+ * object or separate allocations per HyperLogLog. Every key starts with a
+ * sorted array of sparse registers, each a 32 bit integer (index << 6 | fsb).
+ * The array doubles in size as registers are set until it would use as much
+ * memory as 6 bit dense registers, at which point the key is promoted to dense
+ * registers.
+ *
+ * Register arrays are allocated from slabs, one for each array size. A slab
+ * allocates fixed size blocks from 1 MiB chunks and keeps a list of freed
+ * blocks, the index of the next free block is stored in the freed block
+ * itself. Keys are stored back to back in a key arena and indexed by an open
+ * addressing hash table of entry numbers.
+ */
+
+#define SLAB_CHUNK_BYTES (1 << 20)
+#define SLAB_PAD sizeof(uint32_t) /* Dense registers read the byte before the first, a whole
+                                     uint32_t keeps sparse blocks aligned */
+#define SLAB_NO_BLOCK UINT32_MAX
+#define MAP_MAX_CLASSES 32
+#define MAP_KEY_BYTES 0
+#define MAP_KEY_STR 1
+#define MAP_KEY_INT 2
+
+typedef struct {
+    uint8_t** chunks; /* Each chunk has SLAB_PAD bytes of padding before its first block */
+    uint32_t chunkCount;
+    uint32_t blockBytes; /* Size of each block */
+    uint32_t blocksPerChunk;
+    uint32_t blocks; /* Number of blocks handed out from chunks */
+    uint32_t freeHead; /* First freed block or SLAB_NO_BLOCK */
+} Slab;
+
+typedef struct {
+    uint64_t hash; /* Hash of the key */
+    uint64_t keyOffset; /* Position of the key in the key arena */
+    uint32_t keyLength;
+    uint32_t block; /* Block of the registers in the slab of sizeClass */
+    uint32_t count; /* Number of sparse registers */
+    uint8_t keyKind; /* MAP_KEY_BYTES, MAP_KEY_STR or MAP_KEY_INT */
+    uint8_t sizeClass; /* Slab of the registers, denseClass if dense */
+} MapEntry;
+
+typedef struct {
+    PyObject_HEAD
+    unsigned short p; /* 2^p = number of registers */
+    uint64_t size; /* Number of registers */
+    uint64_t seed; /* MurmurHash64A seed */
+    uint8_t denseClass; /* Slab of dense registers, sparse arrays use the slabs before it */
+    Slab slabs[MAP_MAX_CLASSES];
+    MapEntry* entries; /* Entries in insertion order */
+    uint64_t count; /* Number of entries */
+    uint64_t entryCapacity;
+    uint32_t* slots; /* Entry number + 1 for each slot, 0 if empty */
+    uint64_t slotCount; /* Number of slots, a power of 2 */
+    uint8_t* keys; /* Key arena */
+    uint64_t keyBytes;
+    uint64_t keyCapacity;
+} HyperLogLogMap;
+
+typedef struct {
+    PyObject_HEAD
+    HyperLogLogMap* map;
+    uint64_t pos; /* Next entry */
+} HyperLogLogMapIterator;
+
+
+/* Gets a block of a slab. */
+static inline uint8_t* slabBlock(const Slab* slab, uint32_t block)
+{
+    uint32_t chunk = block/slab->blocksPerChunk;
+    return slab->chunks[chunk] + SLAB_PAD + (uint64_t)(block % slab->blocksPerChunk)*slab->blockBytes;
+}
+
+
+/* Allocates a zeroed block from a slab. Returns SLAB_NO_BLOCK on failure to
+ * allocate memory. */
+static uint32_t slabAlloc(Slab* slab)
+{
+    uint32_t block = slab->freeHead;
+
+    if (block != SLAB_NO_BLOCK) {
+        memcpy(&slab->freeHead, slabBlock(slab, block), sizeof(uint32_t));
+    } else {
+        if (slab->blocks == slab->chunkCount*slab->blocksPerChunk) {
+            uint8_t** chunks = (uint8_t**)realloc(slab->chunks, (slab->chunkCount + 1)*sizeof(uint8_t*));
+            if (chunks == NULL) return SLAB_NO_BLOCK;
+            slab->chunks = chunks;
+
+            chunks[slab->chunkCount] = (uint8_t*)malloc(SLAB_PAD + (uint64_t)slab->blocksPerChunk*slab->blockBytes);
+            if (chunks[slab->chunkCount] == NULL) return SLAB_NO_BLOCK;
+            memset(chunks[slab->chunkCount], 0, SLAB_PAD);
+            slab->chunkCount++;
+        }
+
+        block = slab->blocks++;
+    }
+
+    memset(slabBlock(slab, block), 0, slab->blockBytes);
+
+    return block;
+}
+
+
+/* Returns a block to a slab. */
+static void slabFree(Slab* slab, uint32_t block)
+{
+    memcpy(slabBlock(slab, block), &slab->freeHead, sizeof(uint32_t));
+    slab->freeHead = block;
+}
+
+
+/* Gets the key of a HyperLogLogMap entry as a Python object. */
+static PyObject* mapEntryKey(const HyperLogLogMap* self, const MapEntry* entry)
+{
+    const char* data = (const char*)self->keys + entry->keyOffset;
+
+    if (entry->keyKind == MAP_KEY_STR) {
+        return PyUnicode_DecodeUTF8(data, entry->keyLength, NULL);
+    } else if (entry->keyKind == MAP_KEY_INT) {
+        long long value;
+        memcpy(&value, data, sizeof(value));
+        return PyLong_FromLongLong(value);
+    }
+
+    return PyBytes_FromStringAndSize(data, entry->keyLength);
+}
+
+
+/* Gets the bytes of a key. Integer keys are stored in scratch. Returns -1 and
+ * sets an exception if the key is not bytes, str or an int. */
+static int parseMapKey(PyObject* key, const char** data, Py_ssize_t* len, uint8_t* kind, long long* scratch)
+{
+    if (PyBytes_Check(key)) {
+        *kind = MAP_KEY_BYTES;
+        return PyBytes_AsStringAndSize(key, (char**)data, len);
+    } else if (PyUnicode_Check(key)) {
+        *kind = MAP_KEY_STR;
+        *data = PyUnicode_AsUTF8AndSize(key, len);
+        return *data == NULL ? -1 : 0;
+    } else if (PyLong_Check(key)) {
+        *kind = MAP_KEY_INT;
+        *scratch = PyLong_AsLongLong(key);
+        if (*scratch == -1 && PyErr_Occurred()) return -1;
+        *data = (const char*)scratch;
+        *len = sizeof(*scratch);
+        return 0;
+    }
+
+    PyErr_SetString(PyExc_TypeError, "HyperLogLogMap keys must be bytes, str or int");
+    return -1;
+}
+
+
+/* Finds the slot of a key, which is empty if the key is not in the map. */
+static uint64_t findMapSlot(const HyperLogLogMap* self, const char* data, Py_ssize_t len, uint8_t kind, uint64_t hash)
+{
+    uint64_t mask = self->slotCount - 1;
+    uint64_t i = hash & mask;
+
+    while (self->slots[i] != 0) {
+        const MapEntry* entry = &self->entries[self->slots[i] - 1];
+
+        if (entry->hash == hash && entry->keyKind == kind && entry->keyLength == (uint64_t)len &&
+            memcmp(self->keys + entry->keyOffset, data, len) == 0) {
+            break;
+        }
+
+        i = (i + 1) & mask;
+    }
+
+    return i;
+}
+
+
+/* Gets the entry of a key. Returns NULL and sets an exception if the key is
+ * invalid. If the key is not in the map a KeyError is set unless insert is
+ * true, in which case an empty entry is added for the key. */
+static MapEntry* getMapEntry(HyperLogLogMap* self, PyObject* key, bool insert)
+{
+    const char* data;
+    Py_ssize_t len;
+    uint8_t kind;
+    long long scratch;
+    uint64_t hash;
+    uint64_t slot;
+    MapEntry* entry;
+
+    if (self->slots == NULL) { /* __init__() wasn't called, e.g. HyperLogLogMap.__new__() */
+        PyErr_SetString(PyExc_TypeError, "HyperLogLogMap is not initialized");
+        return NULL;
+    }
+
+    if (parseMapKey(key, &data, &len, &kind, &scratch) < 0) return NULL;
+
+    hash = MurmurHash64A(data, len, kind);
+    slot = findMapSlot(self, data, len, kind, hash);
+
+    if (self->slots[slot] != 0) {
+        return &self->entries[self->slots[slot] - 1];
+    } else if (!insert) {
+        PyErr_SetObject(PyExc_KeyError, key);
+        return NULL;
+    }
+
+    if (len > UINT32_MAX || self->count >= UINT32_MAX - 1) {
+        PyErr_SetString(PyExc_OverflowError, "HyperLogLogMap key is too large");
+        return NULL;
+    }
+
+    if (4*(self->count + 1) > 3*self->slotCount) { /* Keep the table at most 3/4 full */
+        uint64_t slotCount = 2*self->slotCount;
+        uint32_t* slots = (uint32_t*)calloc(slotCount, sizeof(uint32_t));
+
+        if (slots == NULL) {
+            PyErr_NoMemory();
+            return NULL;
+        }
+
+        for (uint64_t i = 0; i < self->count; i++) {
+            uint64_t j = self->entries[i].hash & (slotCount - 1);
+
+            while (slots[j] != 0) {
+                j = (j + 1) & (slotCount - 1);
+            }
+
+            slots[j] = i + 1;
+        }
+
+        free(self->slots);
+        self->slots = slots;
+        self->slotCount = slotCount;
+        slot = findMapSlot(self, data, len, kind, hash);
+    }
+
+    if (self->count == self->entryCapacity) {
+        uint64_t capacity = self->entryCapacity ? 2*self->entryCapacity : 16;
+        MapEntry* entries = (MapEntry*)realloc(self->entries, capacity*sizeof(MapEntry));
+
+        if (entries == NULL) {
+            PyErr_NoMemory();
+            return NULL;
+        }
+
+        self->entries = entries;
+        self->entryCapacity = capacity;
+    }
+
+    if (self->keyBytes + len > self->keyCapacity) {
+        uint64_t capacity = self->keyCapacity ? self->keyCapacity : 256;
+        uint8_t* keys;
+
+        while (capacity < self->keyBytes + len) {
+            capacity *= 2;
+        }
+
+        if ((keys = (uint8_t*)realloc(self->keys, capacity)) == NULL) {
+            PyErr_NoMemory();
+            return NULL;
+        }
+
+        self->keys = keys;
+        self->keyCapacity = capacity;
+    }
+
+    entry = &self->entries[self->count];
+    entry->sizeClass = 0; /* The smallest sparse array, or dense registers if p is very small */
+    entry->block = slabAlloc(&self->slabs[0]);
+
+    if (entry->block == SLAB_NO_BLOCK) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    memcpy(self->keys + self->keyBytes, data, len);
+    entry->hash = hash;
+    entry->keyOffset = self->keyBytes;
+    entry->keyLength = (uint32_t)len;
+    entry->keyKind = kind;
+    entry->count = 0;
+    self->keyBytes += len;
+    self->slots[slot] = ++self->count;
+
+    return entry;
+}
+
+
+/* Moves the sparse registers of an entry to dense registers. Returns -1 on
+ * failure to allocate memory. */
+static int promoteMapEntry(HyperLogLogMap* self, MapEntry* entry)
+{
+    uint32_t block = slabAlloc(&self->slabs[self->denseClass]);
+    const uint32_t* sparse;
+    uint8_t* regs;
+
+    if (block == SLAB_NO_BLOCK) return -1;
+
+    sparse = (const uint32_t*)slabBlock(&self->slabs[entry->sizeClass], entry->block);
+    regs = slabBlock(&self->slabs[self->denseClass], block);
+
+    for (uint32_t i = 0; i < entry->count; i++) {
+        setDenseRegister(sparse[i] >> 6, sparse[i] & 63, regs);
+    }
+
+    slabFree(&self->slabs[entry->sizeClass], entry->block);
+    entry->sizeClass = self->denseClass;
+    entry->block = block;
+
+    return 0;
+}
+
+
+/* Sets a register of an entry if fsb is larger than its current value.
+ * Returns 1 if the register was updated or -1 on failure to allocate memory. */
+static int setMapRegister(HyperLogLogMap* self, MapEntry* entry, uint32_t index, uint8_t fsb)
+{
+    uint32_t* sparse;
+    uint32_t lo = 0;
+    uint32_t hi = entry->count;
+
+    if (entry->sizeClass == self->denseClass) {
+        uint8_t* regs = slabBlock(&self->slabs[self->denseClass], entry->block);
+
+        if (fsb <= getDenseRegister(index, regs)) return 0;
+
+        setDenseRegister(index, fsb, regs);
+        return 1;
+    }
+
+    sparse = (uint32_t*)slabBlock(&self->slabs[entry->sizeClass], entry->block);
+
+    while (lo < hi) { /* Binary search for the first register with an index >= index */
+        uint32_t mid = (lo + hi)/2;
+
+        if ((sparse[mid] >> 6) < index) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (lo < entry->count && (sparse[lo] >> 6) == index) {
+        if (fsb <= (sparse[lo] & 63)) return 0;
+
+        sparse[lo] = (index << 6) | fsb;
+        return 1;
+    }
+
+    if (entry->count*sizeof(uint32_t) == self->slabs[entry->sizeClass].blockBytes) {
+        uint8_t next = entry->sizeClass + 1;
+        uint32_t block;
+
+        if (next == self->denseClass) {
+            if (promoteMapEntry(self, entry) < 0) return -1;
+            return setMapRegister(self, entry, index, fsb);
+        }
+
+        if ((block = slabAlloc(&self->slabs[next])) == SLAB_NO_BLOCK) return -1;
+
+        memcpy(slabBlock(&self->slabs[next], block), sparse, entry->count*sizeof(uint32_t));
+        slabFree(&self->slabs[entry->sizeClass], entry->block);
+        entry->sizeClass = next;
+        entry->block = block;
+        sparse = (uint32_t*)slabBlock(&self->slabs[next], block);
+    }
+
+    memmove(sparse + lo + 1, sparse + lo, (entry->count - lo)*sizeof(uint32_t));
+    sparse[lo] = (index << 6) | fsb;
+    entry->count++;
+
+    return 1;
+}
+
+
+/* Counts the register values of an entry. */
+static void countMapRegisters(const HyperLogLogMap* self, const MapEntry* entry, uint64_t* histogram)
+{
+    const uint8_t* regs = slabBlock(&self->slabs[entry->sizeClass], entry->block);
+
+    if (entry->sizeClass == self->denseClass) {
+        countDenseRegisters(regs, self->size, histogram);
+        return;
+    }
+
+    memset(histogram, 0, 65*sizeof(uint64_t));
+    histogram[0] = self->size - entry->count;
+
+    for (uint32_t i = 0; i < entry->count; i++) {
+        histogram[((const uint32_t*)regs)[i] & 63]++;
+    }
+}
+
+
+static PyObject* HyperLogLogMap_new(PyTypeObject* type, PyObject* args, PyObject* kwds)
+{
+    HyperLogLogMap* self = (HyperLogLogMap*)type->tp_alloc(type, 0);
+    return (PyObject*)self;
+}
+
+
+static int HyperLogLogMap_init(HyperLogLogMap* self, PyObject* args, PyObject* kwds)
+{
+    static char* kwlist[] = {"p", "seed", NULL};
+    int p = 12;
+    uint64_t denseBytes;
+
+    self->seed = 314;
+
+    if (self->slots != NULL) {
+        PyErr_SetString(PyExc_TypeError, "HyperLogLogMap is already initialized");
+        return -1;
+    }
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|iK", kwlist, &p, &self->seed)) {
+        return -1;
+    }
+
+    if (p < 2 || p > 26) { /* Sparse registers store the index in 26 bits */
+        PyErr_SetString(PyExc_ValueError, "p is out of range");
+        return -1;
+    }
+
+    self->p = p;
+    self->size = 1ULL << p;
+    denseBytes = (self->size*6)/8 + 1;
+
+    /* Sparse arrays hold 4, 8, 16, ... registers while smaller than dense */
+    self->denseClass = 0;
+
+    while ((4*sizeof(uint32_t) << self->denseClass) < denseBytes) {
+        Slab* slab = &self->slabs[self->denseClass++];
+        slab->blockBytes = 4*sizeof(uint32_t) << (self->denseClass - 1);
+    }
+
+    self->slabs[self->denseClass].blockBytes = denseBytes > 4 ? denseBytes : 4;
+
+    for (uint8_t i = 0; i <= self->denseClass; i++) {
+        Slab* slab = &self->slabs[i];
+        slab->blocksPerChunk = slab->blockBytes < SLAB_CHUNK_BYTES ? SLAB_CHUNK_BYTES/slab->blockBytes : 1;
+        slab->freeHead = SLAB_NO_BLOCK;
+    }
+
+    self->slotCount = 16;
+    self->slots = (uint32_t*)calloc(self->slotCount, sizeof(uint32_t));
+
+    if (self->slots == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static void HyperLogLogMap_dealloc(HyperLogLogMap* self)
+{
+    for (int i = 0; i < MAP_MAX_CLASSES; i++) {
+        for (uint32_t j = 0; j < self->slabs[i].chunkCount; j++) {
+            free(self->slabs[i].chunks[j]);
+        }
+
+        free(self->slabs[i].chunks);
+    }
+
+    free(self->entries);
+    free(self->slots);
+    free(self->keys);
+
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+
+/* Adds an element to the HyperLogLog of a key. */
+static PyObject* HyperLogLogMap_add(HyperLogLogMap* self, PyObject* args)
+{
+    PyObject* key;
+    PyObject* value;
+    MapEntry* entry;
+    uint64_t hash;
+    uint64_t index;
+    uint8_t fsb;
+    int updated;
+
+    if (!PyArg_ParseTuple(args, "OO", &key, &value)) return NULL;
+    if (hashObject(value, self->seed, HASH_MURMUR64A, &hash) < 0) return NULL;
+    if ((entry = getMapEntry(self, key, true)) == NULL) return NULL;
+
+    splitHash(hash, self->p, HASH_MURMUR64A, &index, &fsb);
+    updated = setMapRegister(self, entry, (uint32_t)index, fsb);
+
+    if (updated < 0) {
+        return PyErr_NoMemory();
+    } else if (updated) {
+        Py_RETURN_TRUE;
+    }
+
+    Py_RETURN_FALSE;
+}
+
+
+/* Estimates the cardinality of the HyperLogLog of a key. */
+static PyObject* HyperLogLogMap_cardinality(HyperLogLogMap* self, PyObject* key)
+{
+    uint64_t histogram[65];
+    MapEntry* entry = getMapEntry(self, key, false);
+
+    if (entry == NULL) return NULL;
+
+    countMapRegisters(self, entry, histogram);
+
+    return Py_BuildValue("K", estimateCardinality(histogram, self->p));
+}
+
+
+/* Creates a HyperLogLog with the registers of a key. */
+static PyObject* HyperLogLogMap_get(HyperLogLogMap* self, PyObject* key)
+{
+    MapEntry* entry = getMapEntry(self, key, false);
+    const uint8_t* regs;
+    HyperLogLog* hll;
+
+    if (entry == NULL) return NULL;
+    if ((hll = newHyperLogLog(&HyperLogLogType, self->p, false, LAYOUT_U6)) == NULL) return NULL;
+
+    hll->seed = self->seed;
+    regs = slabBlock(&self->slabs[entry->sizeClass], entry->block);
+
+    if (entry->sizeClass == self->denseClass) {
+        memcpy(hll->registers, regs, (self->size*6)/8 + 1);
+    } else {
+        for (uint32_t i = 0; i < entry->count; i++) {
+            uint32_t reg = ((const uint32_t*)regs)[i];
+            setDenseRegister(reg >> 6, reg & 63, hll->registers);
+        }
+    }
+
+    countMapRegisters(self, entry, hll->histogram);
+
+    return (PyObject*)hll;
+}
+
+
+/* Merges every HyperLogLog of another HyperLogLogMap into the HyperLogLog of
+ * the same key, adding keys which are missing. */
+static PyObject* HyperLogLogMap_merge(HyperLogLogMap* self, PyObject* args)
+{
+    HyperLogLogMap* other;
+
+    if (!PyArg_ParseTuple(args, "O!", Py_TYPE(self), &other)) return NULL;
+
+    if (other->p != self->p || other->seed != self->seed) {
+        PyErr_SetString(PyExc_ValueError, "Cannot merge HyperLogLogMaps with different p or seed");
+        return NULL;
+    }
+
+    if (other == self) {
+        Py_RETURN_NONE;
+    }
+
+    for (uint64_t i = 0; i < other->count; i++) {
+        const MapEntry* src = &other->entries[i];
+        const uint8_t* regs = slabBlock(&other->slabs[src->sizeClass], src->block);
+        PyObject* key = mapEntryKey(other, src);
+        MapEntry* dst;
+
+        if (key == NULL) return NULL;
+
+        dst = getMapEntry(self, key, true);
+        Py_DECREF(key);
+
+        if (dst == NULL) return NULL;
+
+        if (src->sizeClass != other->denseClass) {
+            for (uint32_t j = 0; j < src->count; j++) {
+                uint32_t reg = ((const uint32_t*)regs)[j];
+
+                if (setMapRegister(self, dst, reg >> 6, reg & 63) < 0) return PyErr_NoMemory();
+            }
+            continue;
+        }
+
+        if (dst->sizeClass != self->denseClass && promoteMapEntry(self, dst) < 0) {
+            return PyErr_NoMemory();
+        }
+
+        maxRegisters(slabBlock(&self->slabs[self->denseClass], dst->block), false, regs, false, self->size);
+    }
+
+    Py_RETURN_NONE;
+}
+
+
+/* Gets a dictionary of internal attributes and their values */
+static PyObject* HyperLogLogMap__get_meta(HyperLogLogMap* self)
+{
+    uint64_t dense = 0;
+    uint64_t bytes = self->slotCount*sizeof(uint32_t) + self->entryCapacity*sizeof(MapEntry) + self->keyCapacity;
+
+    for (uint64_t i = 0; i < self->count; i++) {
+        dense += self->entries[i].sizeClass == self->denseClass;
+    }
+
+    for (int i = 0; i <= self->denseClass; i++) {
+        bytes += (uint64_t)self->slabs[i].chunkCount*self->slabs[i].blocksPerChunk*self->slabs[i].blockBytes;
+    }
+
+    return Py_BuildValue("{s:K,s:K,s:K}",
+        "keys", self->count,
+        "dense_keys", dense,
+        "bytes", bytes
+    );
+}
+
+
+static PyObject* HyperLogLogMap_p(HyperLogLogMap* self)
+{
+    return Py_BuildValue("i", self->p);
+}
+
+
+static PyObject* HyperLogLogMap_seed(HyperLogLogMap* self)
+{
+    return Py_BuildValue("K", self->seed);
+}
+
+
+static Py_ssize_t HyperLogLogMap_length(HyperLogLogMap* self)
+{
+    return (Py_ssize_t)self->count;
+}
+
+
+static int HyperLogLogMap_contains(HyperLogLogMap* self, PyObject* key)
+{
+    if (getMapEntry(self, key, false) != NULL) return 1;
+    if (!PyErr_ExceptionMatches(PyExc_KeyError)) return -1;
+
+    PyErr_Clear();
+    return 0;
+}
+
+
+static PyObject* HyperLogLogMap_iter(HyperLogLogMap* self);
+
+
+static PyMethodDef HyperLogLogMap_methods[] = {
+    {"add", (PyCFunction)HyperLogLogMap_add, METH_VARARGS,
+     "Add an element to the HyperLogLog of a key."
+    },
+    {"cardinality", (PyCFunction)HyperLogLogMap_cardinality, METH_O,
+     "Get the cardinality of the HyperLogLog of a key."
+    },
+    {"get", (PyCFunction)HyperLogLogMap_get, METH_O,
+     "Get a copy of the HyperLogLog of a key."
+    },
+    {"merge", (PyCFunction)HyperLogLogMap_merge, METH_VARARGS,
+     "Merge every HyperLogLog of another HyperLogLogMap."
+    },
+    {"p", (PyCFunction)HyperLogLogMap_p, METH_NOARGS,
+     "Get the number of register index bits."
+    },
+    {"seed", (PyCFunction)HyperLogLogMap_seed, METH_NOARGS,
+     "Get the hash function seed."
+    },
+    {"_get_meta", (PyCFunction)HyperLogLogMap__get_meta, METH_NOARGS,
+     "Get internal attributes."
+    },
+    {NULL}  /* Sentinel */
+};
+
+
+static PySequenceMethods HyperLogLogMap_as_sequence = {
+    (lenfunc)HyperLogLogMap_length,           /* sq_length */
+    0,                                        /* sq_concat */
+    0,                                        /* sq_repeat */
+    0,                                        /* sq_item */
+    0,                                        /* was_sq_slice */
+    0,                                        /* sq_ass_item */
+    0,                                        /* was_sq_ass_slice */
+    (objobjproc)HyperLogLogMap_contains,      /* sq_contains */
+};
+
+
+static PyTypeObject HyperLogLogMapType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "HLL.HyperLogLogMap",                     /* tp_name */
+    sizeof(HyperLogLogMap),                   /* tp_basicsize */
+    0,                                        /* tp_itemsize */
+    (destructor)HyperLogLogMap_dealloc,       /* tp_dealloc */
+    0,                                        /* tp_print */
+    0,                                        /* tp_getattr */
+    0,                                        /* tp_setattr */
+    0,                                        /* tp_compare */
+    0,                                        /* tp_repr */
+    0,                                        /* tp_as_number */
+    &HyperLogLogMap_as_sequence,              /* tp_as_sequence */
+    0,                                        /* tp_as_mapping */
+    0,                                        /* tp_hash */
+    0,                                        /* tp_call */
+    0,                                        /* tp_str */
+    0,                                        /* tp_getattro */
+    0,                                        /* tp_setattro */
+    0,                                        /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,/* tp_flags */
+    "HyperLogLogMap object",                  /* tp_doc */
+    0,                                        /* tp_traverse */
+    0,                                        /* tp_clear */
+    0,                                        /* tp_richcompare */
+    0,                                        /* tp_weaklistoffset */
+    (getiterfunc)HyperLogLogMap_iter,         /* tp_iter */
+    0,                                        /* tp_iternext */
+    HyperLogLogMap_methods,                   /* tp_methods */
+    0,                                        /* tp_members */
+    0,                                        /* tp_getset */
+    0,                                        /* tp_base */
+    0,                                        /* tp_dict */
+    0,                                        /* tp_descr_get */
+    0,                                        /* tp_descr_set */
+    0,                                        /* tp_dictoffset */
+    (initproc)HyperLogLogMap_init,            /* tp_init */
+    0,                                        /* tp_alloc */
+    HyperLogLogMap_new,                       /* tp_new */
+};
+
+
+static void HyperLogLogMapIterator_dealloc(HyperLogLogMapIterator* self)
+{
+    Py_XDECREF(self->map);
+    PyObject_Del(self);
+}
+
+
+static PyObject* HyperLogLogMapIterator_next(HyperLogLogMapIterator* self)
+{
+    if (self->pos >= self->map->count) return NULL;
+
+    return mapEntryKey(self->map, &self->map->entries[self->pos++]);
+}
+
+
+static PyTypeObject HyperLogLogMapIteratorType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "HLL.HyperLogLogMapIterator",             /* tp_name */
+    sizeof(HyperLogLogMapIterator),           /* tp_basicsize */
+    0,                                        /* tp_itemsize */
+    (destructor)HyperLogLogMapIterator_dealloc, /* tp_dealloc */
+    0,                                        /* tp_print */
+    0,                                        /* tp_getattr */
+    0,                                        /* tp_setattr */
+    0,                                        /* tp_compare */
+    0,                                        /* tp_repr */
+    0,                                        /* tp_as_number */
+    0,                                        /* tp_as_sequence */
+    0,                                        /* tp_as_mapping */
+    0,                                        /* tp_hash */
+    0,                                        /* tp_call */
+    0,                                        /* tp_str */
+    0,                                        /* tp_getattro */
+    0,                                        /* tp_setattro */
+    0,                                        /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                       /* tp_flags */
+    "HyperLogLogMap key iterator",            /* tp_doc */
+    0,                                        /* tp_traverse */
+    0,                                        /* tp_clear */
+    0,                                        /* tp_richcompare */
+    0,                                        /* tp_weaklistoffset */
+    PyObject_SelfIter,                        /* tp_iter */
+    (iternextfunc)HyperLogLogMapIterator_next,/* tp_iternext */
+    0,                                        /* tp_methods */
+    0,                                        /* tp_members */
+    0,                                        /* tp_getset */
+    0,                                        /* tp_base */
+    0,                                        /* tp_dict */
+    0,                                        /* tp_descr_get */
+    0,                                        /* tp_descr_set */
+    0,                                        /* tp_dictoffset */
+    0,                                        /* tp_init */
+    0,                                        /* tp_alloc */
+    0,                                        /* tp_new */
+};
+
+
+/* Iterates over the keys in insertion order. */
+static PyObject* HyperLogLogMap_iter(HyperLogLogMap* self)
+{
+    HyperLogLogMapIterator* it = PyObject_New(HyperLogLogMapIterator, &HyperLogLogMapIteratorType);
+
+    if (it == NULL) return NULL;
+
+    Py_INCREF(self);
+    it->map = self;
+    it->pos = 0;
+
+    return (PyObject*)it;
+}
+
+
+/*
+ * SlidingHyperLogLog
+ * ------------------
+ *
+ * A SlidingHyperLogLog estimates the number of distinct elements added within
+ * any window of time up to a maximum window, using the Sliding HyperLogLog
+ * algorithm [5]. Instead of a single value, each register keeps the list of
+ * possible future maxima: the (timestamp, fsb) pairs which could still be the
+ * largest value of the register for some window. A pair is dropped once a
+ * pair at least as recent has a value at least as large, or once it is older
+ * than the maximum window. The values in a list are therefore strictly
+ * decreasing as the timestamps increase, so a list holds at most 64 pairs and
+ * usually only a few.
+ *
+ * The value of a register for a window is the value of the first pair in the
+ * window, so the histogram of any window is built with one pass over the
+ * registers.
+ */
+
+typedef struct {
+    double timestamp;
+    uint8_t fsb;
+} SlidingEntry;
+
+typedef struct {
+    SlidingEntry* entries; /* Sorted by timestamp */
+    uint8_t count;
+    uint8_t capacity;
+} SlidingRegister;
+
+typedef struct {
+    PyObject_HEAD
+    unsigned short p; /* 2^p = number of registers */
+    uint64_t size; /* Number of registers */
+    uint64_t seed; /* MurmurHash64A seed */
+    double window; /* Maximum window in seconds */
+    double latest; /* Latest timestamp added */
+    SlidingRegister* registers;
+} SlidingHyperLogLog;
+
+
+/* Gets the current time in seconds since the epoch. */
+static double currentTime(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec + (double)ts.tv_nsec*1e-9;
+}
+
+
+/* Adds a pair to the list of a register, dropping pairs older than horizon
+ * and pairs the new pair makes redundant. Returns 1 if the list changed, 0 if
+ * the pair is redundant or -1 on failure to allocate memory. */
+static int addSlidingEntry(SlidingRegister* reg, double timestamp, uint8_t fsb, double horizon)
 {
-    HyperLogLog* otherHLL;
-    uint64_t otherSize;
+    uint8_t kept = 0;
+    uint8_t pos;
 
-    if (!PyArg_ParseTuple(args, "O", &otherHLL)) return NULL;
+    if (timestamp <= horizon) return 0;
 
-    otherSize = otherHLL->size;
+    for (uint8_t i = 0; i < reg->count; i++) {
+        SlidingEntry* e = &reg->entries[i];
 
-    if (otherSize != self->size) {
-        PyErr_SetString(PyExc_ValueError, "Unequal sizes");
-        return NULL;
+        if (e->timestamp >= timestamp && e->fsb >= fsb) return 0; /* The new pair is redundant */
     }
 
-    self->isCached = 0;
-
-    for (uint64_t i = 0; i < self->size; i++) {
-        uint64_t newVal;
-        uint64_t oldVal;
+    for (uint8_t i = 0; i < reg->count; i++) { /* Drop expired and redundant pairs */
+        SlidingEntry e = reg->entries[i];
 
-        if (self->isSparse) {
-            oldVal = getSparseRegister(self, i);
-        } else {
-            oldVal = getDenseRegister(i, self->registers);
+        if (e.timestamp > horizon && (e.timestamp > timestamp || e.fsb > fsb)) {
+            reg->entries[kept++] = e;
         }
+    }
 
-        if (otherHLL->isSparse) {
-            newVal = getSparseRegister(otherHLL, i);
-        } else {
-            newVal = getDenseRegister(i, otherHLL->registers);
-        }
+    reg->count = kept;
 
-        if (oldVal < newVal) {
-            setRegister(self, i, (uint8_t)newVal);
-        }
+    if (reg->count == reg->capacity) {
+        uint8_t capacity = reg->capacity ? 2*reg->capacity : 2;
+        SlidingEntry* entries = (SlidingEntry*)realloc(reg->entries, capacity*sizeof(SlidingEntry));
+
+        if (entries == NULL) return -1;
+
+        reg->entries = entries;
+        reg->capacity = capacity;
     }
 
-    Py_INCREF(Py_None);
-    return Py_None;
+    for (pos = reg->count; pos > 0 && reg->entries[pos - 1].timestamp > timestamp; pos--) {
+        reg->entries[pos] = reg->entries[pos - 1];
+    }
+
+    reg->entries[pos].timestamp = timestamp;
+    reg->entries[pos].fsb = fsb;
+    reg->count++;
+
+    return 1;
 }
 
 
-static PyObject* HyperLogLog_new(PyTypeObject* type, PyObject*args, PyObject* kwds)
+/* Adds a pair to a register and advances the latest timestamp. */
+static int addSlidingRegister(SlidingHyperLogLog* self, uint64_t index, double timestamp, uint8_t fsb)
 {
-    HyperLogLog* self;
-    self = (HyperLogLog*)type->tp_alloc(type, 0);
+    if (timestamp > self->latest) {
+        self->latest = timestamp;
+    }
+
+    return addSlidingEntry(&self->registers[index], timestamp, fsb, self->latest - self->window);
+}
+
+
+static PyObject* SlidingHyperLogLog_new(PyTypeObject* type, PyObject* args, PyObject* kwds)
+{
+    SlidingHyperLogLog* self = (SlidingHyperLogLog*)type->tp_alloc(type, 0);
     return (PyObject*)self;
 }
 
 
-/*
- * Serialization method to pickle a HyperLogLog object.
- *
- * HyperLogLog's are serialized using a single list. The first 7 elements
- * are fields, the next 65 elements are the histogram, and the remaining
- * elements represent the registers. Let N be the total number of elements in
- * in the list, then the serialization schema is:
- *
- *     Index  Description
- *     -----  -----------
- *     0      version
- *     1      isSparse field
- *     2      added field
- *     3      listSize field
- *     4      isCached field
- *     5      cache field
- *     6      index of node that is currently cached
- *     7-72   register histogram values
- *     73-N   register values, if sparse then tuples of the form (register
- *            index, register value) otherwise integers
- */
-static PyObject* HyperLogLog_reduce(HyperLogLog* self)
+static int SlidingHyperLogLog_init(SlidingHyperLogLog* self, PyObject* args, PyObject* kwds)
 {
-    PyObject* val;
-    PyObject* state;
-    uint64_t dumpSize;
+    static char* kwlist[] = {"p", "window", "seed", NULL};
+    int p = 12;
 
-    if (self->isSparse) {
-        flushRegisterBuffer(self);
-        dumpSize = self->listSize + 65 + 7;
-    } else {
-        dumpSize = self->size + 65 + 7;
-    }
+    self->window = 60.0;
+    self->seed = 314;
 
-    state = PyList_New(dumpSize);
+    if (self->registers != NULL) {
+        PyErr_SetString(PyExc_TypeError, "SlidingHyperLogLog is already initialized");
+        return -1;
+    }
 
-    for (uint64_t i = 0; i < dumpSize; i++) {
-        val = Py_BuildValue("k", 0);
-        PyList_SetItem(state, i, val);
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|idK", kwlist, &p, &self->window, &self->seed)) {
+        return -1;
     }
 
-    PyList_SetItem(state, 0, Py_BuildValue("k", (uint64_t)self->isSparse));
-    PyList_SetItem(state, 1, Py_BuildValue("k", self->added));
-    PyList_SetItem(state, 2, Py_BuildValue("k", self->listSize));
-    PyList_SetItem(state, 3, Py_BuildValue("k", self->isCached));
-    PyList_SetItem(state, 4, Py_BuildValue("k", self->cache));
-    PyList_SetItem(state, 5, Py_BuildValue("k", 0));
-    PyList_SetItem(state, 6, Py_BuildValue("k", 0)); /* reserved */
+    if (p < 2 || p > 63) {
+        PyErr_SetString(PyExc_ValueError, "p is out of range");
+        return -1;
+    }
 
-    /* Set histogram values */
-    for (int i = 7; i < 72; i++) {
-        val = Py_BuildValue("k", self->histogram[i - 7]);
-        PyList_SetItem(state, i, val);
+    if (!(self->window > 0)) {
+        PyErr_SetString(PyExc_ValueError, "window must be positive");
+        return -1;
     }
 
-    if (self->isSparse) { /* Handle sparse representation */
-        if (self->nodeCache != NULL) {
-            PyList_SetItem(state, 5, Py_BuildValue("k", self->nodeCache->index));
-        }
+    self->p = p;
+    self->size = 1ULL << p;
+    self->latest = -INFINITY;
+    self->registers = (SlidingRegister*)calloc(self->size, sizeof(SlidingRegister));
 
-        struct Node *current = NULL;
-        PyObject *pyList = NULL;
+    if (self->registers == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
 
-        current = self->sparseRegisterList;
-        uint64_t j = 72;
+    return 0;
+}
 
-        while (current != NULL) {
-            pyList = PyList_New(2);
-            PyList_SetItem(pyList, 0, Py_BuildValue("k", current->index));
-            PyList_SetItem(pyList, 1, Py_BuildValue("k", current->fsb));
-            PyList_SetItem(state, j, pyList);
-            current = current->next;
-            j++;
-        }
-    } else { /* Handle dense representation */
-        for (uint64_t i = 72; i < self->size + 72; i++) {
-            val = Py_BuildValue("k", getDenseRegister(i - 72, self->registers));
-            PyList_SetItem(state, i, val);
+
+static void SlidingHyperLogLog_dealloc(SlidingHyperLogLog* self)
+{
+    if (self->registers != NULL) {
+        for (uint64_t i = 0; i < self->size; i++) {
+            free(self->registers[i].entries);
         }
     }
 
-    PyObject* args = Py_BuildValue("(iii)", self->p, self->seed, self->isSparse);
-    return Py_BuildValue("(ONN)", Py_TYPE(self), args, state);
+    free(self->registers);
+
+    Py_TYPE(self)->tp_free((PyObject*)self);
 }
 
 
-/* Gets the seed value used in the Murmur hash. */
-static PyObject* HyperLogLog_seed(HyperLogLog* self)
+/* Adds an element with a timestamp, the current time by default. */
+static PyObject* SlidingHyperLogLog_add(SlidingHyperLogLog* self, PyObject* args, PyObject* kwds)
 {
-    return Py_BuildValue("k", self->seed);
+    static char* kwlist[] = {"value", "timestamp", NULL};
+    PyObject* value;
+    PyObject* timestampObj = Py_None;
+    double timestamp;
+    uint64_t hash;
+    uint64_t index;
+    uint8_t fsb;
+    int updated;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|O", kwlist, &value, &timestampObj)) return NULL;
+    if (hashObject(value, self->seed, HASH_MURMUR64A, &hash) < 0) return NULL;
+
+    if (timestampObj == Py_None) {
+        timestamp = currentTime();
+    } else if ((timestamp = PyFloat_AsDouble(timestampObj)) == -1.0 && PyErr_Occurred()) {
+        return NULL;
+    }
+
+    splitHash(hash, self->p, HASH_MURMUR64A, &index, &fsb);
+    updated = addSlidingRegister(self, index, timestamp, fsb);
+
+    if (updated < 0) {
+        return PyErr_NoMemory();
+    } else if (updated) {
+        Py_RETURN_TRUE;
+    }
+
+    Py_RETURN_FALSE;
 }
 
 
-/* De-serialization method used to restore pickled objects. */
-static PyObject* HyperLogLog_set_state(HyperLogLog* self, PyObject* state)
+/* Estimates the number of distinct elements added within a window ending now,
+ * by default the maximum window ending at the current time. */
+static PyObject* SlidingHyperLogLog_cardinality(SlidingHyperLogLog* self, PyObject* args, PyObject* kwds)
 {
+    static char* kwlist[] = {"window", "now", NULL};
+    PyObject* windowObj = Py_None;
+    PyObject* nowObj = Py_None;
+    double window = self->window;
+    double now;
+    double horizon;
+    uint64_t histogram[65];
 
-    PyObject* dump;
-    PyObject* valPtr;
-    unsigned long val;
-    uint64_t nodeCacheIndex;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OO", kwlist, &windowObj, &nowObj)) return NULL;
 
-    if (!PyArg_ParseTuple(state, "O:setstate", &dump)) return NULL;
+    if (windowObj != Py_None && (window = PyFloat_AsDouble(windowObj)) == -1.0 && PyErr_Occurred()) {
+        return NULL;
+    }
 
-    self->isSparse = (bool) PyLong_AsUnsignedLong(PyList_GetItem(dump, 0));
-    self->added    = PyLong_AsUnsignedLong(PyList_GetItem(dump, 1));
-    self->listSize = PyLong_AsUnsignedLong(PyList_GetItem(dump, 2));
-    self->isCached = (bool) PyLong_AsUnsignedLong(PyList_GetItem(dump, 3));
-    self->cache    = PyLong_AsUnsignedLong(PyList_GetItem(dump, 4));
-    nodeCacheIndex = PyLong_AsUnsignedLong(PyList_GetItem(dump, 5));
+    if (nowObj == Py_None) {
+        now = currentTime();
+    } else if ((now = PyFloat_AsDouble(nowObj)) == -1.0 && PyErr_Occurred()) {
+        return NULL;
+    }
 
-    uint64_t dumpSize = self->isSparse ? self->listSize : self->size;
-    dumpSize += 65 + 7;
+    if (!(window > 0) || window > self->window) {
+        PyErr_SetString(PyExc_ValueError, "window must be positive and at most the maximum window");
+        return NULL;
+    }
 
-    for (int i = 7; i < 65 + 7; i++) {
-        valPtr = PyList_GetItem(dump, i);
-        val = PyLong_AsUnsignedLong(valPtr);
-        self->histogram[i - 7] = val;
+    horizon = now - window;
+    memset(histogram, 0, sizeof(histogram));
+
+    for (uint64_t i = 0; i < self->size; i++) {
+        const SlidingRegister* reg = &self->registers[i];
+        uint8_t fsb = 0;
+
+        /* Values decrease with time so the first pair in the window is the largest */
+        for (uint8_t j = 0; j < reg->count; j++) {
+            if (reg->entries[j].timestamp > horizon) {
+                fsb = reg->entries[j].fsb;
+                break;
+            }
+        }
+
+        histogram[fsb]++;
     }
 
-    if (self->isSparse) {
-        uint64_t index;
-        uint64_t fsb;
-        struct Node* node = NULL;
-        struct Node* prev = NULL;
-        PyObject *lst = NULL;
+    return Py_BuildValue("K", estimateCardinality(histogram, self->p));
+}
 
-        for (uint64_t i = 65 + 7; i < dumpSize; i++) {
-            lst = PyList_GetItem(dump, i);
-            index = PyLong_AsUnsignedLong(PyList_GetItem(lst, 0));
-            fsb = PyLong_AsUnsignedLong(PyList_GetItem(lst, 1));
 
-            node = (struct Node*)malloc(sizeof(struct Node));
-            node->index = index;
-            node->fsb = fsb;
-            node->next = NULL;
+/* Merges another SlidingHyperLogLog with the same size and seed. */
+static PyObject* SlidingHyperLogLog_merge(SlidingHyperLogLog* self, PyObject* args)
+{
+    SlidingHyperLogLog* other;
+
+    if (!PyArg_ParseTuple(args, "O!", Py_TYPE(self), &other)) return NULL;
 
-            if (i == 65 + 7) {
-                self->sparseRegisterList = node;
-                prev = node;
-            } else {
-                prev->next = node;
-                prev = node;
-            }
+    if (other->size != self->size) {
+        PyErr_SetString(PyExc_ValueError, "Unequal sizes");
+        return NULL;
+    }
+
+    if (other->seed != self->seed) {
+        PyErr_SetString(PyExc_ValueError, "Cannot merge SlidingHyperLogLogs with different seeds");
+        return NULL;
+    }
+
+    if (other == self) {
+        Py_RETURN_NONE;
+    }
+
+    for (uint64_t i = 0; i < other->size; i++) {
+        const SlidingRegister* reg = &other->registers[i];
 
-            if (node->index == nodeCacheIndex) {
-                self->nodeCache = node;
+        for (uint8_t j = 0; j < reg->count; j++) {
+            if (addSlidingRegister(self, i, reg->entries[j].timestamp, reg->entries[j].fsb) < 0) {
+                return PyErr_NoMemory();
             }
         }
-    } else {
-        for (uint64_t i = 65 + 7; i < dumpSize; i++) {
-            valPtr = PyList_GetItem(dump, i);
-            val = PyLong_AsUnsignedLong(valPtr);
-            setDenseRegister(i - 72, (uint8_t)val, self->registers);
-        }
     }
 
-    Py_INCREF(Py_None);
-    return Py_None;
+    Py_RETURN_NONE;
 }
 
 
-/* Gets the number of registers. */
-static PyObject* HyperLogLog_size(HyperLogLog* self)
+/* Gets the number of (timestamp, fsb) pairs stored. */
+static PyObject* SlidingHyperLogLog__entries(SlidingHyperLogLog* self)
 {
-    return Py_BuildValue("i", self->size);
+    uint64_t count = 0;
+
+    for (uint64_t i = 0; i < self->size; i++) {
+        count += self->registers[i].count;
+    }
+
+    return Py_BuildValue("K", count);
 }
 
 
-static PyMemberDef HyperLogLog_members[] = {
-    {NULL} /* Sentinel */
-};
+static PyObject* SlidingHyperLogLog_size(SlidingHyperLogLog* self)
+{
+    return Py_BuildValue("K", self->size);
+}
 
 
-static PyMethodDef HyperLogLog_methods[] = {
-    {"add", (PyCFunction)HyperLogLog_add, METH_VARARGS,
-     "Add an element."
-    },
-    {"cardinality", (PyCFunction)HyperLogLog_cardinality, METH_NOARGS,
-     "Get the cardinality."
-    },
-    {"merge", (PyCFunction)HyperLogLog_merge, METH_VARARGS,
-     "Merge another HyperLogLog."
+static PyObject* SlidingHyperLogLog_seed(SlidingHyperLogLog* self)
+{
+    return Py_BuildValue("K", self->seed);
+}
+
+
+static PyObject* SlidingHyperLogLog_window(SlidingHyperLogLog* self)
+{
+    return Py_BuildValue("d", self->window);
+}
+
+
+static PyMethodDef SlidingHyperLogLog_methods[] = {
+    {"add", (PyCFunction)SlidingHyperLogLog_add, METH_VARARGS | METH_KEYWORDS,
+     "Add an element with a timestamp in seconds, the current time by default."
     },
-    {"hash", (PyCFunction)HyperLogLog_hash, METH_VARARGS,
-     "Get a MurmurHash64A hash."
+    {"cardinality", (PyCFunction)SlidingHyperLogLog_cardinality, METH_VARARGS | METH_KEYWORDS,
+     "Get the cardinality of a window of time ending now."
     },
-    {"seed", (PyCFunction)HyperLogLog_seed, METH_NOARGS,
-     "Get the hash function seed."
+    {"merge", (PyCFunction)SlidingHyperLogLog_merge, METH_VARARGS,
+     "Merge another SlidingHyperLogLog."
     },
-    {"size", (PyCFunction)HyperLogLog_size, METH_NOARGS,
+    {"size", (PyCFunction)SlidingHyperLogLog_size, METH_NOARGS,
      "Get the number of registers."
     },
-    {"get_register", (PyCFunction)HyperLogLog_get_register, METH_VARARGS,
-     "Get the value of a register."
-    },
-    {"_histogram", (PyCFunction)HyperLogLog__histogram, METH_NOARGS,
-     "Get a histogram of the register values."
-    },
-    {"_get_meta", (PyCFunction)HyperLogLog__get_meta, METH_NOARGS,
-     "Get the values of internal attributes."
+    {"seed", (PyCFunction)SlidingHyperLogLog_seed, METH_NOARGS,
+     "Get the hash function seed."
     },
-    {"__reduce__", (PyCFunction)HyperLogLog_reduce, METH_NOARGS,
-     "Serialization helper function for pickling."
+    {"window", (PyCFunction)SlidingHyperLogLog_window, METH_NOARGS,
+     "Get the maximum window in seconds."
     },
-    {"__setstate__", (PyCFunction)HyperLogLog_set_state, METH_VARARGS,
-    "De-serialization helper function for pickling."
+    {"_entries", (PyCFunction)SlidingHyperLogLog__entries, METH_NOARGS,
+     "Get the number of stored (timestamp, register value) pairs."
     },
     {NULL}  /* Sentinel */
 };
 
 
-static PyTypeObject HyperLogLogType = {
+static PyTypeObject SlidingHyperLogLogType = {
     PyVarObject_HEAD_INIT(NULL, 0)
-    "HLL.HyperLogLog",                        /* tp_name */
-    sizeof(HyperLogLog),                      /* tp_basicsize */
+    "HLL.SlidingHyperLogLog",                 /* tp_name */
+    sizeof(SlidingHyperLogLog),               /* tp_basicsize */
     0,                                        /* tp_itemsize */
-    (destructor)HyperLogLog_dealloc,          /* tp_dealloc */
+    (destructor)SlidingHyperLogLog_dealloc,   /* tp_dealloc */
     0,                                        /* tp_print */
     0,                                        /* tp_getattr */
     0,                                        /* tp_setattr */
@@ -1056,24 +5691,24 @@ static PyTypeObject HyperLogLogType = {
     0,                                        /* tp_setattro */
     0,                                        /* tp_as_buffer */
     Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /* tp_flags */
-    "HyperLogLog object",                     /* tp_doc */
+    "SlidingHyperLogLog object",              /* tp_doc */
     0,                                        /* tp_traverse */
     0,                                        /* tp_clear */
     0,                                        /* tp_richcompare */
     0,                                        /* tp_weaklistoffset */
     0,                                        /* tp_iter */
     0,                                        /* tp_iternext */
-    HyperLogLog_methods,                      /* tp_methods */
-    HyperLogLog_members,                      /* tp_members */
+    SlidingHyperLogLog_methods,               /* tp_methods */
+    0,                                        /* tp_members */
     0,                                        /* tp_getset */
     0,                                        /* tp_base */
     0,                                        /* tp_dict */
     0,                                        /* tp_descr_get */
     0,                                        /* tp_descr_set */
     0,                                        /* tp_dictoffset */
-    (initproc)HyperLogLog_init,               /* tp_init */
+    (initproc)SlidingHyperLogLog_init,        /* tp_init */
     0,                                        /* tp_alloc */
-    HyperLogLog_new,                          /* tp_new */
+    SlidingHyperLogLog_new,                   /* tp_new */
 };
 
 
@@ -1090,11 +5725,18 @@ PyInit_HLL(void)
 {
     PyObject* m;
     if (PyType_Ready(&HyperLogLogType) < 0) return NULL;
+    if (PyType_Ready(&HyperLogLogMapType) < 0) return NULL;
+    if (PyType_Ready(&HyperLogLogMapIteratorType) < 0) return NULL;
+    if (PyType_Ready(&SlidingHyperLogLogType) < 0) return NULL;
     m = PyModule_Create(&HyperLogLogmodule);
     if (m == NULL) return NULL;
 
     Py_INCREF(&HyperLogLogType);
     PyModule_AddObject(m, "HyperLogLog", (PyObject*)&HyperLogLogType);
+    Py_INCREF(&HyperLogLogMapType);
+    PyModule_AddObject(m, "HyperLogLogMap", (PyObject*)&HyperLogLogMapType);
+    Py_INCREF(&SlidingHyperLogLogType);
+    PyModule_AddObject(m, "SlidingHyperLogLog", (PyObject*)&SlidingHyperLogLogType);
 
     return m;
 }
@@ -1102,108 +5744,6 @@ PyInit_HLL(void)
 
 /* ========================== Helper functions ============================= */
 
-/* Counts leading zeros (number of consecutive of zero bits from the left) in
- * an unsigned 64bit integer. */
-static inline uint8_t clz(uint64_t x) {
-#if defined(__GNUC__) || defined(__clang__)
-    return x ? __builtin_clzll(x) : 64;
-#else
-    static const uint8_t zeroes[] = {
-        64, 63, 62, 62, 61, 61, 61, 61,
-        60, 60, 60, 60, 60, 60, 60, 60,
-        59, 59, 59, 59, 59, 59, 59, 59,
-        59, 59, 59, 59, 59, 59, 59, 59,
-        58, 58, 58, 58, 58, 58, 58, 58,
-        58, 58, 58, 58, 58, 58, 58, 58,
-        58, 58, 58, 58, 58, 58, 58, 58,
-        58, 58, 58, 58, 58, 58, 58, 58,
-        57, 57, 57, 57, 57, 57, 57, 57,
-        57, 57, 57, 57, 57, 57, 57, 57,
-        57, 57, 57, 57, 57, 57, 57, 57,
-        57, 57, 57, 57, 57, 57, 57, 57,
-        57, 57, 57, 57, 57, 57, 57, 57,
-        57, 57, 57, 57, 57, 57, 57, 57,
-        57, 57, 57, 57, 57, 57, 57, 57,
-        57, 57, 57, 57, 57, 57, 57, 57,
-        56, 56, 56, 56, 56, 56, 56, 56,
-        56, 56, 56, 56, 56, 56, 56, 56,
-        56, 56, 56, 56, 56, 56, 56, 56,
-        56, 56, 56, 56, 56, 56, 56, 56,
-        56, 56, 56, 56, 56, 56, 56, 56,
-        56, 56, 56, 56, 56, 56, 56, 56,
-        56, 56, 56, 56, 56, 56, 56, 56,
-        56, 56, 56, 56, 56, 56, 56, 56,
-        56, 56, 56, 56, 56, 56, 56, 56,
-        56, 56, 56, 56, 56, 56, 56, 56,
-        56, 56, 56, 56, 56, 56, 56, 56,
-        56, 56, 56, 56, 56, 56, 56, 56,
-        56, 56, 56, 56, 56, 56, 56, 56,
-        56, 56, 56, 56, 56, 56, 56, 56,
-        56, 56, 56, 56, 56, 56, 56, 56
-    };
-
-    uint8_t shift;
-
-    if (x >= (1ULL << 32)) {
-        if (x >= (1ULL << 48)) {
-            shift = (x >= (1ULL << 56)) ? 56 : 48;
-        } else {
-            shift = (x >= (1ULL << 40)) ? 40 : 32;
-        }
-    } else {
-        if (x >= (1U << 16)) {
-            shift = (x >= (1U << 24)) ? 24 : 16;
-        } else {
-            shift = (x >= (1U << 8)) ? 8 : 0;
-        }
-    }
-
-    uint8_t fsbByte = (uint8_t)(x >> shift);
-    return zeroes[fsbByte] - shift;
-#endif
-}
-
-
-static inline double sigma(double x) {
-    if (x == 1.0) {
-        return INFINITY;
-    }
-
-    double zPrime;
-    double y = 1.0;
-    double z = x;
-
-    do {
-        x *= x;
-        zPrime = z;
-        z += x*y;
-        y += y;
-    } while(z != zPrime);
-
-    return z;
-}
-
-
-static inline double tau(double x) {
-    if (x == 0.0 || x == 1.0) {
-        return 0.0;
-    }
-
-    double zPrime;
-    double y = 1.0;
-    double z = 1 - x;
-
-    do {
-        x = sqrt(x);
-        zPrime = z;
-        y *= 0.5;
-        z -= pow(1 - x, 2)*y;
-    } while(zPrime != z);
-
-    return z/3;
-}
-
-
 /* Print the bits in a byte. */
 void printByte(uint8_t b)
 {
@@ -1,12 +1,575 @@
+/*
+ * Definitions shared by the Python module (hll.c) and the Python-free core
+ * (libhll.c). Functions used for every added element are defined here so
+ * they can be inlined, bulk operations on registers are in libhll.c.
+ */
+
+#ifndef HLL_H
+#define HLL_H
+
+#include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
+#include "../lib/murmur2.h"
+#include "../lib/wyhash.h"
+#include "../lib/xxh3.h"
+
+#define HASH_MURMUR64A 0 /* Register index from the high bits of a MurmurHash64A hash */
+#define HASH_REDIS 1 /* Register index from the low bits of a MurmurHash64A hash, as in Redis */
+#define HASH_XXH3 2 /* Register index from the high bits of an XXH3 64 bit hash */
+#define HASH_WYHASH 3 /* Register index from the high bits of a wyhash hash */
+
+
+/* Counts leading zeros (number of consecutive of zero bits from the left) in
+ * an unsigned 64bit integer. */
+static inline uint8_t clz(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+    return x ? __builtin_clzll(x) : 64;
+#else
+    static const uint8_t zeroes[] = {
+        64, 63, 62, 62, 61, 61, 61, 61,
+        60, 60, 60, 60, 60, 60, 60, 60,
+        59, 59, 59, 59, 59, 59, 59, 59,
+        59, 59, 59, 59, 59, 59, 59, 59,
+        58, 58, 58, 58, 58, 58, 58, 58,
+        58, 58, 58, 58, 58, 58, 58, 58,
+        58, 58, 58, 58, 58, 58, 58, 58,
+        58, 58, 58, 58, 58, 58, 58, 58,
+        57, 57, 57, 57, 57, 57, 57, 57,
+        57, 57, 57, 57, 57, 57, 57, 57,
+        57, 57, 57, 57, 57, 57, 57, 57,
+        57, 57, 57, 57, 57, 57, 57, 57,
+        57, 57, 57, 57, 57, 57, 57, 57,
+        57, 57, 57, 57, 57, 57, 57, 57,
+        57, 57, 57, 57, 57, 57, 57, 57,
+        57, 57, 57, 57, 57, 57, 57, 57,
+        56, 56, 56, 56, 56, 56, 56, 56,
+        56, 56, 56, 56, 56, 56, 56, 56,
+        56, 56, 56, 56, 56, 56, 56, 56,
+        56, 56, 56, 56, 56, 56, 56, 56,
+        56, 56, 56, 56, 56, 56, 56, 56,
+        56, 56, 56, 56, 56, 56, 56, 56,
+        56, 56, 56, 56, 56, 56, 56, 56,
+        56, 56, 56, 56, 56, 56, 56, 56,
+        56, 56, 56, 56, 56, 56, 56, 56,
+        56, 56, 56, 56, 56, 56, 56, 56,
+        56, 56, 56, 56, 56, 56, 56, 56,
+        56, 56, 56, 56, 56, 56, 56, 56,
+        56, 56, 56, 56, 56, 56, 56, 56,
+        56, 56, 56, 56, 56, 56, 56, 56,
+        56, 56, 56, 56, 56, 56, 56, 56
+    };
+
+    uint8_t shift;
+
+    if (x >= (1ULL << 32)) {
+        if (x >= (1ULL << 48)) {
+            shift = (x >= (1ULL << 56)) ? 56 : 48;
+        } else {
+            shift = (x >= (1ULL << 40)) ? 40 : 32;
+        }
+    } else {
+        if (x >= (1U << 16)) {
+            shift = (x >= (1U << 24)) ? 24 : 16;
+        } else {
+            shift = (x >= (1U << 8)) ? 8 : 0;
+        }
+    }
+
+    uint8_t fsbByte = (uint8_t)(x >> shift);
+    return zeroes[fsbByte] - shift;
+#endif
+}
+
+
+/* Counts trailing zeros (number of consecutive of zero bits from the right)
+ * in an unsigned 64bit integer. */
+static inline uint8_t ctz(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+    return x ? __builtin_ctzll(x) : 64;
+#else
+    return x ? 63 - clz(x & (~x + 1)) : 64;
+#endif
+}
+
+
+/* ========================== Dense representation ========================= */
+/*
+ * Since register values will never exceed 64 we store them using only 6 bits.
+ * This encoding is diagrammed below:
+ *
+ *          b0        b1        b2        b3
+ *          /         /         /         /
+ *     +---------+---------+---------+---------+
+ *     |0000 0011|1111 0011|0110 1110|1111 1011|
+ *     +---------+---------+---------+---------+
+ *      |_____||_____| |_____||_____| |_____|
+ *         |      |       |      |       |
+ *       offset   m1      m2     m3     m4
+ *
+ *      b = bytes, m = registers
+ *
+ * The first six bits in b0 are an unused offset. With the exception of byte
+ * aligned registers (e.g. m4), registers will have bits in consecutive bytes.
+ * For example, the register m2 has bits in b1 and b2. The higher order bits
+ * of m2 are in b1 and the lower order bytes of m2 are in the b2.
+ *
+ * Getting a register
+ * ------------------
+ *
+ * Suppose we want to get register m2 (e.g. m=2). First we determine the
+ * indices of the enclosing bytes:
+ *
+ *     left byte  = (6*m + 6)/8 - 1                                         (1)
+ *                = 1
+ *
+ *     right byte = left byte + 1                                           (2)
+ *                = 2
+ *
+ * Next we compute the number of bits of m2 in each byte. The number of right
+ * bits is:
+ *
+ *     rb = right bits                                                      (3)
+ *        = (6*m + 6) % 8
+ *        = 2
+ *
+ *     lb = left bits                                                       (4)
+ *        = 6 - rb
+ *        = 4
+ *
+ * This result is diagrammed below:
+ *
+ *         b1         b2
+ *          \         /
+ *     +---------+---------+
+ *     |1111 0011|0110 1110|
+ *     +---------+---------+
+ *           ^^^^ ^^
+ *           /      \
+ *       left bits  right bits
+ *
+ *       m2 = "001101"
+ *
+ * Move the left bits into the higher order positions:
+ *
+ *     +---------+
+ *     |1111 0011|   <-- b1
+ *     |1100 1100|   <-- b1 << rb
+ *     +---------+
+ *
+ * Move the right bits to the lower order position:
+ *
+ *     +---------+
+ *     |0110 1110|   <-- b2
+ *     |0000 0001|   <-- b2 >> (8 - rb)
+ *     +---------+
+ *
+ * Bitwise OR the two bytes, b1 | b2:
+ *
+ *     +---------+
+ *     |1100 1100|  <-- b1
+ *     |0000 0001|  <-- b2
+ *     |1100 1101|  <-- b1 | b2
+ *     +---------+
+ *
+ * Finally use a mask to remove the bits not part of m2:
+ *
+ *     +---------+
+ *     |1100 1101|  <-- b1 | b2
+ *     |0011 1111|  <-- mask to isolate the register bits
+ *     |0000 1101|  <-- m2 = b1 & mask
+ *     +---------+
+ *
+ * Setting a register
+ * ------------------
+ *
+ * Setting a register is similar to getting a register. We determine the
+ * enclosing bytes using (1) and (2). Then the bits of each byte is
+ * computed using (3) and (4). Continuing the previous example using register
+ * m2, at this point we should have:
+ *
+ *         b1         b2
+ *          \         /
+ *     +---------+---------+
+ *     |1111 0011|0110 1110|
+ *     +---------+---------+
+ *           ^^^^ ^^
+ *           /      \
+ *       left bits  right bits
+ *
+ *       lb = 4, rb = 2
+ *       m2 = "001101"
+ *
+ * Let N be the value we want to set. Suppose we want to set m2 to 7 (N=7). We
+ * start by zeroing out the left bits of m in b1 and the rights bits of m in
+ * b2:
+ *
+ *     +---------+
+ *     |1111 0011|  <- b1
+ *     |0011 1100|  <- b1 = b1 >> lb
+ *     |1111 0000|  <- b1 = b1 << lb
+ *     |0110 1110|  <- b2
+ *     |1011 1000|  <- b2 = b2 << rb
+ *     |0010 1110|  <- b2 = b2 >> rb
+ *     +---------+
+ *
+ * Now that we have made space for m2, we need to set the new bits. We can get
+ * new bits by simplying shifting N:
+ *
+ *      new right bits
+ *            \
+ *            vv
+ *    +---------+
+ *    |0000 0111|  <- N=7
+ *    +---------+
+ *       ^^ ^^
+ *        \ /
+ *    new left bits
+ *
+ *    nlb = new left bits
+ *        = N >> rb
+ *        = 7 >> 2
+ *
+ *    nrb = new right bits
+ *        = N << (8 - rb)
+ *        = 7 << 6
+ *
+ * We can now set the left byte b1 using bitwise OR:
+ *
+ *    +---------+
+ *    |1111 0000|  <- b1
+ *    |0000 0001|  <- nlb
+ *    |1111 0001|  <- b1 | nlb
+ *    +---------+
+ *
+ * Setting the right byte b2 using bitwise OR:
+ *
+ *    +---------+
+ *    |0010 1110|  <- b2
+ *    |1100 0000|  <- nrb
+ *    |1110 1110|  <- b2 | nrb
+ *    +---------+
+ *
+ * The bytes have been updated so we're done. The final result is shown
+ * below:
+ *
+ *         b1         b2
+ *          \         /
+ *     +---------+---------+
+ *     |1111 0001|1110 1110|
+ *     +---------+---------+
+ *           ^^^^ ^^
+ *           /      \
+ *       left bits  right bits
+ *
+ *       lb = 4, rb = 2
+ *       m2 = "000111"
+ */
+
+
+/* Get register m. */
+static inline uint64_t getDenseRegister(uint64_t m, uint8_t* regs)
+{
+    uint64_t nBits = 6*m + 6;
+    uint64_t bytePos = nBits/8 - 1;
+    uint8_t leftByte = regs[bytePos];
+    uint8_t rightByte = regs[bytePos + 1];
+    uint8_t nrb = (uint8_t) (nBits % 8);
+    uint8_t reg;
+
+    leftByte <<= nrb; /* Move left bits into high order spots */
+    rightByte >>= (8 - nrb); /* Move rights bits into the low order spots */
+    reg = leftByte | rightByte; /* OR the result to get the register */
+    reg &= 63; /* Get rid of the 2 extra bits */
+
+    return (uint64_t) reg;
+}
+
+
+/* Set register m to n. */
+static inline void setDenseRegister(uint64_t m, uint8_t n, uint8_t* regs)
+{
+    uint64_t nBits = 6*m + 6;
+    uint64_t bytePos = nBits/8 - 1;
+    uint8_t nrb = (uint8_t) (nBits % 8);
+    uint8_t nlb = 6 - nrb;
+    uint8_t leftByte = regs[bytePos];
+    uint8_t rightByte = regs[bytePos + 1];
+
+    leftByte >>= nlb;
+    leftByte <<= nlb;
+    rightByte <<= nrb;
+    rightByte >>= nrb;
+    leftByte |= (n >> nrb); /* Set the new left bits */
+    rightByte |= (n << (8 - nrb)); /* Set the new right bits */
+    regs[bytePos] = leftByte;
+    regs[bytePos + 1] = rightByte;
+}
+
+
+/*
+ * Unpacked dense registers
+ * ------------------------
+ *
+ * Dense registers can instead be stored using one byte per register (the
+ * "u8" layout). This uses a third more memory than 6 bit registers but
+ * registers are read and written without any shifts or masks and merged using
+ * byte wise maximums. Unpacked registers are converted to 6 bit registers
+ * when serialized.
+ */
+
+/* Gets register m of densely encoded registers using either layout. */
+static inline uint8_t getRegisterIn(const uint8_t* regs, bool unpacked, uint64_t m)
+{
+    return unpacked ? regs[m] : (uint8_t)getDenseRegister(m, (uint8_t*)regs);
+}
+
+
+/* Sets register m of densely encoded registers using either layout. */
+static inline void setRegisterIn(uint8_t* regs, bool unpacked, uint64_t m, uint8_t n)
+{
+    if (unpacked) {
+        regs[m] = n;
+    } else {
+        setDenseRegister(m, n, regs);
+    }
+}
+
+
+/* Gets the number of bytes used by densely encoded registers. */
+static inline uint64_t denseBytes(uint64_t size, bool unpacked)
+{
+    return unpacked ? size : (size*6)/8 + 1;
+}
+
+
+/* Hashes an element using the hash function of a hash kind. */
+static inline uint64_t hashElement(const void* data, uint64_t len, uint64_t seed, uint8_t hashKind)
+{
+    switch (hashKind) {
+    case HASH_XXH3:
+        return XXH3_64bits_withSeed(data, len, seed);
+    case HASH_WYHASH:
+        return wyhash(data, len, seed);
+    default:
+        return MurmurHash64A(data, len, seed);
+    }
+}
+
+
+/* Splits a hash into a register index and the position of the first set bit
+ * in the remaining bits. Redis uses the last p bits as the index and counts
+ * from the right instead. */
+static inline void splitHash(uint64_t hash, unsigned short p, uint8_t hashKind, uint64_t* index, uint8_t* fsb)
+{
+    if (hashKind == HASH_REDIS) {
+        *index = hash & ((1ULL << p) - 1);
+        *fsb = ctz((hash >> p) | (1ULL << (64 - p))) + 1;
+        return;
+    }
+
+    /* Use the first p bits as an index and find the first set bit in the
+     * remaining bits. A sentinel bit caps the value at 64 - p + 1 if the
+     * remaining bits are all zero. */
+    *index = hash >> (64 - p);
+    *fsb = clz((hash << p) | (1ULL << (p - 1))) + 1;
+}
+
+
+/* Maps a nonzero register of a HyperLogLog with 2^p registers to the register
+ * and value it has in a HyperLogLog with 2^newP registers. The d = p - newP
+ * index bits dropped by folding become the first of the remaining bits, so
+ * the first set bit is found among them or, if they are all zero, d bits
+ * later than before. This gives the same registers as adding the elements
+ * with newP in the first place. */
+static inline void foldRegister(uint64_t index, uint8_t fsb, unsigned short p, unsigned short newP,
+                                uint8_t hashKind, uint64_t* newIndex, uint8_t* newFsb)
+{
+    unsigned short d = p - newP;
+    uint64_t dropped;
+
+    if (hashKind == HASH_REDIS) {
+        *newIndex = index & ((1ULL << newP) - 1);
+        dropped = index >> newP;
+        *newFsb = dropped ? ctz(dropped) + 1 : d + fsb;
+        return;
+    }
+
+    *newIndex = index >> d;
+    dropped = index & ((1ULL << d) - 1);
+    *newFsb = dropped ? clz(dropped << (64 - d)) + 1 : d + fsb;
+}
+
+
+/* The sparse register list is described in the sparse representation
+ * section of hll.c. */
+
+#define MAX_VARINT_BYTES 10 /* Max bytes to encode a 64 bit varint */
+
+
+/* Iterates over the registers of a sparse list. */
+typedef struct {
+    const uint8_t* pos; /* Next byte to decode */
+    const uint8_t* end; /* End of the list */
+    uint64_t index; /* Index of the current register */
+    uint8_t fsb; /* Value of the current register */
+} SparseIterator;
+
+
+/* Moves to the next register. Returns false if there are no more registers. */
+static inline bool nextSparseRegister(SparseIterator* it)
+{
+    uint64_t delta = 0;
+    int shift = 0;
+
+    if (it->pos >= it->end) {
+        return 0;
+    }
+
+    while (*it->pos & 0x80) {
+        delta |= (uint64_t)(*it->pos++ & 0x7F) << shift;
+        shift += 7;
+    }
+
+    delta |= (uint64_t)(*it->pos++) << shift;
+    it->index += delta;
+    it->fsb = *it->pos++;
+
+    return 1;
+}
+
+
+/* Encodes a register at the position out. Returns the position following the
+ * encoded register. */
+static inline uint8_t* writeSparseRegister(uint8_t* out, uint64_t delta, uint8_t fsb)
+{
+    while (delta >= 0x80) {
+        *out++ = (uint8_t)(delta | 0x80);
+        delta >>= 7;
+    }
+
+    *out++ = (uint8_t)delta;
+    *out++ = fsb;
+
+    return out;
+}
+
+
+/*
+ * Binary serialization
+ * --------------------
+ *
+ * HyperLogLogs are serialized to bytes using a versioned format. All integers
+ * are little endian so the format is independent of the platform:
+ *
+ *     Offset  Size  Description
+ *     ------  ----  -----------
+ *     0       4     magic bytes "HLLB"
+ *     4       1     format version (1)
+ *     5       1     p
+ *     6       1     flags, see below
+ *     7       1     hash function, 0 = MurmurHash64A, 1 = Redis, 2 = XXH3, 3 = wyhash
+ *     8       8     seed
+ *     16      8     added field
+ *     24      8     number of sparse registers (0 if dense)
+ *     32      16    HIP estimate and probability (only if FORMAT_HIP_VALID)
+ *     32/48   N     registers
+ *
+ * The flags are FORMAT_SPARSE if the registers are sparse, FORMAT_HIP if the
+ * HyperLogLog uses the HIP estimator and FORMAT_HIP_VALID if its HIP estimate
+ * is still valid, in which case the estimate and probability follow the
+ * header as IEEE 754 doubles. Serialized HyperLogLogs without HIP are the same
+ * as before the HIP flags were added.
+ *
+ * Dense registers are stored exactly as they are in memory using 6 bits per
+ * register, so they can be written and read with a single copy. Sparse
+ * registers are stored using the delta and varint encoding of the sparse
+ * register list. The register histogram is rebuilt when deserializing.
+ */
+
+#define FORMAT_MAGIC "HLLB"
+#define FORMAT_VERSION 1
+#define FORMAT_HEADER_SIZE 32
+#define FORMAT_HIP_SIZE 16
+
+#define FORMAT_SPARSE 1 /* Registers are sparse */
+#define FORMAT_HIP 2 /* Uses the HIP estimator */
+#define FORMAT_HIP_VALID 4 /* The HIP estimate follows the header */
+
+
+/* Checks the flags of serialized bytes are known and consistent. */
+static inline bool isValidFormatFlags(uint8_t flags)
+{
+    if (flags & ~(FORMAT_SPARSE | FORMAT_HIP | FORMAT_HIP_VALID)) {
+        return 0;
+    }
+
+    return !(flags & FORMAT_HIP_VALID) || (flags & FORMAT_HIP);
+}
+
+
+/* Gets the offset of the registers of serialized bytes with the given
+ * flags. */
+static inline uint64_t formatRegistersOffset(uint8_t flags)
+{
+    return FORMAT_HEADER_SIZE + ((flags & FORMAT_HIP_VALID) ? FORMAT_HIP_SIZE : 0);
+}
+
+
+/* Writes a 64 bit integer in little endian byte order. */
+static inline void writeUint64(uint8_t* out, uint64_t x)
+{
+    for (int i = 0; i < 8; i++) {
+        out[i] = (uint8_t)(x >> (8*i));
+    }
+}
+
+
+/* Reads a 64 bit integer in little endian byte order. */
+static inline uint64_t readUint64(const uint8_t* in)
+{
+    uint64_t x = 0;
+
+    for (int i = 7; i >= 0; i--) {
+        x = (x << 8) | in[i];
+    }
+
+    return x;
+}
+
+
+/* Writes a double as the little endian bytes of its IEEE 754 encoding. */
+static inline void writeDouble(uint8_t* out, double x)
+{
+    uint64_t bits;
+
+    memcpy(&bits, &x, sizeof(bits));
+    writeUint64(out, bits);
+}
+
+
+/* Reads a double written by writeDouble(). */
+static inline double readDouble(const uint8_t* in)
+{
+    uint64_t bits = readUint64(in);
+    double x;
+
+    memcpy(&x, &bits, sizeof(x));
+
+    return x;
+}
 
-static inline uint8_t clz(uint64_t x);
-static inline double sigma(double x);
-static inline double tau(double x);
 
-static inline void setDenseRegister(uint64_t m, uint8_t n, unsigned char *regs);
-static inline uint64_t getDenseRegister(uint64_t m, unsigned char * regs);
+/* Bulk register operations, see libhll.c */
+uint64_t maxDenseRegisters(uint8_t* dst, const uint8_t* src, uint64_t size);
+uint64_t maxRegisters(uint8_t* dst, bool dstUnpacked, const uint8_t* src, bool srcUnpacked, uint64_t size);
+void countDenseRegisters(const uint8_t* regs, uint64_t size, uint64_t* histogram);
+void countRegisters(const uint8_t* regs, bool unpacked, uint64_t size, uint64_t* histogram);
+void packRegisters(uint8_t* dst, const uint8_t* src, uint64_t size);
+void unpackRegisters(uint8_t* dst, const uint8_t* src, uint64_t size);
+void foldRegisters(uint8_t* dst, unsigned short newP, const uint8_t* src, unsigned short p, uint8_t hashKind);
+int64_t checkSparseRegisters(const uint8_t* list, uint64_t len, uint64_t size, uint64_t* histogram);
+bool checkRegisterHistogram(const uint64_t* histogram, unsigned short p);
+uint64_t estimateCardinality(const uint64_t* histogram, unsigned short p);
 
-void printByte(unsigned char a);
-void setMemoryErrorMsg(uint64_t bytes);
-uint8_t isValidIndex(uint64_t index, uint64_t size);
+#endif
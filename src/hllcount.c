@@ -0,0 +1,305 @@
+/*
+ * hllcount
+ * --------
+ *
+ * Counts the distinct lines of files or stdin using libhll. Sketches can be
+ * written with -o and merged into the count with -m, so counts can be split
+ * across machines. Unless -p, -s or -H are given the count uses the
+ * parameters of the first sketch merged. Sketches use the format of
+ * HyperLogLog.to_bytes() and can be loaded in Python with
+ * HyperLogLog.from_bytes().
+ *
+ * Usage: hllcount [-p P] [-s SEED] [-H HASH] [-m SKETCH]... [-o SKETCH] [FILE]...
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "libhll.h"
+
+#define READ_SIZE (1 << 20) /* Bytes read at a time */
+
+
+static void usage(FILE* out)
+{
+    fprintf(out,
+        "Usage: hllcount [-p P] [-s SEED] [-H HASH] [-m SKETCH]... [-o SKETCH] [FILE]...\n"
+        "Estimate the number of distinct lines in FILEs, or stdin if no FILE or\n"
+        "SKETCH is given. A FILE of - reads stdin.\n"
+        "\n"
+        "  -p P       use 2^P registers (default 14, or that of the first SKETCH)\n"
+        "  -s SEED    hash seed (default 314)\n"
+        "  -H HASH    hash function: murmur64a (default), xxh3 or wyhash\n"
+        "  -m SKETCH  merge a sketch written by -o or HyperLogLog.to_bytes()\n"
+        "  -o SKETCH  write the sketch to a file\n"
+        "  -h         show this help\n");
+}
+
+
+/* Adds each line of a file to a sketch. A line which doesn't fit in the read
+ * buffer is carried over to the next read, growing the buffer if the line
+ * fills it, so every line is added as one element. Returns 0, or ENOMEM or
+ * EIO on failure. */
+static int countLines(hll_t* hll, FILE* in, char** buf, size_t* bufSize)
+{
+    size_t carry = 0;
+    size_t n;
+
+    while ((n = fread(*buf + carry, 1, *bufSize - carry, in)) > 0) {
+        char* start = *buf;
+        char* end = *buf + carry + n;
+        char* nl;
+
+        while ((nl = (char*)memchr(start, '\n', end - start)) != NULL) {
+            hll_add(hll, start, nl - start);
+            start = nl + 1;
+        }
+
+        carry = end - start;
+
+        if (carry == *bufSize) { /* Line longer than the buffer */
+            char* grown = (char*)realloc(*buf, 2*(*bufSize));
+
+            if (grown == NULL) return ENOMEM;
+
+            *buf = grown;
+            *bufSize *= 2;
+        } else {
+            memmove(*buf, start, carry);
+        }
+    }
+
+    if (ferror(in)) return EIO;
+
+    if (carry > 0) { /* Last line without a newline */
+        hll_add(hll, *buf, carry);
+    }
+
+    return 0;
+}
+
+
+/* Reads a whole file. Returns NULL and sets errno on failure. */
+static uint8_t* readFile(const char* path, size_t* len)
+{
+    FILE* f = fopen(path, "rb");
+    uint8_t* data = NULL;
+    size_t cap = 0;
+    size_t n;
+
+    *len = 0;
+    if (f == NULL) return NULL;
+
+    do {
+        if (*len == cap) {
+            uint8_t* grown = (uint8_t*)realloc(data, cap ? 2*cap : 4096);
+
+            if (grown == NULL) {
+                free(data);
+                fclose(f);
+                errno = ENOMEM;
+                return NULL;
+            }
+
+            data = grown;
+            cap = cap ? 2*cap : 4096;
+        }
+
+        n = fread(data + *len, 1, cap - *len, f);
+        *len += n;
+    } while (n > 0);
+
+    if (ferror(f)) {
+        free(data);
+        fclose(f);
+        errno = EIO;
+        return NULL;
+    }
+
+    fclose(f);
+
+    return data;
+}
+
+
+static int parseHash(const char* name)
+{
+    if (strcmp(name, "murmur64a") == 0) return HLL_HASH_MURMUR64A;
+    if (strcmp(name, "xxh3") == 0) return HLL_HASH_XXH3;
+    if (strcmp(name, "wyhash") == 0) return HLL_HASH_WYHASH;
+
+    return -1;
+}
+
+
+int main(int argc, char** argv)
+{
+    const char** sketches = (const char**)calloc(argc, sizeof(char*));
+    const char** files = (const char**)calloc(argc, sizeof(char*));
+    const char* output = NULL;
+    int nSketches = 0;
+    int nFiles = 0;
+    bool isConfigured = false; /* If -p, -s or -H were given */
+    int p = 14;
+    uint64_t seed = HLL_DEFAULT_SEED;
+    int hash = HLL_HASH_MURMUR64A;
+    hll_t* hll = NULL;
+    char* buf = NULL;
+    size_t bufSize = READ_SIZE;
+    int status = 1;
+    int err;
+
+    if (sketches == NULL || files == NULL) {
+        fprintf(stderr, "hllcount: %s\n", hll_strerror(HLL_ENOMEM));
+        return 1;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        char* end;
+
+        if (arg[0] != '-' || strcmp(arg, "-") == 0) {
+            files[nFiles++] = arg;
+            continue;
+        }
+
+        if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+            usage(stdout);
+            status = 0;
+            goto done;
+        }
+
+        if (strlen(arg) != 2 || strchr("psHmo", arg[1]) == NULL || i + 1 >= argc) {
+            usage(stderr);
+            goto done;
+        }
+
+        const char* value = argv[++i];
+        isConfigured |= strchr("psH", arg[1]) != NULL;
+
+        switch (arg[1]) {
+        case 'p':
+            p = (int)strtol(value, &end, 10);
+
+            if (*end != '\0' || p < HLL_MIN_P || p > HLL_MAX_P) {
+                fprintf(stderr, "hllcount: p must be between %d and %d\n", HLL_MIN_P, HLL_MAX_P);
+                goto done;
+            }
+            break;
+        case 's':
+            seed = strtoull(value, &end, 10);
+
+            if (*end != '\0') {
+                fprintf(stderr, "hllcount: invalid seed '%s'\n", value);
+                goto done;
+            }
+            break;
+        case 'H':
+            if ((hash = parseHash(value)) < 0) {
+                fprintf(stderr, "hllcount: hash must be 'murmur64a', 'xxh3' or 'wyhash'\n");
+                goto done;
+            }
+            break;
+        case 'm':
+            sketches[nSketches++] = value;
+            break;
+        case 'o':
+            output = value;
+            break;
+        }
+    }
+
+    if ((nSketches == 0 || isConfigured) && (err = hll_create(&hll, p, seed, hash)) != HLL_OK) {
+        fprintf(stderr, "hllcount: %s\n", hll_strerror(err));
+        goto done;
+    }
+
+    for (int i = 0; i < nSketches; i++) {
+        hll_t* other;
+        size_t len;
+        uint8_t* data = readFile(sketches[i], &len);
+
+        if (data == NULL) {
+            fprintf(stderr, "hllcount: %s: %s\n", sketches[i], strerror(errno));
+            goto done;
+        }
+
+        err = hll_deserialize(&other, data, len);
+        free(data);
+
+        if (err == HLL_OK && hll == NULL) {
+            hll = other;
+        } else if (err == HLL_OK) {
+            if (hll_p(hll) > hll_p(other)) {
+                err = hll_fold(hll, hll_p(other)); /* Merge at the lower precision */
+            }
+            if (err == HLL_OK) {
+                err = hll_merge(hll, other);
+            }
+            hll_destroy(other);
+        }
+
+        if (err != HLL_OK) {
+            fprintf(stderr, "hllcount: %s: %s\n", sketches[i], hll_strerror(err));
+            goto done;
+        }
+    }
+
+    if (nFiles == 0 && nSketches == 0) {
+        files[nFiles++] = "-";
+    }
+
+    if (nFiles > 0 && (buf = (char*)malloc(bufSize)) == NULL) {
+        fprintf(stderr, "hllcount: %s\n", hll_strerror(HLL_ENOMEM));
+        goto done;
+    }
+
+    for (int i = 0; i < nFiles; i++) {
+        bool isStdin = strcmp(files[i], "-") == 0;
+        FILE* in = isStdin ? stdin : fopen(files[i], "rb");
+        int readErr;
+
+        if (in == NULL) {
+            fprintf(stderr, "hllcount: %s: %s\n", files[i], strerror(errno));
+            goto done;
+        }
+
+        readErr = countLines(hll, in, &buf, &bufSize);
+        if (!isStdin) fclose(in);
+
+        if (readErr != 0) {
+            fprintf(stderr, "hllcount: %s: %s\n", isStdin ? "stdin" : files[i], strerror(readErr));
+            goto done;
+        }
+    }
+
+    if (output != NULL) {
+        size_t len = hll_serialized_size(hll);
+        uint8_t* data = (uint8_t*)malloc(len);
+        FILE* out = fopen(output, "wb");
+        bool ok = data != NULL && out != NULL && hll_serialize(hll, data, len) == HLL_OK &&
+                  fwrite(data, 1, len, out) == len;
+
+        free(data);
+        if (out != NULL && fclose(out) != 0) ok = false;
+
+        if (!ok) {
+            fprintf(stderr, "hllcount: %s: %s\n", output, strerror(errno));
+            goto done;
+        }
+    }
+
+    printf("%llu\n", (unsigned long long)hll_cardinality(hll));
+    status = 0;
+
+done:
+    hll_destroy(hll);
+    free(buf);
+    free(sketches);
+    free(files);
+
+    return status;
+}
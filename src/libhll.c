@@ -0,0 +1,803 @@
+/*
+ * Python-free core of the HyperLogLog module. This file contains the bulk
+ * register operations used by the Python module (hll.c) and libhll, a C
+ * interface to HyperLogLog sketches declared in libhll.h. libhll can be
+ * built as a library using "make libhll".
+ */
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+#define HLL_AVX2 /* Dispatch to AVX2 kernels at runtime */
+#include <immintrin.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "hll.h"
+#include "libhll.h"
+
+
+/*
+ * Merging dense registers
+ * -----------------------
+ *
+ * Merging two HyperLogLogs takes the maximum of each pair of registers. Rather
+ * than unpacking every register we operate on 6 byte blocks which hold
+ * exactly 8 registers (register m is in block m/8). A block is loaded into a 64 bit integer and the registers
+ * are split into two sets of 4 with 6 unused bits between them:
+ *
+ *      even = x & 0x03F03F03F03F
+ *      odd  = (x >> 6) & 0x03F03F03F03F
+ *
+ * The unused bit above each register is used as a guard bit. For a set of
+ * registers a and b
+ *
+ *      t = (a | guard) - b
+ *
+ * leaves the guard bit of a register set iff a >= b, and the subtraction can
+ * never borrow from a neighbouring register. Subtracting the guard bits
+ * shifted down by 6 turns each set guard bit into a mask covering the
+ * register, which selects the larger of the two registers.
+ *
+ * The same computation is done on four blocks at a time with AVX2 when the
+ * CPU supports it. Registers that don't fill a whole block are merged one at
+ * a time.
+ */
+
+#define BLOCK_BYTES 6 /* Bytes per block */
+#define BLOCK_REGISTERS 8 /* Registers per block */
+#define EVEN_REGISTERS 0x03F03F03F03FULL /* Mask of the even registers in a block */
+#define GUARD_BITS 0x040040040040ULL /* Bit above each even register */
+
+
+/* Loads a block as a big endian 48 bit integer. */
+static inline uint64_t loadBlock(const uint8_t* block)
+{
+    uint64_t x = 0;
+
+    for (int i = 0; i < BLOCK_BYTES; i++) {
+        x = (x << 8) | block[i];
+    }
+
+    return x;
+}
+
+
+/* Stores a big endian 48 bit integer as a block. */
+static inline void storeBlock(uint64_t x, uint8_t* block)
+{
+    for (int i = BLOCK_BYTES - 1; i >= 0; i--) {
+        block[i] = (uint8_t)x;
+        x >>= 8;
+    }
+}
+
+
+/* Counts the set bits in a 64 bit integer. */
+static inline uint8_t popcount(uint64_t x)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return (uint8_t)__builtin_popcountll(x);
+#else
+    uint8_t n = 0;
+
+    while (x) {
+        x &= x - 1;
+        n++;
+    }
+
+    return n;
+#endif
+}
+
+
+/* Takes the maximum of each pair of registers in a set of registers
+ * separated by guard bits. Sets ge to the guard bits of the registers in a
+ * which are greater than or equal to the register in b. */
+static inline uint64_t maxRegisterSet(uint64_t a, uint64_t b, uint64_t* ge)
+{
+    uint64_t t = ((a | GUARD_BITS) - b) & GUARD_BITS;
+    uint64_t mask = t - (t >> 6);
+
+    *ge = t;
+
+    return (a & mask) | (b & ~mask);
+}
+
+
+/* Merges the block src into the block dst. Returns the number of registers
+ * in dst which were updated. */
+static inline uint8_t maxBlock(uint8_t* dst, const uint8_t* src)
+{
+    uint64_t x = loadBlock(dst);
+    uint64_t y = loadBlock(src);
+    uint64_t geEven, geOdd;
+
+    uint64_t even = maxRegisterSet(x & EVEN_REGISTERS, y & EVEN_REGISTERS, &geEven);
+    uint64_t odd = maxRegisterSet((x >> 6) & EVEN_REGISTERS, (y >> 6) & EVEN_REGISTERS, &geOdd);
+
+    storeBlock(even | (odd << 6), dst);
+
+    return BLOCK_REGISTERS - popcount(geEven | (geOdd >> 1));
+}
+
+
+#ifdef HLL_AVX2
+
+/* Merges four blocks at a time using AVX2. Each 128 bit lane holds two
+ * blocks which are byte swapped into 64 bit integers, merged using the same
+ * method as maxBlock(), and swapped back. Returns the number of registers
+ * updated and sets nBlocks to the number of blocks processed. */
+__attribute__((target("avx2")))
+static uint64_t maxBlocksAVX2(uint8_t* dst, const uint8_t* src, uint64_t bytes, uint64_t* nBlocks)
+{
+    const __m256i toInt = _mm256_setr_epi8(
+        5, 4, 3, 2, 1, 0, -1, -1, 11, 10, 9, 8, 7, 6, -1, -1,
+        5, 4, 3, 2, 1, 0, -1, -1, 11, 10, 9, 8, 7, 6, -1, -1);
+    const __m256i toBlock = _mm256_setr_epi8(
+        5, 4, 3, 2, 1, 0, 13, 12, 11, 10, 9, 8, -1, -1, -1, -1,
+        5, 4, 3, 2, 1, 0, 13, 12, 11, 10, 9, 8, -1, -1, -1, -1);
+    const __m256i evenMask = _mm256_set1_epi64x(EVEN_REGISTERS);
+    const __m256i guard = _mm256_set1_epi64x(GUARD_BITS);
+    uint64_t updated = 0;
+    uint64_t offset = 0;
+    uint64_t ge[4];
+    uint8_t out[32];
+
+    /* Loads read 4 bytes past the last block so stop early */
+    while (offset + 4*BLOCK_BYTES + 4 <= bytes) {
+        __m256i x = _mm256_inserti128_si256(_mm256_castsi128_si256(
+            _mm_loadu_si128((const __m128i*)(dst + offset))),
+            _mm_loadu_si128((const __m128i*)(dst + offset + 2*BLOCK_BYTES)), 1);
+        __m256i y = _mm256_inserti128_si256(_mm256_castsi128_si256(
+            _mm_loadu_si128((const __m128i*)(src + offset))),
+            _mm_loadu_si128((const __m128i*)(src + offset + 2*BLOCK_BYTES)), 1);
+
+        x = _mm256_shuffle_epi8(x, toInt);
+        y = _mm256_shuffle_epi8(y, toInt);
+
+        __m256i a = _mm256_and_si256(x, evenMask);
+        __m256i b = _mm256_and_si256(y, evenMask);
+        __m256i t = _mm256_and_si256(_mm256_sub_epi64(_mm256_or_si256(a, guard), b), guard);
+        __m256i mask = _mm256_sub_epi64(t, _mm256_srli_epi64(t, 6));
+        __m256i even = _mm256_or_si256(_mm256_and_si256(a, mask), _mm256_andnot_si256(mask, b));
+        __m256i geEven = t;
+
+        a = _mm256_and_si256(_mm256_srli_epi64(x, 6), evenMask);
+        b = _mm256_and_si256(_mm256_srli_epi64(y, 6), evenMask);
+        t = _mm256_and_si256(_mm256_sub_epi64(_mm256_or_si256(a, guard), b), guard);
+        mask = _mm256_sub_epi64(t, _mm256_srli_epi64(t, 6));
+        __m256i odd = _mm256_or_si256(_mm256_and_si256(a, mask), _mm256_andnot_si256(mask, b));
+
+        x = _mm256_or_si256(even, _mm256_slli_epi64(odd, 6));
+        x = _mm256_shuffle_epi8(x, toBlock);
+        _mm256_storeu_si256((__m256i*)out, x);
+        memcpy(dst + offset, out, 2*BLOCK_BYTES);
+        memcpy(dst + offset + 2*BLOCK_BYTES, out + 16, 2*BLOCK_BYTES);
+
+        _mm256_storeu_si256((__m256i*)ge, _mm256_or_si256(geEven, _mm256_srli_epi64(t, 1)));
+        updated += 4*BLOCK_REGISTERS - popcount(ge[0]) - popcount(ge[1]) - popcount(ge[2]) - popcount(ge[3]);
+        offset += 4*BLOCK_BYTES;
+    }
+
+    *nBlocks = offset/BLOCK_BYTES;
+
+    return updated;
+}
+
+#endif
+
+
+/* Merges the densely encoded registers src into dst. Returns the number of
+ * registers in dst which were updated. */
+uint64_t maxDenseRegisters(uint8_t* dst, const uint8_t* src, uint64_t size)
+{
+    uint64_t bytes = (size*6)/8 + 1;
+    uint64_t blocks = bytes/BLOCK_BYTES;
+    uint64_t updated = 0;
+    uint64_t i = 0;
+
+#ifdef HLL_AVX2
+    static int hasAVX2 = -1;
+
+    if (hasAVX2 < 0) {
+        __builtin_cpu_init();
+        hasAVX2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+
+    if (hasAVX2) {
+        updated += maxBlocksAVX2(dst, src, bytes, &i);
+    }
+#endif
+
+    for (; i < blocks; i++) {
+        updated += maxBlock(dst + i*BLOCK_BYTES, src + i*BLOCK_BYTES);
+    }
+
+    /* Merge the registers not covered by a whole block */
+    for (uint64_t m = blocks*BLOCK_REGISTERS; m < size; m++) {
+        uint64_t fsb = getDenseRegister(m, (uint8_t*)src);
+
+        if (fsb > getDenseRegister(m, dst)) {
+            setDenseRegister(m, (uint8_t)fsb, dst);
+            updated++;
+        }
+    }
+
+    return updated;
+}
+
+
+/* Counts the values of densely encoded registers. The registers in each block
+ * are counted into four separate tables so that consecutive increments don't
+ * depend on each other. */
+void countDenseRegisters(const uint8_t* regs, uint64_t size, uint64_t* histogram)
+{
+    uint64_t bytes = (size*6)/8 + 1;
+    uint64_t blocks = bytes/BLOCK_BYTES;
+    uint64_t counts[4][64];
+
+    memset(counts, 0, sizeof(counts));
+
+    for (uint64_t i = 0; i < blocks; i++) {
+        uint64_t x = loadBlock(regs + i*BLOCK_BYTES);
+
+        counts[0][(x >> 42) & 63]++;
+        counts[1][(x >> 36) & 63]++;
+        counts[2][(x >> 30) & 63]++;
+        counts[3][(x >> 24) & 63]++;
+        counts[0][(x >> 18) & 63]++;
+        counts[1][(x >> 12) & 63]++;
+        counts[2][(x >> 6) & 63]++;
+        counts[3][x & 63]++;
+    }
+
+    for (uint64_t m = blocks*BLOCK_REGISTERS; m < size; m++) {
+        counts[0][getDenseRegister(m, (uint8_t*)regs)]++;
+    }
+
+    for (int k = 0; k < 64; k++) {
+        histogram[k] = counts[0][k] + counts[1][k] + counts[2][k] + counts[3][k];
+    }
+
+    histogram[64] = 0;
+}
+
+
+/* Takes the maximum of each pair of unpacked registers and stores it in dst.
+ * Returns the number of registers in dst that were updated. */
+static uint64_t maxUnpackedRegisters(uint8_t* dst, const uint8_t* src, uint64_t size)
+{
+    uint64_t updated = 0;
+    uint64_t i = 0;
+
+#ifdef __SSE2__
+    for (; i + 16 <= size; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(dst + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i max = _mm_max_epu8(a, b);
+
+        updated += 16 - popcount((uint64_t)_mm_movemask_epi8(_mm_cmpeq_epi8(max, a)));
+        _mm_storeu_si128((__m128i*)(dst + i), max);
+    }
+#endif
+
+    for (; i < size; i++) {
+        if (src[i] > dst[i]) {
+            dst[i] = src[i];
+            updated++;
+        }
+    }
+
+    return updated;
+}
+
+
+/* Takes the maximum of each pair of registers, which may use different
+ * layouts, and stores it in dst. Returns the number of registers in dst that
+ * were updated. */
+uint64_t maxRegisters(uint8_t* dst, bool dstUnpacked, const uint8_t* src, bool srcUnpacked, uint64_t size)
+{
+    uint64_t updated = 0;
+
+    if (!dstUnpacked && !srcUnpacked) {
+        return maxDenseRegisters(dst, src, size);
+    } else if (dstUnpacked && srcUnpacked) {
+        return maxUnpackedRegisters(dst, src, size);
+    }
+
+    for (uint64_t i = 0; i < size; i++) {
+        uint8_t fsb = getRegisterIn(src, srcUnpacked, i);
+
+        if (fsb > getRegisterIn(dst, dstUnpacked, i)) {
+            setRegisterIn(dst, dstUnpacked, i, fsb);
+            updated++;
+        }
+    }
+
+    return updated;
+}
+
+
+/* Counts the number of registers with each value using either layout. */
+void countRegisters(const uint8_t* regs, bool unpacked, uint64_t size, uint64_t* histogram)
+{
+    uint64_t counts[4][64];
+    uint64_t i = 0;
+
+    if (!unpacked) {
+        countDenseRegisters(regs, size, histogram);
+        return;
+    }
+
+    memset(counts, 0, sizeof(counts));
+
+    for (; i + 4 <= size; i += 4) {
+        counts[0][regs[i] & 63]++;
+        counts[1][regs[i + 1] & 63]++;
+        counts[2][regs[i + 2] & 63]++;
+        counts[3][regs[i + 3] & 63]++;
+    }
+
+    for (; i < size; i++) {
+        counts[0][regs[i] & 63]++;
+    }
+
+    for (int k = 0; k < 64; k++) {
+        histogram[k] = counts[0][k] + counts[1][k] + counts[2][k] + counts[3][k];
+    }
+
+    histogram[64] = 0;
+}
+
+
+/* Converts unpacked registers to 6 bit registers a block at a time. dst must
+ * be zeroed. */
+void packRegisters(uint8_t* dst, const uint8_t* src, uint64_t size)
+{
+    uint64_t blocks = size/BLOCK_REGISTERS;
+
+    for (uint64_t i = 0; i < blocks; i++) {
+        const uint8_t* r = src + i*BLOCK_REGISTERS;
+        uint64_t x = 0;
+
+        for (int j = 0; j < BLOCK_REGISTERS; j++) {
+            x = (x << 6) | (r[j] & 63);
+        }
+
+        storeBlock(x, dst + i*BLOCK_BYTES);
+    }
+
+    for (uint64_t m = blocks*BLOCK_REGISTERS; m < size; m++) {
+        setDenseRegister(m, src[m], dst);
+    }
+}
+
+
+/* Converts 6 bit registers to unpacked registers a block at a time. */
+void unpackRegisters(uint8_t* dst, const uint8_t* src, uint64_t size)
+{
+    uint64_t blocks = size/BLOCK_REGISTERS;
+
+    for (uint64_t i = 0; i < blocks; i++) {
+        uint64_t x = loadBlock(src + i*BLOCK_BYTES);
+        uint8_t* r = dst + i*BLOCK_REGISTERS;
+
+        for (int j = BLOCK_REGISTERS - 1; j >= 0; j--) {
+            r[j] = x & 63;
+            x >>= 6;
+        }
+    }
+
+    for (uint64_t m = blocks*BLOCK_REGISTERS; m < size; m++) {
+        dst[m] = (uint8_t)getDenseRegister(m, (uint8_t*)src);
+    }
+}
+
+
+/* Folds 2^p unpacked registers into 2^newP unpacked registers, keeping the max
+ * of each group, see foldRegister(). dst must be zeroed. */
+void foldRegisters(uint8_t* dst, unsigned short newP, const uint8_t* src, unsigned short p, uint8_t hashKind)
+{
+    uint64_t size = 1ULL << p;
+
+    for (uint64_t i = 0; i < size; i++) {
+        uint64_t index;
+        uint8_t fsb;
+
+        if (src[i] == 0) continue;
+
+        foldRegister(i, src[i], p, newP, hashKind, &index, &fsb);
+        if (fsb > dst[index]) dst[index] = fsb;
+    }
+}
+
+
+/* ============================ Estimation ================================= */
+
+static inline double sigma(double x)
+{
+    if (x == 1.0) {
+        return INFINITY;
+    }
+
+    double zPrime;
+    double y = 1.0;
+    double z = x;
+
+    do {
+        x *= x;
+        zPrime = z;
+        z += x*y;
+        y += y;
+    } while(z != zPrime);
+
+    return z;
+}
+
+
+static inline double tau(double x)
+{
+    if (x == 0.0 || x == 1.0) {
+        return 0.0;
+    }
+
+    double zPrime;
+    double y = 1.0;
+    double z = 1 - x;
+
+    do {
+        x = sqrt(x);
+        zPrime = z;
+        y *= 0.5;
+        z -= pow(1 - x, 2)*y;
+    } while(zPrime != z);
+
+    return z/3;
+}
+
+
+/* Estimates the cardinality of 2^p registers from a histogram of their
+ * values. */
+uint64_t estimateCardinality(const uint64_t* histogram, unsigned short p)
+{
+    double alpha = 0.7213475;
+    double m = (double)(1ULL << p);
+    double z = m*tau((m - (double)histogram[p + 1])/m);
+
+    uint64_t k;
+    for (k = 64 - p; k >= 1; --k) {
+        z += histogram[k];
+        z *= 0.5;
+    }
+
+    z += m*sigma((double)histogram[0]/m);
+
+    return (uint64_t)round(alpha*m*(m/z));
+}
+
+
+/* Validates a sparse register list and counts the register values into
+ * histogram, where every register must be counted as zero to begin with.
+ * Register values can be at most 64 - p + 1, see splitHash(). Returns the
+ * number of registers in the list or -1 if the list is corrupt. */
+int64_t checkSparseRegisters(const uint8_t* list, uint64_t len, uint64_t size, uint64_t* histogram)
+{
+    SparseIterator it = {list, list + len, 0, 0};
+    uint8_t maxFsb = 65 - ctz(size); /* size is 2^p */
+    int64_t count = 0;
+    uint64_t prev = 0;
+
+    /* Registers must be in order and the last register must end the list */
+    while (it.pos < it.end) {
+        const uint8_t* pos = it.pos;
+
+        while (pos < it.end && (*pos & 0x80)) pos++;
+
+        if (pos + 1 >= it.end || pos - it.pos >= MAX_VARINT_BYTES || !nextSparseRegister(&it) ||
+                it.index >= size || (count > 0 && it.index <= prev) ||
+                it.fsb == 0 || it.fsb > maxFsb) {
+            return -1;
+        }
+
+        histogram[0]--;
+        histogram[it.fsb]++;
+        prev = it.index;
+        count++;
+    }
+
+    return count;
+}
+
+
+/* Checks a histogram counted from registers has no register above 64 - p + 1,
+ * which no hash can produce, see splitHash(). */
+bool checkRegisterHistogram(const uint64_t* histogram, unsigned short p)
+{
+    for (int k = 64 - p + 2; k <= 64; k++) {
+        if (histogram[k] > 0) return 0;
+    }
+
+    return 1;
+}
+
+
+/* ================================ libhll ================================= */
+
+struct hll {
+    uint8_t* registers; /* Densely encoded registers */
+    uint64_t histogram[65]; /* Register histogram */
+    uint64_t size; /* Number of registers */
+    uint64_t seed; /* Hash function seed */
+    uint64_t added; /* Number of elements added */
+    uint64_t cache; /* Cached cardinality estimate */
+    unsigned short p; /* 2^p = number of registers */
+    uint8_t hashKind; /* Hash function, see HLL_HASH_MURMUR64A */
+    bool isCached; /* If the cache is up to date */
+};
+
+
+int hll_create(hll_t** hll, int p, uint64_t seed, int hash)
+{
+    hll_t* self;
+
+    *hll = NULL;
+
+    if (p < HLL_MIN_P || p > HLL_MAX_P || hash < HASH_MURMUR64A || hash > HASH_WYHASH) {
+        return HLL_EINVAL;
+    }
+
+    self = (hll_t*)calloc(1, sizeof(hll_t));
+    if (self == NULL) return HLL_ENOMEM;
+
+    self->p = (unsigned short)p;
+    self->size = 1ULL << p;
+    self->seed = seed;
+    self->hashKind = (uint8_t)hash;
+    self->histogram[0] = self->size;
+    self->registers = (uint8_t*)calloc(denseBytes(self->size, false), 1);
+
+    if (self->registers == NULL) {
+        free(self);
+        return HLL_ENOMEM;
+    }
+
+    *hll = self;
+
+    return HLL_OK;
+}
+
+
+void hll_destroy(hll_t* hll)
+{
+    if (hll == NULL) return;
+
+    free(hll->registers);
+    free(hll);
+}
+
+
+uint64_t hll_hash(const hll_t* hll, const void* data, size_t len)
+{
+    return hashElement(data, len, hll->seed, hll->hashKind);
+}
+
+
+void hll_add_hash(hll_t* hll, uint64_t hash)
+{
+    uint64_t index;
+    uint8_t fsb;
+
+    splitHash(hash, hll->p, hll->hashKind, &index, &fsb);
+    hll->added++;
+
+    uint8_t cur = (uint8_t)getDenseRegister(index, hll->registers);
+
+    if (fsb > cur) {
+        setDenseRegister(index, fsb, hll->registers);
+        hll->histogram[cur]--;
+        hll->histogram[fsb]++;
+        hll->isCached = 0;
+    }
+}
+
+
+void hll_add(hll_t* hll, const void* data, size_t len)
+{
+    hll_add_hash(hll, hashElement(data, len, hll->seed, hll->hashKind));
+}
+
+
+/* Folds 6 bit registers to 2^newP registers. Returns NULL if out of memory. */
+static uint8_t* foldDenseRegisters(const uint8_t* regs, unsigned short p, unsigned short newP, uint8_t hashKind)
+{
+    uint8_t* values = (uint8_t*)malloc(1ULL << p);
+    uint8_t* folded = (uint8_t*)calloc(1ULL << newP, 1);
+    uint8_t* registers = (uint8_t*)calloc(denseBytes(1ULL << newP, false), 1);
+
+    if (values == NULL || folded == NULL || registers == NULL) {
+        free(values);
+        free(folded);
+        free(registers);
+        return NULL;
+    }
+
+    unpackRegisters(values, regs, 1ULL << p);
+    foldRegisters(folded, newP, values, p, hashKind);
+    packRegisters(registers, folded, 1ULL << newP);
+    free(values);
+    free(folded);
+
+    return registers;
+}
+
+
+int hll_fold(hll_t* hll, int p)
+{
+    uint8_t* registers;
+
+    if (p < HLL_MIN_P || p > hll->p) return HLL_EINVAL;
+    if (p == hll->p) return HLL_OK;
+
+    registers = foldDenseRegisters(hll->registers, hll->p, (unsigned short)p, hll->hashKind);
+    if (registers == NULL) return HLL_ENOMEM;
+
+    free(hll->registers);
+    hll->registers = registers;
+    hll->p = (unsigned short)p;
+    hll->size = 1ULL << p;
+    hll->isCached = 0;
+    countDenseRegisters(hll->registers, hll->size, hll->histogram);
+
+    return HLL_OK;
+}
+
+
+int hll_merge(hll_t* dst, const hll_t* src)
+{
+    uint8_t* folded = NULL;
+    const uint8_t* registers = src->registers;
+
+    if (dst->hashKind != src->hashKind || dst->p > src->p) {
+        return HLL_EMISMATCH;
+    }
+
+    if (src->p > dst->p) {
+        folded = foldDenseRegisters(src->registers, src->p, dst->p, src->hashKind);
+        if (folded == NULL) return HLL_ENOMEM;
+        registers = folded;
+    }
+
+    if (maxDenseRegisters(dst->registers, registers, dst->size) > 0) {
+        countDenseRegisters(dst->registers, dst->size, dst->histogram);
+        dst->isCached = 0;
+    }
+
+    free(folded);
+
+    return HLL_OK;
+}
+
+
+uint64_t hll_cardinality(hll_t* hll)
+{
+    if (!hll->isCached) {
+        hll->cache = estimateCardinality(hll->histogram, hll->p);
+        hll->isCached = 1;
+    }
+
+    return hll->cache;
+}
+
+
+int hll_p(const hll_t* hll)
+{
+    return hll->p;
+}
+
+
+size_t hll_serialized_size(const hll_t* hll)
+{
+    return FORMAT_HEADER_SIZE + denseBytes(hll->size, false);
+}
+
+
+int hll_serialize(const hll_t* hll, uint8_t* out, size_t len)
+{
+    if (len < hll_serialized_size(hll)) {
+        return HLL_EINVAL;
+    }
+
+    memcpy(out, FORMAT_MAGIC, 4);
+    out[4] = FORMAT_VERSION;
+    out[5] = (uint8_t)hll->p;
+    out[6] = 0; /* Dense, without HIP */
+    out[7] = hll->hashKind;
+    writeUint64(out + 8, hll->seed);
+    writeUint64(out + 16, hll->added);
+    writeUint64(out + 24, 0);
+    memcpy(out + FORMAT_HEADER_SIZE, hll->registers, denseBytes(hll->size, false));
+
+    return HLL_OK;
+}
+
+
+int hll_deserialize(hll_t** hll, const uint8_t* data, size_t len)
+{
+    const uint8_t* regs;
+    uint64_t regsLen;
+    hll_t* self;
+    int err;
+
+    *hll = NULL;
+
+    if (len < FORMAT_HEADER_SIZE || memcmp(data, FORMAT_MAGIC, 4) != 0 || data[4] != FORMAT_VERSION ||
+            data[5] < HLL_MIN_P || data[5] > HLL_MAX_P || !isValidFormatFlags(data[6]) || data[7] > HASH_WYHASH ||
+            len < formatRegistersOffset(data[6])) {
+        return HLL_EFORMAT;
+    }
+
+    /* Sketches are always estimated from their registers, skip any HIP estimate */
+    regs = data + formatRegistersOffset(data[6]);
+
+    if ((err = hll_create(&self, data[5], readUint64(data + 8), data[7])) != HLL_OK) {
+        return err;
+    }
+
+    self->added = readUint64(data + 16);
+    regsLen = len - (regs - data);
+
+    if (!(data[6] & FORMAT_SPARSE)) {
+        if (regsLen != denseBytes(self->size, false)) {
+            hll_destroy(self);
+            return HLL_EFORMAT;
+        }
+
+        memcpy(self->registers, regs, regsLen);
+        countDenseRegisters(self->registers, self->size, self->histogram);
+
+        if (!checkRegisterHistogram(self->histogram, self->p)) {
+            hll_destroy(self);
+            return HLL_EFORMAT;
+        }
+    } else {
+        int64_t count = checkSparseRegisters(regs, regsLen, self->size, self->histogram);
+        SparseIterator it = {regs, regs + regsLen, 0, 0};
+
+        if (count < 0 || (uint64_t)count != readUint64(data + 24)) {
+            hll_destroy(self);
+            return HLL_EFORMAT;
+        }
+
+        while (nextSparseRegister(&it)) {
+            setDenseRegister(it.index, it.fsb, self->registers);
+        }
+    }
+
+    *hll = self;
+
+    return HLL_OK;
+}
+
+
+const char* hll_strerror(int error)
+{
+    switch (error) {
+    case HLL_OK:
+        return "Success";
+    case HLL_ENOMEM:
+        return "Out of memory";
+    case HLL_EINVAL:
+        return "Invalid argument";
+    case HLL_EMISMATCH:
+        return "Sketches use different precisions or hash functions";
+    case HLL_EFORMAT:
+        return "Invalid serialized HyperLogLog";
+    default:
+        return "Unknown error";
+    }
+}
@@ -0,0 +1,107 @@
+/*
+ * libhll
+ * ------
+ *
+ * A C interface to HyperLogLog sketches which doesn't depend on Python.
+ * Sketches are serialized using the same format as HyperLogLog.to_bytes() in
+ * the Python module, so sketches can be created by C or C++ programs and
+ * loaded with HyperLogLog.from_bytes() and vice versa.
+ *
+ * Registers are always stored densely using 6 bits each. Sparse sketches
+ * serialized by the Python module are converted to dense registers when they
+ * are deserialized.
+ *
+ * Functions returning int return HLL_OK on success or one of the negative
+ * error codes below. A sketch must not be used by more than one thread at a
+ * time.
+ *
+ * Example:
+ *
+ *     hll_t* hll;
+ *
+ *     if (hll_create(&hll, 14, HLL_DEFAULT_SEED, HLL_HASH_MURMUR64A) != HLL_OK) abort();
+ *
+ *     hll_add(hll, "some data", 9);
+ *     printf("%llu\n", (unsigned long long)hll_cardinality(hll));
+ *     hll_destroy(hll);
+ */
+
+#ifndef LIBHLL_H
+#define LIBHLL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define HLL_OK 0
+#define HLL_ENOMEM -1 /* Out of memory */
+#define HLL_EINVAL -2 /* Invalid argument */
+#define HLL_EMISMATCH -3 /* Sketches use different hash functions or sizes */
+#define HLL_EFORMAT -4 /* Serialized sketch is corrupt or uses an unsupported format */
+
+#define HLL_HASH_MURMUR64A 0 /* MurmurHash64A, the default of the Python module */
+#define HLL_HASH_REDIS 1 /* MurmurHash64A selecting registers like Redis */
+#define HLL_HASH_XXH3 2 /* XXH3 64 bit hash */
+#define HLL_HASH_WYHASH 3 /* wyhash */
+
+#define HLL_MIN_P 2
+#define HLL_MAX_P 32
+#define HLL_DEFAULT_SEED 314 /* Default seed of the Python module */
+
+typedef struct hll hll_t;
+
+/* Creates a sketch with 2^p registers. hash is one of HLL_HASH_*. */
+int hll_create(hll_t** hll, int p, uint64_t seed, int hash);
+
+/* Frees a sketch. Does nothing if hll is NULL. */
+void hll_destroy(hll_t* hll);
+
+/* Hashes an element and adds it to the sketch. */
+void hll_add(hll_t* hll, const void* data, size_t len);
+
+/* Adds a precomputed 64 bit hash. Hashes should be computed using hll_hash()
+ * or be otherwise uniformly distributed. */
+void hll_add_hash(hll_t* hll, uint64_t hash);
+
+/* Hashes an element using the hash function and seed of a sketch. */
+uint64_t hll_hash(const hll_t* hll, const void* data, size_t len);
+
+/* Merges src into dst. Both sketches must use the same hash function and src
+ * must have at least as many registers as dst, otherwise returns
+ * HLL_EMISMATCH. A larger src is folded to the size of dst, dst is never
+ * folded, see hll_fold(). */
+int hll_merge(hll_t* dst, const hll_t* src);
+
+/* Reduces a sketch to 2^p registers, p being at most hll_p(). The registers
+ * are the same as if the elements had been added with p registers. */
+int hll_fold(hll_t* hll, int p);
+
+/* Gets the estimated number of distinct elements added. */
+uint64_t hll_cardinality(hll_t* hll);
+
+/* Gets the number of registers, 2^p, as p. */
+int hll_p(const hll_t* hll);
+
+/* Gets the number of bytes written by hll_serialize(). */
+size_t hll_serialized_size(const hll_t* hll);
+
+/* Serializes a sketch into out, which must hold at least
+ * hll_serialized_size() bytes, otherwise returns HLL_EINVAL. */
+int hll_serialize(const hll_t* hll, uint8_t* out, size_t len);
+
+/* Creates a sketch from bytes written by hll_serialize() or by
+ * HyperLogLog.to_bytes() in the Python module. The HIP estimate of a
+ * HyperLogLog created with hip=True is ignored. */
+int hll_deserialize(hll_t** hll, const uint8_t* data, size_t len);
+
+/* Gets a description of an error code. */
+const char* hll_strerror(int error);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
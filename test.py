@@ -1,9 +1,14 @@
+import os
 import pickle
 import random
+import subprocess
 import sys
+import tempfile
+import threading
 import unittest
 
-from HLL import HyperLogLog
+from array import array
+from HLL import HyperLogLog, HyperLogLogMap, SlidingHyperLogLog
 from random import randint
 
 
@@ -24,6 +29,30 @@ class TestAdd(unittest.TestCase):
         except Exception as ex:
             self.fail('failed to add bytes: %s' % ex)
 
+    def test_add_ints(self):
+        # Ints are hashed as 8 little-endian bytes
+        for value in (0, 1, -1, 2**63 - 1, -2**63, 2**64 - 1):
+            self.assertEqual(self.hll.hash(value), self.hll.hash((value % 2**64).to_bytes(8, 'little')))
+
+        self.assertNotEqual(self.hll.hash(1), self.hll.hash('1'))
+
+        for value in (2**64, -2**63 - 1):
+            with self.assertRaises(OverflowError):
+                self.hll.add(value)
+
+    def test_add_bytes_like(self):
+        data = b'some other characters'
+        expected = self.hll.hash(data)
+
+        for item in (bytearray(data), memoryview(data), memoryview(b'xx' + data)[2:], data.decode()):
+            self.assertEqual(self.hll.hash(item), expected)
+
+        with self.assertRaises(TypeError):
+            self.hll.add(1.5)
+
+        with self.assertRaises(BufferError):
+            self.hll.add(memoryview(b'abcdef')[::2])
+
     def test_return_value_indicates_register_update(self):
 
         # Dense representation returns change status
@@ -41,6 +70,276 @@ class TestAdd(unittest.TestCase):
         self.assertFalse(changed)
 
 
+class TestAddMany(unittest.TestCase):
+
+    def test_matches_add(self):
+        for sparse in (True, False):
+            data = [str(i) for i in range(5000)] + [b'bytes', 'unicode \u00e9']
+            hll_a = HyperLogLog(10, sparse=sparse)
+            hll_b = HyperLogLog(10, sparse=sparse)
+
+            for item in data:
+                hll_a.add(item)
+            hll_b.add_many(iter(data))
+
+            self.assertEqual(hll_a._histogram(), hll_b._histogram())
+            for i in range(hll_a.size()):
+                self.assertEqual(hll_a.get_register(i), hll_b.get_register(i))
+
+    def test_return_value_counts_register_updates(self):
+        hll = HyperLogLog(5, sparse=False)
+        updated = hll.add_many(['asdf', 'asdf'])
+        self.assertEqual(updated, 1)
+        self.assertEqual(hll.add_many(('asdf',)), 0)
+        self.assertEqual(hll.add_many([]), 0)
+
+    def test_element_types(self):
+        data = [i for i in range(3000)] + [bytearray(b'a'), memoryview(b'b'), b'c', 'd', -7, 2**64 - 1]
+
+        for threads in (1, 3):
+            hll_a = HyperLogLog(10)
+            hll_b = HyperLogLog(10)
+
+            for item in data:
+                hll_a.add(item)
+            hll_b.add_many(data, threads=threads)
+
+            self.assertEqual(hll_a._histogram(), hll_b._histogram())
+
+    def test_invalid_element(self):
+        hll = HyperLogLog(5, sparse=False)
+        with self.assertRaises(TypeError):
+            hll.add_many(['asdf', 1.5, 'other'])
+
+        # Elements preceding the invalid element are added
+        self.assertEqual(hll.add('asdf'), False)
+
+    def test_not_iterable(self):
+        hll = HyperLogLog(5)
+        with self.assertRaises(TypeError):
+            hll.add_many(1)
+
+    def test_threads_match_serial_ingestion(self):
+        data = [str(i) for i in range(200000)]
+
+        for sparse in (True, False):
+            hll_a = HyperLogLog(12, sparse=sparse)
+            hll_b = HyperLogLog(12, sparse=sparse)
+            hll_a.add_many(data)
+            hll_b.add_many(data, threads=4)
+
+            self.assertEqual(hll_a._histogram(), hll_b._histogram())
+            self.assertEqual(hll_a.cardinality(), hll_b.cardinality())
+            self.assertEqual(hll_a._get_meta()['added'], hll_b._get_meta()['added'])
+
+    def test_threads_return_value(self):
+        hll = HyperLogLog(5, sparse=False)
+        self.assertEqual(hll.add_many(['asdf', 'asdf'], threads=3), 1)
+        self.assertEqual(hll.add_many(['asdf'], threads=3), 0)
+
+        with self.assertRaises(ValueError):
+            hll.add_many(['asdf'], threads=0)
+
+
+class TestGilReleasedUpdates(unittest.TestCase):
+
+    def race(self, update, elements):
+        """
+        Calls update() on a thread while using the HyperLogLog from this one.
+        Methods either succeed or raise RuntimeError, and the result is the
+        same as adding everything one at a time.
+        """
+        hll = HyperLogLog(12)
+        thread = threading.Thread(target=update, args=(hll,))
+        calls = (hll.to_bytes, hll.cardinality, lambda: hll.get_register(0),
+                 lambda: hll.merge(HyperLogLog(12)), lambda: hll.add('extra'))
+        thread.start()
+
+        while thread.is_alive():
+            for call in calls:
+                try:
+                    call()
+                except RuntimeError:
+                    pass
+
+        thread.join()
+        hll.add('extra')
+
+        expected = HyperLogLog(12)
+        expected.add_many(elements + ['extra'])
+        self.assertEqual(hll.get_registers(), expected.get_registers())
+
+    def test_add_many(self):
+        data = [str(i) for i in range(200000)]
+        self.race(lambda hll: hll.add_many(data), data)
+
+    def test_add_hashes(self):
+        data = [str(i) for i in range(200000)]
+        hashes = array('Q', [HyperLogLog(12).hash(x) for x in data])
+        self.race(lambda hll: hll.add_hashes(hashes), data)
+
+
+class TestAddFile(unittest.TestCase):
+
+    def setUp(self):
+        self.dir = tempfile.TemporaryDirectory()
+        self.path = os.path.join(self.dir.name, 'ids.txt')
+
+    def tearDown(self):
+        self.dir.cleanup()
+
+    def write(self, data):
+        with open(self.path, 'wb') as f:
+            f.write(data)
+
+    def test_matches_add_many(self):
+        lines = [str(i) for i in range(100000)]
+        self.write('\n'.join(lines).encode() + b'\n')
+
+        for threads in (1, 4):
+            for sparse in (True, False):
+                hll_a = HyperLogLog(12, sparse=sparse)
+                hll_b = HyperLogLog(12, sparse=sparse)
+                hll_a.add_many(lines)
+                hll_b.add_file(self.path, threads=threads)
+
+                self.assertEqual(hll_a.get_registers(), hll_b.get_registers())
+                self.assertEqual(hll_a._histogram(), hll_b._histogram())
+                self.assertEqual(hll_a._get_meta()['added'], hll_b._get_meta()['added'])
+
+    def test_records(self):
+        self.write(b'a\n\nb\nc')
+        hll = HyperLogLog(10)
+        hll.add_file(self.path)
+        self.assertEqual(hll._get_meta()['added'], 3)
+
+        hll = HyperLogLog(10)
+        hll.add_file(self.path, skip_empty=False)
+        self.assertEqual(hll._get_meta()['added'], 4)
+
+        expected = HyperLogLog(10)
+        expected.add_many(['a', 'b', 'c', ''])
+        self.assertEqual(hll.get_registers(), expected.get_registers())
+
+    def test_delimiter(self):
+        self.write(b'a,b,c,a')
+        hll = HyperLogLog(10)
+        hll.add_file(self.path, delimiter=b',')
+
+        expected = HyperLogLog(10)
+        expected.add_many(['a', 'b', 'c', 'a'])
+        self.assertEqual(hll.get_registers(), expected.get_registers())
+
+        with self.assertRaises(TypeError):
+            hll.add_file(self.path, delimiter=b'\r\n')
+
+    def test_empty_file(self):
+        self.write(b'')
+        hll = HyperLogLog(10)
+        self.assertEqual(hll.add_file(self.path, threads=2), 0)
+        self.assertEqual(hll.cardinality(), 0)
+
+    @unittest.skipIf(sys.platform == 'win32', 'requires os.mkfifo')
+    def test_pipe(self):
+        lines = [str(i) for i in range(100000)]
+        fifo = os.path.join(self.dir.name, 'fifo')
+        os.mkfifo(fifo)
+
+        def writer():
+            with open(fifo, 'w') as f:
+                f.write('\n'.join(lines))
+
+        thread = threading.Thread(target=writer)
+        thread.start()
+        hll = HyperLogLog(12)
+        hll.add_file(fifo, threads=2)
+        thread.join()
+
+        expected = HyperLogLog(12)
+        expected.add_many(lines)
+        self.assertEqual(hll.get_registers(), expected.get_registers())
+
+    @unittest.skipIf(sys.platform == 'win32', 'requires os.mkfifo')
+    def test_hyperloglog_is_busy_while_adding(self):
+        fifo = os.path.join(self.dir.name, 'fifo')
+        os.mkfifo(fifo)
+
+        for concurrent in (False, True):
+            hll = HyperLogLog(12, concurrent=concurrent)
+            thread = threading.Thread(target=hll.add_file, args=(fifo,))
+            thread.start()
+
+            with open(fifo, 'w') as f:  # Returns once add_file() has opened the fifo
+                if concurrent:
+                    hll.add('x')
+                    self.assertEqual(hll.cardinality(), 1)
+                else:
+                    for call in (lambda: hll.add('x'), hll.cardinality, hll.to_bytes,
+                                 lambda: hll.add_file(self.path), lambda: hll.merge(HyperLogLog(12))):
+                        with self.assertRaises(RuntimeError):
+                            call()
+
+                with self.assertRaises(RuntimeError):
+                    hll.fold(10)
+
+                f.write('a\nb\n')
+
+            thread.join()
+            self.assertEqual(hll._get_meta()['added'], 3 if concurrent else 2)
+            self.assertEqual(hll.cardinality(), 3 if concurrent else 2)
+
+    def test_missing_file(self):
+        with self.assertRaises(OSError):
+            HyperLogLog(10).add_file(os.path.join(self.dir.name, 'missing'))
+        with self.assertRaises(ValueError):
+            HyperLogLog(10).add_file(self.path, threads=0)
+
+
+class TestAddHashes(unittest.TestCase):
+
+    def test_matches_add(self):
+        for sparse in (True, False):
+            hll_a = HyperLogLog(10, sparse=sparse)
+            hll_b = HyperLogLog(10, sparse=sparse)
+            hashes = array('Q')
+
+            for i in range(5000):
+                hll_a.add(str(i))
+                hashes.append(hll_a.hash(str(i)))
+
+            hll_b.add_hashes(hashes)
+            self.assertEqual(hll_a._histogram(), hll_b._histogram())
+            for i in range(hll_a.size()):
+                self.assertEqual(hll_a.get_register(i), hll_b.get_register(i))
+
+    def test_accepts_raw_bytes(self):
+        hll = HyperLogLog(5, sparse=False)
+        hashes = array('Q', [1 << 63 | 1, 3 << 61 | 1 << 57, 1 << 63 | 1])
+        self.assertEqual(hll.add_hashes(memoryview(hashes.tobytes())), 2)
+        self.assertEqual(hll.get_register(16), 59)
+        self.assertEqual(hll.get_register(12), 2)
+
+    def test_rank_is_capped(self):
+        for sparse in (True, False):
+            for layout in ('u6', 'u8', 'u4'):
+                hll = HyperLogLog(10, sparse=sparse, layout=layout)
+                hll.add_hashes(array('Q', [0, 1 << 63]))
+
+                self.assertEqual(hll.get_register(0), 64 - 10 + 1)
+                self.assertEqual(hll.get_register(512), 64 - 10 + 1)
+                self.assertEqual(hll.cardinality(), 2)
+                self.assertEqual(sum(hll._histogram()), 2**10)
+
+    def test_invalid_buffer(self):
+        hll = HyperLogLog(5)
+        with self.assertRaises(ValueError):
+            hll.add_hashes(array('I', [1, 2, 3]))
+        with self.assertRaises(ValueError):
+            hll.add_hashes(b'123')
+        with self.assertRaises(TypeError):
+            hll.add_hashes([1, 2, 3])
+
+
 class TestHyperLogLogConstructor(unittest.TestCase):
 
     def test_size_lower_bound(self):
@@ -75,12 +374,242 @@ class TestHyperLogLogConstructor(unittest.TestCase):
         hll2 = HyperLogLog(5, seed=20000)
         self.assertNotEqual(hll.hash('test'), hll2.hash('test'))
 
+class TestUnpackedLayout(unittest.TestCase):
+
+    layout = 'u8'
+
+    def pair(self, p, data, sparse=False):
+        hll_a = HyperLogLog(p, sparse=sparse, layout=self.layout)
+        hll_b = HyperLogLog(p, sparse=sparse)
+        hll_a.add_many(data)
+        hll_b.add_many(data)
+        return hll_a, hll_b
+
+    def assertSameRegisters(self, hll_a, hll_b):
+        self.assertEqual(hll_a._histogram(), hll_b._histogram())
+        self.assertEqual(hll_a.cardinality(), hll_b.cardinality())
+
+        for i in range(hll_a.size()):
+            self.assertEqual(hll_a.get_register(i), hll_b.get_register(i))
+
+    def test_matches_packed_layout(self):
+        for p in (3, 10, 14):
+            for sparse in (True, False):
+                hll_a, hll_b = self.pair(p, [str(i) for i in range(randint(0, 20000))], sparse)
+                self.assertEqual(hll_a._get_meta()['layout'], self.layout)
+                self.assertSameRegisters(hll_a, hll_b)
+
+    def test_threads(self):
+        data = [str(i) for i in range(100000)]
+        for sparse in (True, False):
+            hll_a = HyperLogLog(12, sparse=sparse, layout=self.layout)
+            hll_b = HyperLogLog(12)
+            hll_a.add_many(data, threads=3)
+            hll_b.add_many(data)
+            self.assertSameRegisters(hll_a, hll_b)
+
+    def test_merge_mixed_layouts(self):
+        data_a = [str(i) for i in range(5000)]
+        data_b = [str(i) for i in range(3000, 9000)]
+
+        for layouts in ((self.layout, self.layout), (self.layout, 'u6'), ('u6', self.layout), (self.layout, 'u8')):
+            hll_a = HyperLogLog(11, sparse=False, layout=layouts[0])
+            hll_b = HyperLogLog(11, sparse=False, layout=layouts[1])
+            expected = HyperLogLog(11, sparse=False)
+            hll_a.add_many(data_a)
+            hll_b.add_many(data_b)
+            expected.add_many(data_a + data_b)
+
+            self.assertSameRegisters(HyperLogLog.union(hll_a, hll_b), expected)
+            self.assertEqual(HyperLogLog.union_cardinality(hll_a, hll_b), expected.cardinality())
+            hll_a.merge(hll_b)
+            self.assertSameRegisters(hll_a, expected)
+
+    def test_serialization_uses_packed_registers(self):
+        hll_a, hll_b = self.pair(12, [str(i) for i in range(10000)])
+        self.assertEqual(hll_a.to_bytes(), hll_b.to_bytes())
+
+        for hll in (HyperLogLog.from_bytes(hll_b.to_bytes(), layout=self.layout), pickle.loads(pickle.dumps(hll_a))):
+            self.assertEqual(hll._get_meta()['layout'], self.layout)
+            self.assertSameRegisters(hll, hll_b)
+
+    def test_invalid_layout(self):
+        with self.assertRaises(ValueError):
+            HyperLogLog(4, layout='u7')
+
+class TestNibbleLayout(TestUnpackedLayout):
+
+    layout = 'u4'
+
+    def test_minimum_register_increases(self):
+        # Registers are eventually rebased and large values are kept aside
+        for p in (2, 4, 7):
+            hll_a, hll_b = self.pair(p, [str(i) for i in range(200000)])
+            self.assertGreater(min(hll_a.get_register(i) for i in range(hll_a.size())), 0)
+            self.assertSameRegisters(hll_a, hll_b)
+
+class TestConcurrent(unittest.TestCase):
+
+    def test_registers_are_unpacked_and_dense(self):
+        meta = HyperLogLog(12, concurrent=True)._get_meta()
+        self.assertTrue(meta['concurrent'])
+        self.assertEqual(meta['layout'], 'u8')
+        self.assertFalse(meta['is_sparse'])
+
+    def test_threads_match_sequential_adds(self):
+        chunks = [[str(t * 50000 + i) for i in range(50000)] for t in range(4)]
+        hll = HyperLogLog(12, concurrent=True)
+        expected = HyperLogLog(12, sparse=False)
+
+        def ingest(chunk):
+            for _ in range(2):
+                hll.add_many(chunk)
+                hll.add(chunk[0])
+
+        threads = [threading.Thread(target=ingest, args=(chunk,)) for chunk in chunks]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+
+        for chunk in chunks:
+            expected.add_many(chunk)
+
+        self.assertEqual(hll.to_bytes()[32:], expected.to_bytes()[32:])
+        self.assertEqual(hll._histogram(), expected._histogram())
+        self.assertEqual(hll.cardinality(), expected.cardinality())
+        self.assertEqual(hll._get_meta()['added'], 8 * 50001)
+
+    def test_merge_and_worker_threads(self):
+        hll = HyperLogLog(10, concurrent=True)
+        other = HyperLogLog(10)
+        other.add_many(['a', 'b', 'c'])
+        hll.merge(other)
+        hll.add_many([str(i) for i in range(10000)], threads=4)
+
+        expected = HyperLogLog(10, sparse=False)
+        expected.add_many(['a', 'b', 'c'] + [str(i) for i in range(10000)])
+        self.assertEqual(hll.cardinality(), expected.cardinality())
+
+    def test_serialization_keeps_concurrent(self):
+        hll = HyperLogLog(10, concurrent=True)
+        hll.add_many([str(i) for i in range(1000)])
+        hll2 = pickle.loads(pickle.dumps(hll))
+        self.assertTrue(hll2._get_meta()['concurrent'])
+        self.assertEqual(hll.cardinality(), hll2.cardinality())
+
+        sparse = HyperLogLog(10)
+        sparse.add_many(['a', 'b'])
+        hll3 = HyperLogLog.from_bytes(sparse.to_bytes(), concurrent=True)
+        self.assertFalse(hll3._get_meta()['is_sparse'])
+        self.assertEqual(hll3.cardinality(), 2)
+
+    def test_invalid_options(self):
+        for kwargs in ({'layout': 'u6'}, {'layout': 'u4'}, {'hip': True}):
+            with self.assertRaises(ValueError):
+                HyperLogLog(10, concurrent=True, **kwargs)
+
+        with self.assertRaises(ValueError):
+            HyperLogLog.from_bytes(HyperLogLog(10).to_bytes(), layout='u6', concurrent=True)
+
+class TestSparseRepresentation(unittest.TestCase):
+
+    def test_sparse_matches_dense(self):
+        for p in (4, 8, 12):
+            hll_a = HyperLogLog(p)
+            hll_b = HyperLogLog(p, sparse=False)
+
+            for i in range(randint(1, 2**p)):
+                hll_a.add(str(i))
+                hll_b.add(str(i))
+
+            for i in range(hll_a.size()):
+                self.assertEqual(hll_a.get_register(i), hll_b.get_register(i))
+
+            # Access the registers out of order
+            for i in reversed(range(hll_a.size())):
+                self.assertEqual(hll_a.get_register(i), hll_b.get_register(i))
+
+            self.assertEqual(hll_a._histogram(), hll_b._histogram())
+
+    def test_max_list_size_is_in_bytes(self):
+        hll = HyperLogLog(12, max_sparse_list_size=256, max_sparse_buffer_size=8)
+        i = 0
+
+        while hll._get_meta()['is_sparse']:
+            meta = hll._get_meta()
+            self.assertLess(meta['list_bytes'], 256)
+            self.assertLessEqual(meta['list_size'], meta['list_bytes'] // 2)
+            hll.add(str(i))
+            i += 1
+
+        self.assertGreater(i, 64)
+
+    def test_repeated_elements_are_combined_in_buffer(self):
+        hll = HyperLogLog(12, max_sparse_buffer_size=100)
+
+        for i in range(1000):
+            hll.add('hot key')
+            hll.add('other hot key')
+
+        self.assertEqual(hll._get_meta()['buffer_size'], 2)
+
+    def test_large_buffer_flush(self):
+        for p in (8, 16, 20):
+            hll_a = HyperLogLog(p, max_sparse_buffer_size=10**5)
+            hll_b = HyperLogLog(p, sparse=False)
+            data = [str(randint(0, 10**6)) for _ in range(20000)]
+            hll_a.add_many(data)
+            hll_b.add_many(data)
+            self.assertEqual(hll_a.cardinality(), hll_b.cardinality())
+            self.assertEqual(hll_a._histogram(), hll_b._histogram())
+
+    def test_cardinality_does_not_flush_buffer(self):
+        for hip in (False, True):
+            hll_a = HyperLogLog(14, max_sparse_buffer_size=1000, hip=hip)
+            hll_b = HyperLogLog(14, sparse=False, hip=hip)
+
+            for i in range(600):
+                hll_a.add(str(i))
+                hll_b.add(str(i))
+
+                if i % 50 == 0:
+                    buffered = hll_a._get_meta()['buffer_size']
+                    self.assertEqual(hll_a.cardinality(), hll_b.cardinality())
+                    self.assertEqual(hll_a._histogram(), hll_b._histogram())
+                    self.assertEqual(hll_a._get_meta()['buffer_size'], buffered)
+
+            self.assertGreater(hll_a._get_meta()['buffer_size'], 0)
+
+    def test_sparse_uses_less_memory_than_dense(self):
+        hll = HyperLogLog(14)
+        dense_bytes = 2**14 * 6 // 8 + 1
+        meta = hll._get_meta()
+        self.assertLessEqual(meta['max_list_size'] + 16 * meta['max_buffer_size'], dense_bytes)
+
+
 class TestMerging(unittest.TestCase):
 
-    def test_only_same_size_can_be_merged(self):
-        with self.assertRaises(Exception):
+    def test_larger_hyperloglog_is_folded(self):
+        small = HyperLogLog(4)
+        small.merge(HyperLogLog(5))
+        self.assertEqual(small.size(), 2**4)
+
+    def test_smaller_hyperloglog_cannot_be_merged(self):
+        large = HyperLogLog(5)
+        large.add('hello')
+        registers = large.get_registers()
+
+        with self.assertRaises(ValueError):
+            large.merge(HyperLogLog(4))
+
+        self.assertEqual(large.size(), 2**5)
+        self.assertEqual(large.get_registers(), registers)
+
+    def test_only_same_hash_can_be_merged(self):
+        with self.assertRaises(ValueError):
             hll = HyperLogLog(4)
-            hll.merge(HyperLogLog(5))
+            hll.merge(HyperLogLog(5, hash='xxh3'))
 
     def test_sparse_x_dense_merge(self):
         k = 8
@@ -142,6 +671,372 @@ class TestMerging(unittest.TestCase):
             self.assertEqual(max_fsb, hll_c.get_register(i))
 
 
+    def test_dense_x_dense_merge_all_register_values(self):
+        for p in range(2, 13):
+            m = 2**p
+            hll_a = HyperLogLog(p, sparse=False)
+            hll_b = HyperLogLog(p, sparse=False)
+            regs_a = [randint(0, 64 - p) for _ in range(m)]
+            regs_b = [randint(0, 64 - p) for _ in range(m)]
+
+            hll_a.add_hashes(array('Q', [i << (64 - p) | 1 << (64 - p - v) for i, v in enumerate(regs_a) if v]))
+            hll_b.add_hashes(array('Q', [i << (64 - p) | 1 << (64 - p - v) for i, v in enumerate(regs_b) if v]))
+            hll_a.merge(hll_b)
+
+            expected = [max(a, b) for a, b in zip(regs_a, regs_b)]
+            self.assertEqual([hll_a.get_register(i) for i in range(m)], expected)
+            self.assertEqual(hll_a._histogram(), [expected.count(v) for v in range(65)])
+
+
+class TestFolding(unittest.TestCase):
+
+    def registers(self, hll):
+        return [hll.get_register(i) for i in range(hll.size())]
+
+    def test_folded_registers_equal_lower_precision_registers(self):
+        for hash in ('murmur64a', 'xxh3', 'wyhash'):
+            for layout in ('u6', 'u8', 'u4'):
+                for n in (50, 20000):
+                    hll = HyperLogLog(14, hash=hash, layout=layout)
+                    expected = HyperLogLog(10, hash=hash, layout=layout)
+                    hll.add_many([str(i) for i in range(n)])
+                    expected.add_many([str(i) for i in range(n)])
+
+                    folded = hll.reduce_precision(10)
+                    self.assertEqual(folded.size(), 2**10)
+                    self.assertEqual(self.registers(folded), self.registers(expected))
+                    self.assertEqual(folded._histogram(), expected._histogram())
+                    self.assertEqual(folded.cardinality(), expected.cardinality())
+                    self.assertEqual(folded._get_meta()['is_sparse'], hll._get_meta()['is_sparse'])
+                    self.assertEqual(hll.size(), 2**14)
+
+    def test_fold_in_place(self):
+        hll = HyperLogLog(16, sparse=False)
+        expected = HyperLogLog(14, sparse=False)
+        hll.add_many([str(i) for i in range(100000)])
+        expected.add_many([str(i) for i in range(100000)])
+
+        hll.fold(14)
+        self.assertEqual(hll.size(), 2**14)
+        self.assertEqual(hll.to_bytes(), expected.to_bytes())
+
+        hll.fold(14)
+        self.assertEqual(hll.to_bytes(), expected.to_bytes())
+
+    def test_fold_redis_hyperloglog(self):
+        hll = HyperLogLog.from_redis_bytes(TestRedisEncoding.SPARSE_HEADER + b'\x7f\xff')
+        hll.add_many([str(i) for i in range(5000)])
+        hll.fold(10)
+
+        expected = [0] * 2**10
+        for i in range(5000):
+            hash = hll.hash(str(i))
+            rest = (hash >> 10) | (1 << 54)
+            expected[hash & (2**10 - 1)] = max(expected[hash & (2**10 - 1)], (rest & -rest).bit_length())
+
+        self.assertEqual(self.registers(hll), expected)
+
+    def test_merge_folds_larger_hyperloglog(self):
+        old = HyperLogLog(12)
+        new = HyperLogLog(14)
+        expected = HyperLogLog(12)
+        old.add_many([str(i) for i in range(10000)])
+        new.add_many([str(i) for i in range(5000, 20000)])
+        expected.add_many([str(i) for i in range(20000)])
+
+        merged = HyperLogLog.from_bytes(new.to_bytes())
+        with self.assertRaises(ValueError):
+            merged.merge(old)
+        merged.fold(12)
+        merged.merge(old)
+        old.merge(new)
+
+        for hll in (merged, old):
+            self.assertEqual(hll.size(), 2**12)
+            self.assertEqual(self.registers(hll), self.registers(expected))
+        self.assertEqual(new.size(), 2**14)
+
+    def test_union_folds_to_smallest(self):
+        hlls = [HyperLogLog(p) for p in (14, 10, 12)]
+        expected = HyperLogLog(10)
+        for i, hll in enumerate(hlls):
+            hll.add_many([str(x) for x in range(i * 1000, i * 1000 + 5000)])
+        expected.add_many([str(x) for x in range(7000)])
+
+        union = HyperLogLog.union(*hlls)
+        self.assertEqual(union.size(), 2**10)
+        self.assertEqual(self.registers(union), self.registers(expected))
+        self.assertEqual(HyperLogLog.union_cardinality(*hlls), expected.cardinality())
+        self.assertEqual([hll.size() for hll in hlls], [2**14, 2**10, 2**12])
+
+    def test_joint_estimators_fold_to_smallest(self):
+        A = HyperLogLog(14)
+        B = HyperLogLog(10)
+        A.add_many([str(i) for i in range(6000)])
+        B.add_many([str(i) for i in range(3000, 9000)])
+
+        folded = A.reduce_precision(10)
+        self.assertEqual(A.intersection_cardinality(B), folded.intersection_cardinality(B))
+        self.assertEqual(B.intersection_cardinality(A), B.intersection_cardinality(folded))
+        self.assertEqual(A.jaccard(B), folded.jaccard(B))
+        self.assertEqual(A.size(), 2**14)
+
+    def test_fold_keeps_settings(self):
+        hll = HyperLogLog(12, seed=7, layout='u8', concurrent=True)
+        hll.add_many([str(i) for i in range(1000)])
+        hll.fold(8)
+
+        meta = hll._get_meta()
+        self.assertEqual(hll.seed(), 7)
+        self.assertEqual(meta['layout'], 'u8')
+        self.assertTrue(meta['concurrent'])
+        self.assertEqual(meta['added'], 1000)
+
+    def test_invalid_precision(self):
+        hll = HyperLogLog(10)
+
+        for p in (1, 11):
+            with self.assertRaises(ValueError):
+                hll.fold(p)
+            with self.assertRaises(ValueError):
+                hll.reduce_precision(p)
+
+
+class TestRegisterBuffer(unittest.TestCase):
+
+    def test_registers_match_get_register(self):
+        for kwargs in ({}, {'sparse': False}, {'layout': 'u8'}, {'layout': 'u4'},
+                       {'layout': 'u8', 'concurrent': True}):
+            hll = HyperLogLog(10, **kwargs)
+            hll.add_many([str(i) for i in range(3000)])
+            expected = [hll.get_register(i) for i in range(hll.size())]
+
+            view = hll.registers_view()
+            self.assertTrue(view.readonly)
+            self.assertEqual(view.format, 'B')
+            self.assertEqual(view.tolist(), expected)
+            self.assertEqual(list(memoryview(hll)), expected)
+            self.assertEqual(list(hll.get_registers()), expected)
+
+            out = array('B', bytes(hll.size()))
+            self.assertIs(hll.get_registers(out), out)
+            self.assertEqual(list(out), expected)
+
+    def test_u8_view_is_not_a_copy(self):
+        hll = HyperLogLog(10, sparse=False, layout='u8')
+        view = hll.registers_view()
+        hll.add('hello')
+        self.assertEqual(view.tolist(), [hll.get_register(i) for i in range(hll.size())])
+        self.assertGreater(sum(view), 0)
+
+    def test_cannot_fold_while_exported(self):
+        hll = HyperLogLog(10, layout='u8')
+        view = hll.registers_view()
+
+        with self.assertRaises(BufferError):
+            hll.fold(8)
+
+        view.release()
+        hll.fold(8)
+        self.assertEqual(hll.size(), 2**8)
+
+    def test_invalid_output_buffer(self):
+        hll = HyperLogLog(10)
+
+        with self.assertRaises(ValueError):
+            hll.get_registers(bytearray(10))
+        with self.assertRaises(ValueError):
+            hll.get_registers(array('H', bytes(2 * hll.size())))
+        with self.assertRaises(BufferError):
+            hll.get_registers(bytes(hll.size()))
+
+
+class TestUnion(unittest.TestCase):
+
+    def sketches(self, p, n, sparse):
+        hlls = []
+        for i in range(n):
+            hll = HyperLogLog(p, 5, sparse=sparse[i % len(sparse)])
+            hll.add_many([str(j) for j in range(i * 50, i * 50 + randint(1, 500))])
+            hlls.append(hll)
+        return hlls
+
+    def merged(self, hlls):
+        hll = HyperLogLog(hlls[0].size().bit_length() - 1, 5, sparse=False)
+        for other in hlls:
+            hll.merge(other)
+        return hll
+
+    def test_union_matches_merge(self):
+        for sparse in ([True], [False], [True, False]):
+            hlls = self.sketches(10, 20, sparse)
+            expected = self.merged(hlls)
+            union = HyperLogLog.union(*hlls)
+
+            self.assertEqual(union.seed(), 5)
+            self.assertEqual(union._histogram(), expected._histogram())
+            self.assertEqual(union.cardinality(), expected.cardinality())
+
+            for i in range(union.size()):
+                self.assertEqual(union.get_register(i), expected.get_register(i))
+
+    def test_union_cardinality_matches_merge(self):
+        for sparse in ([True], [False], [True, False]):
+            hlls = self.sketches(12, 50, sparse)
+            self.assertEqual(HyperLogLog.union_cardinality(*hlls), self.merged(hlls).cardinality())
+
+    def test_inputs_are_unchanged(self):
+        hlls = self.sketches(8, 5, [True, False])
+        before = [hll.to_bytes() for hll in hlls]
+        HyperLogLog.union(*hlls)
+        HyperLogLog.union_cardinality(*hlls)
+        self.assertEqual(before, [hll.to_bytes() for hll in hlls])
+
+    def test_single_sketch(self):
+        hll = self.sketches(8, 1, [True])[0]
+        self.assertEqual(HyperLogLog.union_cardinality(hll), hll.cardinality())
+        self.assertEqual(HyperLogLog.union(hll).cardinality(), hll.cardinality())
+
+    def test_invalid_arguments(self):
+        with self.assertRaises(TypeError):
+            HyperLogLog.union()
+
+        with self.assertRaises(TypeError):
+            HyperLogLog.union_cardinality(HyperLogLog(4), 'not a HyperLogLog')
+
+        with self.assertRaises(ValueError):
+            HyperLogLog.union_cardinality(HyperLogLog(4), HyperLogLog(5, hash='xxh3'))
+
+class TestJointEstimation(unittest.TestCase):
+
+    def sketches(self, a, b, x, p=12, sparse=(False, False)):
+        A = HyperLogLog(p, sparse=sparse[0])
+        B = HyperLogLog(p, sparse=sparse[1])
+        A.add_many(['a%d' % i for i in range(a)] + ['x%d' % i for i in range(x)])
+        B.add_many(['b%d' % i for i in range(b)] + ['x%d' % i for i in range(x)])
+        return A, B
+
+    def test_intersection_cardinality(self):
+        for a, b, x in ((10000, 10000, 10000), (50000, 5000, 2000), (0, 1000, 3000)):
+            A, B = self.sketches(a, b, x)
+            self.assertAlmostEqual(A.intersection_cardinality(B), x, delta=0.1 * x)
+            self.assertAlmostEqual(A.jaccard(B), x / (a + b + x), delta=0.05)
+
+    def test_identical_sketches(self):
+        A, _ = self.sketches(5000, 0, 0)
+        self.assertAlmostEqual(A.intersection_cardinality(A), A.cardinality(), delta=50)
+        self.assertAlmostEqual(A.jaccard(A), 1.0, delta=0.01)
+
+    def test_disjoint_sketches(self):
+        A, B = self.sketches(20000, 20000, 0)
+        self.assertLess(A.intersection_cardinality(B), 400)
+        self.assertLess(A.jaccard(B), 0.01)
+
+    def test_empty_sketches(self):
+        A, B = self.sketches(0, 0, 0)
+        self.assertEqual(A.intersection_cardinality(B), 0)
+        self.assertEqual(A.jaccard(B), 0.0)
+
+    def test_symmetric(self):
+        A, B = self.sketches(3000, 1000, 500)
+        self.assertAlmostEqual(A.intersection_cardinality(B), B.intersection_cardinality(A), delta=1)
+
+    def test_sparse_matches_dense(self):
+        for sparse in ((True, True), (True, False), (False, True)):
+            A, B = self.sketches(300, 200, 100, sparse=sparse)
+            A2, B2 = self.sketches(300, 200, 100)
+            self.assertEqual(A.intersection_cardinality(B), A2.intersection_cardinality(B2))
+            self.assertEqual(A.jaccard(B), A2.jaccard(B2))
+
+    def test_invalid_arguments(self):
+        with self.assertRaises(TypeError):
+            HyperLogLog(4).jaccard('not a HyperLogLog')
+
+        with self.assertRaises(ValueError):
+            HyperLogLog(4).intersection_cardinality(HyperLogLog(5, hash='xxh3'))
+
+class TestHipEstimator(unittest.TestCase):
+
+    def test_estimate(self):
+        for n in (10, 1000, 100000):
+            hll = HyperLogLog(12, hip=True)
+            hll.add_many([str(i) for i in range(n)])
+            self.assertTrue(hll._get_meta()['hip'])
+            self.assertAlmostEqual(hll.cardinality(), n, delta=max(2, 0.05 * n))
+
+    def test_sparse_matches_dense(self):
+        for p in (6, 10, 14):
+            data = [str(randint(0, 10000)) for _ in range(20000)]
+            hll_a = HyperLogLog(p, hip=True)
+            hll_b = HyperLogLog(p, hip=True, max_sparse_buffer_size=5)
+            hll_c = HyperLogLog(p, hip=True, sparse=False)
+
+            for i, x in enumerate(data):
+                hll_a.add(x)
+                hll_b.add(x)
+                hll_c.add(x)
+
+                if i % 1000 == 0:
+                    self.assertEqual(hll_a.cardinality(), hll_c.cardinality())
+                    self.assertEqual(hll_b.cardinality(), hll_c.cardinality())
+
+            self.assertEqual(hll_a.cardinality(), hll_c.cardinality())
+            self.assertEqual(hll_b.cardinality(), hll_c.cardinality())
+
+    def test_threads_are_ignored(self):
+        data = [str(i) for i in range(50000)]
+        hll_a = HyperLogLog(10, hip=True)
+        hll_b = HyperLogLog(10, hip=True)
+        hll_a.add_many(data)
+        hll_b.add_many(data, threads=4)
+        self.assertEqual(hll_a.cardinality(), hll_b.cardinality())
+
+    def test_merge_uses_standard_estimator(self):
+        hll_a = HyperLogLog(10, hip=True)
+        hll_b = HyperLogLog(10)
+        hll_a.add_many([str(i) for i in range(5000)])
+        hll_b.add_many([str(i) for i in range(5000)])
+        hll_a.merge(HyperLogLog(10))
+
+        self.assertFalse(hll_a._get_meta()['hip'])
+        self.assertEqual(hll_a.cardinality(), hll_b.cardinality())
+
+    def test_serialization_keeps_estimate(self):
+        for kwargs in ({}, {'sparse': False}, {'layout': 'u4'}):
+            hll = HyperLogLog(10, hip=True, **kwargs)
+            hll.add_many([str(i) for i in range(3000)])
+            expected = HyperLogLog(10, hip=True, **kwargs)
+            expected.add_many([str(i) for i in range(3100)])
+
+            for copy in (HyperLogLog.from_bytes(hll.to_bytes(), layout=kwargs.get('layout', 'u6')),
+                         pickle.loads(pickle.dumps(hll))):
+                self.assertTrue(copy._get_meta()['hip'])
+                self.assertEqual(copy.cardinality(), hll.cardinality())
+
+                # The estimate continues to be updated in arrival order
+                copy.add_many([str(i) for i in range(3000, 3100)])
+                self.assertEqual(copy.cardinality(), expected.cardinality())
+
+    def test_serialization_keeps_standard_estimator_after_merge(self):
+        hll = HyperLogLog(10, hip=True)
+        hll.add_many([str(i) for i in range(3000)])
+        hll.merge(HyperLogLog(10))
+        copy = HyperLogLog.from_bytes(hll.to_bytes())
+
+        self.assertFalse(copy._get_meta()['hip'])
+        self.assertEqual(copy.cardinality(), hll.cardinality())
+        self.assertEqual(len(copy.to_bytes()), len(hll.to_bytes()))
+
+    def test_concurrent_copy_uses_standard_estimator(self):
+        hll = HyperLogLog(10, hip=True)
+        hll.add_many([str(i) for i in range(3000)])
+        standard = HyperLogLog(10)
+        standard.add_many([str(i) for i in range(3000)])
+        copy = HyperLogLog.from_bytes(hll.to_bytes(), concurrent=True)
+
+        self.assertFalse(copy._get_meta()['hip'])
+        self.assertEqual(copy.cardinality(), standard.cardinality())
+
 class TestPickling(unittest.TestCase):
 
     def setUp(self):
@@ -278,5 +1173,582 @@ class TestPickling(unittest.TestCase):
             hll2 = pickle.loads(pickle.dumps(hll))
             self.assertEqual(hll.size(), hll2.size())
 
+class TestBinarySerialization(unittest.TestCase):
+
+    def assertSameHyperLogLog(self, hll, hll2):
+        self.assertEqual(hll.size(), hll2.size())
+        self.assertEqual(hll.seed(), hll2.seed())
+        self.assertEqual(hll._histogram(), hll2._histogram())
+        self.assertEqual(hll.cardinality(), hll2.cardinality())
+        self.assertEqual(hll._get_meta()['is_sparse'], hll2._get_meta()['is_sparse'])
+
+        for i in range(hll.size()):
+            self.assertEqual(hll.get_register(i), hll2.get_register(i))
+
+    def test_round_trip(self):
+        for sparse in (True, False):
+            for p in (4, 10, 14):
+                hll = HyperLogLog(p, randint(1, 10**6), sparse=sparse)
+                hll.add_many([str(i) for i in range(randint(0, 2**p))])
+                hll2 = HyperLogLog.from_bytes(hll.to_bytes())
+                self.assertSameHyperLogLog(hll, hll2)
+
+    def test_from_bytes_accepts_buffers(self):
+        hll = HyperLogLog(8)
+        hll.add_many(['a', 'b', 'c'])
+        data = hll.to_bytes()
+
+        for buf in (bytearray(data), memoryview(data)):
+            self.assertSameHyperLogLog(hll, HyperLogLog.from_bytes(buf))
+
+    def test_dense_registers_are_stored_packed(self):
+        hll = HyperLogLog(12, sparse=False)
+        self.assertEqual(len(hll.to_bytes()), 32 + 2**12 * 6 // 8 + 1)
+
+    def test_pickle_protocol_5_out_of_band(self):
+        hll = HyperLogLog(12, sparse=False)
+        hll.add_many([str(i) for i in range(1000)])
+        buffers = []
+        data = pickle.dumps(hll, protocol=5, buffer_callback=buffers.append)
+
+        self.assertEqual(len(buffers), 1)
+        self.assertLess(len(data), 200)
+        self.assertSameHyperLogLog(hll, pickle.loads(data, buffers=buffers))
+
+    def test_legacy_pickles_can_be_loaded(self):
+        for sparse in (True, False):
+            hll = HyperLogLog(8, 7, sparse=sparse)
+            hll.add_many([str(i) for i in range(100)])
+            cls, args, state = hll.__reduce__()
+            hll2 = cls(*args)
+            hll2.__setstate__(state)
+            self.assertSameHyperLogLog(hll, hll2)
+
+    def test_invalid_bytes(self):
+        hll = HyperLogLog(8, sparse=False)
+        data = hll.to_bytes()
+
+        for bad in (b'', b'HLLB', b'XXXX' + data[4:], data[:-1], data + b'\x00'):
+            with self.assertRaises(ValueError):
+                HyperLogLog.from_bytes(bad)
+
+        hll = HyperLogLog(8)
+        hll.add_many(['a', 'b', 'c'])
+        data = hll.to_bytes()
+
+        for bad in (data[:-1], data[:-2], data[:24] + b'\x09' + data[25:]):
+            with self.assertRaises(ValueError):
+                HyperLogLog.from_bytes(bad)
+
+        hll = HyperLogLog(8, hip=True)
+        data = hll.to_bytes()
+
+        for bad in (data[:6] + b'\x04' + data[7:], data[:6] + b'\x08' + data[7:], data[:40]):
+            with self.assertRaises(ValueError):
+                HyperLogLog.from_bytes(bad)
+
+    def test_sparse_register_values_are_bounded(self):
+        for p in (4, 8, 14):
+            hll = HyperLogLog(p)
+            hll.add('a')
+            data = hll.to_bytes()  # The last byte is the value of the last register
+
+            hll2 = HyperLogLog.from_bytes(data[:-1] + bytes([64 - p + 1]))
+            self.assertEqual(max(hll2.get_registers()), 64 - p + 1)
+
+            with self.assertRaises(ValueError):
+                HyperLogLog.from_bytes(data[:-1] + bytes([64 - p + 2]))
+
+    def test_dense_register_values_are_bounded(self):
+        for p in (4, 8, 14):
+            sparse = HyperLogLog(p)
+            sparse.add('a')
+            data = sparse.to_bytes()
+            dense = HyperLogLog(p, sparse=False)
+            dense.merge(HyperLogLog.from_bytes(data[:-1] + bytes([64 - p + 1])))
+            data = dense.to_bytes()
+
+            for layout in ('u4', 'u6', 'u8'):
+                hll = HyperLogLog.from_bytes(data, layout=layout)
+                self.assertEqual(max(hll.get_registers()), 64 - p + 1)
+
+            data = data[:32] + b'\xff' * (len(data) - 32)  # Every register is 63
+
+            for layout in ('u4', 'u6', 'u8'):
+                with self.assertRaises(ValueError):
+                    HyperLogLog.from_bytes(data, layout=layout)
+
+HLLCOUNT = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'build', 'hllcount')
+
+@unittest.skipUnless(os.path.exists(HLLCOUNT), 'run "make hllcount" to build hllcount')
+class TestHllcount(unittest.TestCase):
+
+    def hllcount(self, *args, stdin=b''):
+        return subprocess.run([HLLCOUNT] + list(args), input=stdin, stdout=subprocess.PIPE, check=True).stdout
+
+    def test_counts_lines_like_add(self):
+        lines = [str(i) for i in range(5000)] * 2
+        hll = HyperLogLog(14)
+        hll.add_many(lines)
+        out = self.hllcount(stdin='\n'.join(lines).encode())
+        self.assertEqual(int(out), hll.cardinality())
+
+    def test_long_lines_are_one_element(self):
+        lines = ['a' * (3 << 20), 'b' * (3 << 20), 'a' * (3 << 20)]
+        hll = HyperLogLog(14)
+        hll.add_many(lines)
+        out = self.hllcount(stdin='\n'.join(lines).encode())
+        self.assertEqual(int(out), hll.cardinality())
+        self.assertEqual(int(out), 2)
+
+    def test_sketches_are_compatible(self):
+        with tempfile.TemporaryDirectory() as d:
+            path = os.path.join(d, 'a.hll')
+            self.hllcount('-p', '12', '-H', 'xxh3', '-o', path, stdin=b'a\nb\nc\n')
+
+            with open(path, 'rb') as f:
+                hll = HyperLogLog.from_bytes(f.read())
+
+            expected = HyperLogLog(12, hash='xxh3', sparse=False)
+            expected.add_many(['a', 'b', 'c'])
+            self.assertEqual(hll.to_bytes(), expected.to_bytes())
+
+            sparse = HyperLogLog(12, hash='xxh3')
+            sparse.add_many(['c', 'd'])
+            path2 = os.path.join(d, 'b.hll')
+            with open(path2, 'wb') as f:
+                f.write(sparse.to_bytes())
+
+            self.assertEqual(int(self.hllcount('-m', path, '-m', path2)), 4)
+
+class TestRedisEncoding(unittest.TestCase):
+
+    HEADER = b'HYLL\x00\x00\x00\x00' + bytes(8)
+    SPARSE_HEADER = b'HYLL\x01\x00\x00\x00' + bytes(8)
+
+    def redis_dense(self, registers):
+        bits = 0
+        for i, value in enumerate(registers):
+            bits |= value << (6 * i)
+        return self.HEADER + bits.to_bytes(2**14 * 6 // 8, 'little')
+
+    def redis_rank(self, hash):
+        """
+        Register index and value Redis selects for a hash.
+        """
+        index = hash & (2**14 - 1)
+        rest = (hash >> 14) | (1 << 50)
+        return index, (rest & -rest).bit_length()
+
+    def test_empty(self):
+        hll = HyperLogLog.from_redis_bytes(self.SPARSE_HEADER + b'\x7f\xff')
+        self.assertEqual(hll.size(), 2**14)
+        self.assertEqual(hll.seed(), 0xadc83b19)
+        self.assertEqual(hll.cardinality(), 0)
+
+    def test_decode_sparse(self):
+        # XZERO(100), VAL(3, 2), ZERO(1), VAL(32, 1), XZERO(16280)
+        data = self.SPARSE_HEADER + bytes([0x40, 99, 0x80 | (2 << 2) | 1, 0x00, 0xfc, 0x40 | (16279 >> 8), 16279 & 0xff])
+        hll = HyperLogLog.from_redis_bytes(data)
+        expected = [0] * 2**14
+        expected[100] = expected[101] = 3
+        expected[103] = 32
+
+        self.assertEqual([hll.get_register(i) for i in range(2**14)], expected)
+        self.assertEqual(hll._histogram()[3], 2)
+        self.assertEqual(hll._histogram()[32], 1)
+
+    def test_decode_dense(self):
+        registers = [randint(0, 51) for _ in range(2**14)]
+        hll = HyperLogLog.from_redis_bytes(self.redis_dense(registers))
+        self.assertEqual([hll.get_register(i) for i in range(2**14)], registers)
+        self.assertEqual(sum(hll._histogram()), 2**14)
+
+    def test_round_trip(self):
+        sparse = HyperLogLog.from_redis_bytes(self.SPARSE_HEADER + b'\x7f\xff')
+        sparse.add_many([str(i) for i in range(100)])
+        self.assertEqual(sparse.to_redis_bytes()[4], 1)
+
+        dense = HyperLogLog.from_redis_bytes(self.redis_dense([0] * 2**14))
+        dense.add_many([str(i) for i in range(100000)])
+        self.assertEqual(dense.to_redis_bytes()[4], 0)
+        self.assertEqual(dense.to_redis_bytes()[16:], self.redis_dense([dense.get_register(i) for i in range(2**14)])[16:])
+
+        for hll in (sparse, dense):
+            hll2 = HyperLogLog.from_redis_bytes(hll.to_redis_bytes())
+            self.assertEqual(hll.cardinality(), hll2.cardinality())
+            self.assertEqual(hll._histogram(), hll2._histogram())
+
+    def test_elements_select_registers_like_redis(self):
+        hll = HyperLogLog.from_redis_bytes(self.SPARSE_HEADER + b'\x7f\xff')
+
+        for i in range(1000):
+            hll.add(str(i))
+
+        expected = [0] * 2**14
+        for i in range(1000):
+            index, rank = self.redis_rank(hll.hash(str(i)))
+            expected[index] = max(expected[index], rank)
+
+        self.assertEqual([hll.get_register(i) for i in range(2**14)], expected)
+
+    def test_redis_and_native_hyperloglogs_cannot_be_merged(self):
+        redis = HyperLogLog.from_redis_bytes(self.SPARSE_HEADER + b'\x7f\xff')
+        native = HyperLogLog(14)
+
+        with self.assertRaises(ValueError):
+            redis.merge(native)
+
+        with self.assertRaises(ValueError):
+            native.to_redis_bytes()
+
+    def test_hash_function_is_serialized(self):
+        redis = HyperLogLog.from_redis_bytes(self.SPARSE_HEADER + b'\x7f\xff')
+        redis.add('a')
+        redis2 = pickle.loads(pickle.dumps(redis))
+        redis2.add('b')
+        redis.add('b')
+        self.assertEqual(redis.to_redis_bytes(), redis2.to_redis_bytes())
+
+    def test_invalid_bytes(self):
+        for bad in (b'', b'HYLL', self.SPARSE_HEADER, self.SPARSE_HEADER + b'\x7f',
+                    self.SPARSE_HEADER + b'\x7f\xff\x00', self.HEADER + bytes(100),
+                    b'HYLL\x02' + bytes(11) + b'\x7f\xff'):
+            with self.assertRaises(ValueError):
+                HyperLogLog.from_redis_bytes(bad)
+
+@unittest.skipIf(sys.platform == 'win32', 'memory-mapped HyperLogLogs require POSIX')
+class TestMemoryMapped(unittest.TestCase):
+
+    def setUp(self):
+        self.dir = tempfile.TemporaryDirectory()
+        self.path = os.path.join(self.dir.name, 'sketch.hll')
+
+    def tearDown(self):
+        self.dir.cleanup()
+
+    def test_matches_in_memory_hyperloglog(self):
+        data = [str(i) for i in range(20000)]
+        hll = HyperLogLog.open(self.path, 12, seed=7, create=True)
+        hll2 = HyperLogLog(12, 7, sparse=False)
+        hll.add_many(data)
+        hll2.add_many(data)
+
+        self.assertTrue(hll._get_meta()['is_mapped'])
+        self.assertEqual(hll.cardinality(), hll2.cardinality())
+        self.assertEqual(hll._histogram(), hll2._histogram())
+        self.assertEqual(hll.to_bytes(), hll2.to_bytes())
+
+    def test_reopen(self):
+        hll = HyperLogLog.open(self.path, 10, seed=3, create=True)
+        hll.add_many([str(i) for i in range(1000)])
+        hll.flush()
+        expected = hll.cardinality()
+        del hll
+
+        hll = HyperLogLog.open(self.path)
+        self.assertEqual(hll.size(), 2**10)
+        self.assertEqual(hll.seed(), 3)
+        self.assertEqual(hll.cardinality(), expected)
+        self.assertEqual(hll._get_meta()['added'], 1000)
+        self.assertEqual(sum(hll._histogram()), 2**10)
+
+    def test_updates_are_visible_to_other_readers(self):
+        writer = HyperLogLog.open(self.path, 10, create=True)
+        reader = HyperLogLog.open(self.path, readonly=True)
+        self.assertEqual(reader.cardinality(), 0)
+
+        writer.add_many([str(i) for i in range(100)])
+        self.assertEqual(reader.cardinality(), writer.cardinality())
+
+        del writer, reader
+        self.assertEqual(HyperLogLog.open(self.path)._get_meta()['added'], 100)
+
+    def test_merge_into_mapped(self):
+        hll = HyperLogLog.open(self.path, 8, create=True)
+        other = HyperLogLog(8)
+        other.add_many(['a', 'b', 'c'])
+        hll.merge(other)
+        self.assertEqual(hll.cardinality(), 3)
+
+    def test_mismatched_parameters(self):
+        HyperLogLog.open(self.path, 8, seed=1, create=True)
+
+        with self.assertRaises(ValueError):
+            HyperLogLog.open(self.path, 9)
+
+        with self.assertRaises(ValueError):
+            HyperLogLog.open(self.path, seed=2)
+
+    def test_invalid_file(self):
+        with open(self.path, 'wb') as f:
+            f.write(b'not a HyperLogLog file' * 100)
+
+        with self.assertRaises(ValueError):
+            HyperLogLog.open(self.path)
+
+    def test_missing_file_is_not_created(self):
+        with self.assertRaises(FileNotFoundError):
+            HyperLogLog.open(self.path, 10)
+
+        self.assertFalse(os.path.exists(self.path))
+
+        with self.assertRaises(ValueError):
+            HyperLogLog.open(self.path, 10, readonly=True, create=True)
+
+    def test_readonly(self):
+        hll = HyperLogLog.open(self.path, 10, create=True)
+        hll.add_many([str(i) for i in range(1000)])
+        expected = hll.cardinality()
+        del hll
+        os.chmod(self.path, 0o444)
+
+        hll = HyperLogLog.open(self.path, readonly=True)
+        self.assertEqual(hll.cardinality(), expected)
+        self.assertEqual(sum(hll._histogram()), 2**10)
+
+        with self.assertRaises(TypeError):
+            hll.add('a')
+
+        with self.assertRaises(TypeError):
+            hll.add_many(['a'])
+
+        with self.assertRaises(TypeError):
+            hll.merge(HyperLogLog(10))
+
+        hll.flush()
+        del hll
+        self.assertEqual(HyperLogLog.open(self.path, readonly=True).cardinality(), expected)
+
+    def test_histogram_is_recounted(self):
+        hll = HyperLogLog.open(self.path, 10, create=True)
+        hll.add_many([str(i) for i in range(1000)])
+        expected = hll.cardinality()
+        del hll
+
+        with open(self.path, 'r+b') as f:
+            f.seek(32)
+            f.write(b'\xff' * 65 * 8)
+
+        self.assertEqual(HyperLogLog.open(self.path, readonly=True).cardinality(), expected)
+
+        hll = HyperLogLog.open(self.path)
+        self.assertEqual(hll.cardinality(), expected)
+        self.assertEqual(sum(hll._histogram()), 2**10)
+
+    def test_register_values_are_bounded(self):
+        HyperLogLog.open(self.path, 10, create=True)
+
+        with open(self.path, 'r+b') as f:
+            f.seek(32 + 65*8)
+            f.write(b'\xff') # The first register is 63, above 64 - p + 1
+
+        with self.assertRaises(ValueError):
+            HyperLogLog.open(self.path)
+
+        with self.assertRaises(ValueError):
+            HyperLogLog.open(self.path, readonly=True)
+
+class TestHashFunctions(unittest.TestCase):
+
+    def test_known_hashes(self):
+        self.assertEqual(HyperLogLog(seed=0, hash='xxh3').hash('abc'), 8696274497037089104)
+
+        # Test vectors of wyhash final version 4, the seed is the position
+        vectors = ['', 'a', 'abc', 'message digest', 'abcdefghijklmnopqrstuvwxyz']
+        expected = [0x0409638ee2bde459, 0xa8412d091b5fe0a9, 0x32dd92e4b2915153, 0x8619124089a3a16b, 0x7a43afb61d7f5f40]
+
+        for seed, (vector, value) in enumerate(zip(vectors, expected)):
+            self.assertEqual(HyperLogLog(seed=seed, hash='wyhash').hash(vector), value)
+
+    def test_murmur_is_default(self):
+        hll = HyperLogLog()
+        self.assertEqual(hll._get_meta()['hash'], 'murmur64a')
+        self.assertEqual(hll.hash('abc'), HyperLogLog(hash='murmur64a').hash('abc'))
+
+    def test_estimates(self):
+        data = [str(i) for i in range(50000)]
+
+        for name in ('xxh3', 'wyhash'):
+            hll = HyperLogLog(14, hash=name)
+            threaded = HyperLogLog(14, hash=name)
+            hll.add_many(data)
+            threaded.add_many(data, threads=3)
+            self.assertLess(abs(hll.cardinality() - len(data)), 0.05*len(data))
+            self.assertEqual(hll.cardinality(), threaded.cardinality())
+
+    def test_serialization_keeps_hash(self):
+        for name in ('xxh3', 'wyhash'):
+            hll = HyperLogLog(10, hash=name)
+            hll.add('a')
+
+            for copy in (HyperLogLog.from_bytes(hll.to_bytes()), pickle.loads(pickle.dumps(hll))):
+                self.assertEqual(copy._get_meta()['hash'], name)
+                self.assertEqual(copy.hash('b'), hll.hash('b'))
+
+    def test_merge_requires_same_hash(self):
+        with self.assertRaises(ValueError):
+            HyperLogLog(10).merge(HyperLogLog(10, hash='xxh3'))
+
+        with self.assertRaises(ValueError):
+            HyperLogLog.union(HyperLogLog(10, hash='wyhash'), HyperLogLog(10, hash='xxh3'))
+
+    def test_invalid_hash(self):
+        with self.assertRaises(ValueError):
+            HyperLogLog(hash='md5')
+
+class TestHyperLogLogMap(unittest.TestCase):
+
+    def fill(self, p, n):
+        hll_map = HyperLogLogMap(p)
+        expected = {}
+
+        for i in range(n):
+            key = random.choice([b'bytes', 'str', 'stré', 7, -(2**40), 'key%d' % (i % 20)])
+            value = str(randint(0, 20000))
+            hll_map.add(key, value)
+            expected.setdefault(key, HyperLogLog(p)).add(value)
+
+        return hll_map, expected
+
+    def test_matches_hyperloglog(self):
+        for p in (2, 5, 12):
+            hll_map, expected = self.fill(p, 20000)
+            self.assertEqual(len(hll_map), len(expected))
+            self.assertEqual(list(hll_map), list(expected))
+
+            for key, hll in expected.items():
+                self.assertIn(key, hll_map)
+                self.assertEqual(hll_map.cardinality(key), hll.cardinality())
+
+                copy = hll_map.get(key)
+                self.assertEqual(copy._histogram(), hll._histogram())
+
+                for i in range(hll.size()):
+                    self.assertEqual(copy.get_register(i), hll.get_register(i))
+
+    def test_keys_are_promoted_to_dense(self):
+        hll_map = HyperLogLogMap(10)
+
+        for i in range(2000):
+            hll_map.add('big', str(i))
+            hll_map.add('small', str(i % 10))
+
+        self.assertEqual(hll_map._get_meta()['dense_keys'], 1)
+        self.assertEqual(hll_map.cardinality('small'), 10)
+
+    def test_merge(self):
+        map_a, expected_a = self.fill(11, 5000)
+        map_b, expected_b = self.fill(11, 5000)
+        map_b.add('only b', 'x')
+        map_a.merge(map_b)
+
+        for key in map_b:
+            expected = HyperLogLog(11)
+            for hll in (expected_a.get(key), expected_b.get(key)):
+                if hll is not None:
+                    expected.merge(hll)
+            if key == 'only b':
+                expected.add('x')
+            self.assertEqual(map_a.cardinality(key), expected.cardinality())
+
+        with self.assertRaises(ValueError):
+            map_a.merge(HyperLogLogMap(12))
+
+    def test_uninitialized_map(self):
+        hll_map = HyperLogLogMap.__new__(HyperLogLogMap)
+
+        with self.assertRaises(TypeError):
+            hll_map.add(b'k', 'v')
+        with self.assertRaises(TypeError):
+            hll_map.cardinality(b'k')
+        with self.assertRaises(TypeError):
+            b'k' in hll_map
+
+        self.assertEqual(len(hll_map), 0)
+
+    def test_missing_and_invalid_keys(self):
+        hll_map = HyperLogLogMap()
+        hll_map.add(1, 'a')
+
+        self.assertNotIn(2, hll_map)
+        self.assertNotIn(b'\x01', hll_map)
+
+        with self.assertRaises(KeyError):
+            hll_map.cardinality(2)
+
+        with self.assertRaises(TypeError):
+            hll_map.add(1.5, 'a')
+
+        with self.assertRaises(ValueError):
+            HyperLogLogMap(27)
+
+class TestSlidingWindow(unittest.TestCase):
+
+    def events(self, n):
+        # Timestamps are mostly increasing with some late arrivals
+        return [(i*0.05 + random.uniform(-3, 0), str(randint(0, 3000))) for i in range(n)]
+
+    def expected(self, p, events, window, now):
+        hll = HyperLogLog(p)
+        for timestamp, value in events:
+            if now - window < timestamp:
+                hll.add(value)
+        return hll.cardinality()
+
+    def test_matches_hyperloglog_of_window(self):
+        events = self.events(20000)
+        latest = max(timestamp for timestamp, _ in events)
+        hll = SlidingHyperLogLog(8, window=100)
+
+        for timestamp, value in events:
+            hll.add(value, timestamp=timestamp)
+
+        for window in (1, 10, 55.5, 100):
+            for now in (latest, latest + 20):
+                self.assertEqual(hll.cardinality(window=window, now=now), self.expected(8, events, window, now))
+
+        # Only a few values are kept per register
+        self.assertLess(hll._entries(), 4*hll.size())
+
+    def test_merge(self):
+        events = self.events(10000)
+        latest = max(timestamp for timestamp, _ in events)
+        hll_a = SlidingHyperLogLog(10, window=200)
+        hll_b = SlidingHyperLogLog(10, window=200)
+
+        for i, (timestamp, value) in enumerate(events):
+            (hll_a if i % 2 else hll_b).add(value, timestamp=timestamp)
+
+        hll_a.merge(hll_b)
+
+        for window in (5, 200):
+            self.assertEqual(hll_a.cardinality(window=window, now=latest), self.expected(10, events, window, latest))
+
+    def test_merge_requires_same_size_and_seed(self):
+        hll = SlidingHyperLogLog(10, window=60)
+        hll.add('a', timestamp=1)
+
+        for other in (SlidingHyperLogLog(11, window=60), SlidingHyperLogLog(10, window=60, seed=7)):
+            other.add('b', timestamp=1)
+            with self.assertRaises(ValueError):
+                hll.merge(other)
+
+        self.assertEqual(hll.cardinality(now=1), 1)
+
+    def test_current_time(self):
+        hll = SlidingHyperLogLog(window=60)
+        hll.add('a')
+        hll.add('b')
+        self.assertEqual(hll.cardinality(), 2)
+        self.assertEqual(hll.cardinality(window=1), 2)
+
+    def test_invalid_window(self):
+        with self.assertRaises(ValueError):
+            SlidingHyperLogLog(window=0)
+
+        with self.assertRaises(ValueError):
+            SlidingHyperLogLog(window=10).cardinality(window=11)
+
 if __name__ == '__main__':
     unittest.main()